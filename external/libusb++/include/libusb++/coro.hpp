@@ -0,0 +1,260 @@
+#pragma once
+
+// Coroutine support needs C++20, the header is empty for older standards so
+// it can be included unconditionally.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LIBUSBXX_COROUTINES 1
+
+#include "libusb++/libusb++.hpp"
+#include "libusb++/transfer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <gsl/span>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace usb {
+
+template <typename T = void> class task;
+
+namespace details {
+
+// continues with the coroutine awaiting the task, if any
+struct final_awaiter {
+  bool await_ready() noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    const auto continuation = h.promise().continuation;
+    return continuation ? continuation : std::noop_coroutine();
+  }
+  void await_resume() noexcept {}
+};
+
+struct task_promise_base {
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+};
+
+template <typename T> struct task_promise : task_promise_base {
+  task<T> get_return_object() noexcept;
+  void return_value(T v) { value.emplace(std::move(v)); }
+  T result() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+
+  std::optional<T> value;
+};
+
+template <> struct task_promise<void> : task_promise_base {
+  task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+  void result() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+} // namespace details
+
+/// Lazily started coroutine, runs when awaited
+///
+/// Coroutines are resumed from wherever the operation they wait for
+/// completes, for transfers that is the event handling of the context
+/// (see event_loop). Use spawn to start a task that nobody awaits.
+template <typename T> class [[nodiscard]] task {
+public:
+  using promise_type = details::task_promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  ~task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+    handle_.promise().continuation = h;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  friend promise_type;
+  explicit task(handle_type h) noexcept : handle_(h) {}
+
+  handle_type handle_;
+};
+
+namespace details {
+
+template <typename T> task<T> task_promise<T>::get_return_object() noexcept {
+  return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+  return task<void>{
+      std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+}
+
+struct detached {
+  struct promise_type {
+    detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+inline detached run_detached(task<void> t,
+                             std::function<void(std::exception_ptr)> done) {
+  std::exception_ptr error;
+  try {
+    co_await std::move(t);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  if (done)
+    done(error);
+}
+
+} // namespace details
+
+/// Start t right away, it runs until its first suspension before spawn
+/// returns. done is called with the exception t exited with (if any).
+inline void spawn(task<void> t,
+                  std::function<void(std::exception_ptr)> done = {}) {
+  details::run_detached(std::move(t), std::move(done));
+}
+
+/// Awaitable asynchronous transfer, returns the number of bytes transferred
+///
+/// The transfer lives in the frame of the awaiting coroutine, destroying a
+/// suspended coroutine cancels it.
+class transfer_awaitable {
+public:
+  using submit_fn = std::function<void(transfer &)>;
+
+  explicit transfer_awaitable(submit_fn submit) : submit_(std::move(submit)) {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    // the coroutine may destroy the transfer and thereby this callback
+    transfer_.set_callback(
+        [h](transfer &) { std::coroutine_handle<>{h}.resume(); });
+    submit_(transfer_);
+  }
+  int await_resume() {
+    if (transfer_.status() != transfer_status::completed)
+      throw usb_error(to_error(transfer_.status()));
+    return transfer_.actual_length();
+  }
+
+private:
+  submit_fn submit_;
+  transfer transfer_;
+};
+
+/// Awaitable control transfer, keeps the buffer for the setup packet
+class control_awaitable {
+public:
+  control_awaitable(interface &intf, uint8_t request_type, uint8_t request,
+                    uint16_t value, uint16_t index, gsl::span<uint8_t> data,
+                    std::chrono::milliseconds timeout)
+      : interface_(intf), data_(data), timeout_(timeout),
+        buffer_(LIBUSB_CONTROL_SETUP_SIZE + data.size()) {
+    libusb_fill_control_setup(buffer_.data(), request_type, request, value,
+                              index, static_cast<uint16_t>(data.size()));
+    if ((request_type & LIBUSB_ENDPOINT_IN) == 0)
+      std::copy(data.begin(), data.end(),
+                buffer_.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+  }
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    // the coroutine may destroy the transfer and thereby this callback
+    transfer_.set_callback(
+        [h](transfer &) { std::coroutine_handle<>{h}.resume(); });
+    interface_.async_control(transfer_, buffer_, timeout_);
+  }
+  int await_resume() {
+    if (transfer_.status() != transfer_status::completed)
+      throw usb_error(to_error(transfer_.status()));
+    const auto length = transfer_.actual_length();
+    if ((buffer_[0] & LIBUSB_ENDPOINT_IN) != 0)
+      std::copy_n(buffer_.begin() + LIBUSB_CONTROL_SETUP_SIZE, length,
+                  data_.begin());
+    return length;
+  }
+
+private:
+  interface &interface_;
+  gsl::span<uint8_t> data_;
+  std::chrono::milliseconds timeout_;
+  std::vector<uint8_t> buffer_;
+  transfer transfer_;
+};
+
+[[nodiscard]] inline transfer_awaitable
+async_read(in_endpoint &ep, gsl::span<uint8_t> data,
+           std::chrono::milliseconds timeout) {
+  return transfer_awaitable{[&ep, data, timeout](transfer &t) {
+    ep.async_bulk_read(t, data, timeout);
+  }};
+}
+
+[[nodiscard]] inline transfer_awaitable
+async_write(out_endpoint &ep, gsl::span<const uint8_t> data,
+            std::chrono::milliseconds timeout) {
+  return transfer_awaitable{[&ep, data, timeout](transfer &t) {
+    ep.async_bulk_write(t, data, timeout);
+  }};
+}
+
+[[nodiscard]] inline control_awaitable
+async_control_read(interface &intf, type type, recipient to, uint8_t request,
+                   uint16_t value, uint16_t index, gsl::span<uint8_t> data,
+                   std::chrono::milliseconds timeout) {
+  const auto request_type = static_cast<uint8_t>(
+      LIBUSB_ENDPOINT_IN | static_cast<uint8_t>(type) |
+      static_cast<uint8_t>(to));
+  return {intf, request_type, request, value, index, data, timeout};
+}
+
+[[nodiscard]] inline control_awaitable
+async_control_write(interface &intf, type type, recipient to, uint8_t request,
+                    uint16_t value, uint16_t index, gsl::span<uint8_t> data,
+                    std::chrono::milliseconds timeout) {
+  const auto request_type = static_cast<uint8_t>(
+      LIBUSB_ENDPOINT_OUT | static_cast<uint8_t>(type) |
+      static_cast<uint8_t>(to));
+  return {intf, request_type, request, value, index, data, timeout};
+}
+
+} // namespace usb
+
+#endif
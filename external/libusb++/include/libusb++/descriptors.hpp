@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 class endpoint_descriptor {
@@ -11,7 +12,8 @@ public:
                       std::vector<uint8_t> &&extra)
       : bEndpointAddress(bEndpointAddress), bmAttributes(bmAttributes),
         wMaxPacketSize(wMaxPacketSize), bInterval(bInterval),
-        bRefresh(bRefresh), bSynchAddress(bSynchAddress), extra(extra) {}
+        bRefresh(bRefresh), bSynchAddress(bSynchAddress),
+        extra(std::move(extra)) {}
 
   const uint8_t bEndpointAddress;
   const uint8_t bmAttributes;
@@ -33,7 +35,7 @@ public:
         bAlternateSetting(bAlternateSetting), bInterfaceClass(bInterfaceClass),
         bInterfaceSubClass(bInterfaceSubClass),
         bInterfaceProtocol(bInterfaceProtocol), iInterface(iInterface),
-        endpoints(endpoints), extra(extra) {}
+        endpoints(std::move(endpoints)), extra(std::move(extra)) {}
   const uint8_t bInterfaceNumber;
   const uint8_t bAlternateSetting;
   const uint8_t bInterfaceClass;
@@ -52,7 +54,8 @@ public:
                     std::vector<uint8_t> &&extra)
       : bConfigurationValue(bConfigurationValue),
         iConfiguration(iConfiguration), bmAttributes(bmAttributes),
-        maxPower(maxPower), interfaces(interfaces), extra(extra) {}
+        maxPower(maxPower), interfaces(std::move(interfaces)),
+        extra(std::move(extra)) {}
   const uint8_t bConfigurationValue;
   const uint8_t iConfiguration;
   const uint8_t bmAttributes;
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "libusb++/device_registry.hpp"
 #include "libusb++/libusb++.hpp"
 #include <optional>
+#include <string>
 #include <vector>
 
 namespace usb {
@@ -16,7 +18,7 @@ private:
   std::optional<uint8_t> interface_class_;
   std::optional<uint8_t> interface_subclass_;
   std::optional<uint8_t> interface_protocol_;
-  // serial number?
+  std::optional<std::string> serial_number_;
 public:
   void bus(int expected);
   void device_address(int expected);
@@ -25,9 +27,24 @@ public:
   void interface_class(uint8_t expected);
   void interface_subclass(uint8_t expected);
   void interface_protocol(uint8_t expected);
+  // the device has to be opened to read the serial number, devices that
+  // can't be opened (e.g. missing permissions) don't match
+  void serial_number(std::string expected);
 
   [[nodiscard]] bool test(const usb::device &d) const;
   [[nodiscard]] std::vector<device> filter(const device_list &l) const;
+  // uses the cached descriptors, devices are only opened once to read the
+  // serial number and not at all otherwise
+  [[nodiscard]] bool test(const cached_device &d) const;
+  [[nodiscard]] std::vector<device_registry::entry>
+  filter(const device_registry &r) const;
+
+private:
+  [[nodiscard]] bool
+  match_device(const usb::device &d,
+               const libusb_device_descriptor &dd) const noexcept;
+  [[nodiscard]] bool match_interfaces(const config_descriptor &config) const;
+  [[nodiscard]] bool has_interface_predicates() const noexcept;
 };
 
 } // namespace usb
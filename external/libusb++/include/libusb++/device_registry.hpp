@@ -0,0 +1,108 @@
+#pragma once
+
+#include "libusb++/descriptors.hpp"
+#include "libusb++/details/libusb.hpp"
+#include "libusb++/libusb++.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace usb {
+
+/// Location of a device: the bus and the ports of all hubs on the way
+///
+/// Unlike the device address the path stays the same if a device is
+/// reconnected to the same port.
+struct device_path {
+  uint8_t bus;
+  std::vector<uint8_t> ports;
+
+  bool operator==(const device_path &other) const noexcept;
+  bool operator!=(const device_path &other) const noexcept;
+  bool operator<(const device_path &other) const noexcept;
+};
+
+/// Descriptors of a device, read once and kept while it is connected
+///
+/// The device descriptor is read on construction, everything else on
+/// first use. All functions may be called from several threads.
+class cached_device {
+public:
+  explicit cached_device(const device &dev);
+
+  [[nodiscard]] const device &get() const noexcept { return device_; }
+  [[nodiscard]] const device_path &path() const noexcept { return path_; }
+  [[nodiscard]] const libusb_device_descriptor &
+  device_descriptor() const noexcept {
+    return descriptor_;
+  }
+  [[nodiscard]] const config_descriptor &configuration(uint8_t index) const;
+  // ascii string descriptor, empty if it can't be read. The device is
+  // opened the first time a string is requested.
+  [[nodiscard]] std::optional<std::string>
+  string_descriptor(uint8_t index) const;
+  [[nodiscard]] std::optional<std::string> serial_number() const {
+    return string_descriptor(descriptor_.iSerialNumber);
+  }
+
+private:
+  device device_;
+  device_path path_;
+  libusb_device_descriptor descriptor_;
+  mutable std::mutex mutex_;
+  mutable std::map<uint8_t, config_descriptor> configurations_;
+  mutable std::map<uint8_t, std::optional<std::string>> strings_;
+};
+
+/// Devices connected to a context, kept up to date by hotplug events
+///
+/// Hotplug events are only delivered while events of the context are
+/// handled (see event_loop). Without hotplug support (e.g. Windows) the
+/// registry is updated by rescan(), which keeps the cached descriptors
+/// of devices that are still connected.
+class device_registry {
+public:
+  using entry = std::shared_ptr<const cached_device>;
+  // called without any lock held, from within event handling if the
+  // change was reported by a hotplug event
+  using listener = std::function<void(const entry &dev, bool arrived)>;
+
+  explicit device_registry(context &ctx);
+  ~device_registry();
+  device_registry(const device_registry &) = delete;
+  device_registry &operator=(const device_registry &) = delete;
+
+  [[nodiscard]] bool hotplug() const noexcept { return hotplug_.has_value(); }
+  void rescan();
+  void set_listener(listener l);
+
+  [[nodiscard]] std::vector<entry> devices() const;
+  [[nodiscard]] entry find(const device_path &path) const;
+  // incremented whenever a device arrives or leaves, rescans can be
+  // skipped if it did not change
+  [[nodiscard]] uint64_t generation() const noexcept;
+
+private:
+  static int LIBUSB_CALL on_hotplug(libusb_context *ctx, libusb_device *dev,
+                                    libusb_hotplug_event event,
+                                    void *user_data);
+  void arrived(libusb_device *dev);
+  void left(libusb_device *dev);
+  void notify(const entry &dev, bool arrived);
+
+  context &ctx_;
+  std::optional<libusb_hotplug_callback_handle> hotplug_;
+  mutable std::mutex mutex_;
+  std::map<device_path, entry> devices_;
+  std::atomic<uint64_t> generation_{0};
+  listener listener_;
+};
+
+} // namespace usb
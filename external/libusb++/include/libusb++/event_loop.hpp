@@ -0,0 +1,102 @@
+#pragma once
+
+#include "libusb++/details/libusb.hpp"
+#include "libusb++/transfer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace usb {
+
+class context;
+
+/// Event handling of a context
+///
+/// Completions of asynchronous transfers are only reported while events
+/// are handled, which can be done
+/// - by a dedicated event thread (start/stop),
+/// - from a loop of the application (run_once),
+/// - from an external poll/epoll loop watching the file descriptors of
+///   libusb (pollfds, next_timeout, handle_ready). Not supported on Windows.
+///
+/// While the event thread runs, callbacks of all transfers of the context
+/// are called from it unless they have an executor. Code that handles
+/// events itself (e.g. spinaltap::device) should then use its own context.
+class event_loop {
+public:
+  struct pollfd {
+    int fd;
+    short events;
+  };
+  using pollfd_added = std::function<void(int fd, short events)>;
+  using pollfd_removed = std::function<void(int fd)>;
+
+  explicit event_loop(context &ctx);
+  ~event_loop();
+  event_loop(const event_loop &) = delete;
+  event_loop &operator=(const event_loop &) = delete;
+
+  void start();
+  // interrupts event handling and joins the event thread. Transfers in
+  // flight stay submitted and complete once events are handled again.
+  void stop();
+  [[nodiscard]] bool running() const noexcept { return running_; }
+  [[nodiscard]] bool in_event_thread() const noexcept;
+
+  // run fn where events are handled next, e.g. to cancel transfers
+  // without racing their callbacks
+  void post(std::function<void()> fn);
+  // handle events in the calling thread for at most timeout
+  void run_once(std::chrono::microseconds timeout);
+
+  [[nodiscard]] std::vector<pollfd> pollfds() const;
+  void set_pollfd_notifiers(pollfd_added added, pollfd_removed removed);
+  // time until timeouts of transfers have to be handled, empty if there are
+  // none pending. An external loop must call handle_ready() by then.
+  [[nodiscard]] std::optional<std::chrono::microseconds> next_timeout() const;
+  // handle events that are ready without blocking
+  void handle_ready();
+
+private:
+  static void LIBUSB_CALL on_pollfd_added(int fd, short events,
+                                          void *user_data);
+  static void LIBUSB_CALL on_pollfd_removed(int fd, void *user_data);
+  void run_posted();
+
+  context &ctx_;
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<std::function<void()>> posted_;
+  pollfd_added added_;
+  pollfd_removed removed_;
+};
+
+/// Executor that runs handlers on the thread calling poll or run_for
+///
+/// Pass get_executor() to transfer::set_executor to have completions
+/// dispatched to a thread of the application instead of the event thread.
+class work_queue {
+public:
+  void post(std::function<void()> fn);
+  // run all handlers that are ready, returns the number of handlers run
+  std::size_t poll();
+  // wait at most timeout for handlers, then run all that are ready
+  std::size_t run_for(std::chrono::microseconds timeout);
+  [[nodiscard]] executor get_executor();
+
+private:
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> handlers_;
+};
+
+} // namespace usb
@@ -9,6 +9,7 @@
 #include <chrono>
 #include <gsl/span>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -44,6 +45,10 @@ enum class log_level {
   debug = LIBUSB_LOG_LEVEL_DEBUG
 };
 
+class event_loop;
+class transfer;
+struct endpoint_metrics;
+
 class context {
 public:
   context();
@@ -56,11 +61,20 @@ public:
   void set_usbdk(bool usbdk);
   libusb_context *get();
 
+  // process pending events (transfer completions, timeouts) for at most
+  // timeout, returns early if completed is set to non-zero by a callback
+  void handle_events(std::chrono::microseconds timeout,
+                     int *completed = nullptr);
+  // event handling of the context, created on first use
+  event_loop &events();
+
   static context &default_context();
 
 private:
   explicit context(libusb_context *ctx);
   libusb_context *context_;
+  std::unique_ptr<event_loop> events_;
+  std::mutex events_mutex_;
 };
 
 // TODO: get speed
@@ -68,13 +82,17 @@ class device {
   using native_handle_t = uintptr_t;
 
 public:
-  device(libusb_device *dev) : dev_(libusb_ref_device(dev)) {}
-  device(const device &other) : dev_(libusb_ref_device(other.dev_)) {}
+  device(libusb_device *dev, context &ctx = context::default_context())
+      : dev_(libusb_ref_device(dev)), ctx_(&ctx) {}
+  device(const device &other)
+      : dev_(libusb_ref_device(other.dev_)), ctx_(other.ctx_) {}
   device &operator=(const device &other) {
     if (this == &other)
       return *this;
     libusb_unref_device(dev_);
     dev_ = libusb_ref_device(other.dev_);
+    ctx_ = other.ctx_;
+    return *this;
   }
   // device(device &&other) { std::swap(dev_, other.dev_); }
   ~device() { libusb_unref_device(dev_); };
@@ -83,7 +101,7 @@ public:
   uint8_t port_number() const noexcept { return libusb_get_port_number(dev_); }
   std::vector<uint8_t> port_numbers() const {
     // USB3 spec only allows for depth of 7
-    std::vector<uint8_t> result{7, 0};
+    std::vector<uint8_t> result(7, 0);
     const auto filled{
         libusb_get_port_numbers(dev_, result.data(), result.size())};
     if (filled < 0)
@@ -158,16 +176,18 @@ public:
   }
 
   native_handle_t native_handle() const noexcept { return (uintptr_t)dev_; }
+  context &owning_context() const noexcept { return *ctx_; }
 
 private:
   libusb_device *dev_;
+  context *ctx_;
 };
 
 class device_handle {
 public:
   using native_handle_t = uintptr_t;
 
-  device_handle(const device &d) {
+  device_handle(const device &d) : ctx_(&d.owning_context()) {
     const auto status{
         libusb_open((libusb_device *)d.native_handle(), &handle_)};
     if (status != 0)
@@ -177,13 +197,14 @@ public:
   // TODO: overload/default param with context
   device_handle(uint16_t vendor_id, uint16_t product_id, usb::context &ctx)
       : handle_(
-            libusb_open_device_with_vid_pid(ctx.get(), vendor_id, product_id)) {
+            libusb_open_device_with_vid_pid(ctx.get(), vendor_id, product_id)),
+        ctx_(&ctx) {
     if (handle_ == nullptr)
       throw usb_error(errors::OTHER);
   }
   device_handle(const device_handle &other) = delete;
   device_handle &operator=(const device_handle &other) = delete;
-  device_handle(device_handle &&other) : handle_(0) {
+  device_handle(device_handle &&other) : handle_(0), ctx_(other.ctx_) {
     std::swap(handle_, other.handle_);
   }
   ~device_handle() {
@@ -235,9 +256,11 @@ public:
   [[nodiscard]] native_handle_t native_handle() const noexcept {
     return (native_handle_t)handle_;
   }
+  [[nodiscard]] context &owning_context() const noexcept { return *ctx_; }
 
 private:
   libusb_device_handle *handle_;
+  context *ctx_;
 };
 
 class interface {
@@ -246,7 +269,7 @@ public:
 
   interface(const device_handle &dh, int interface_number)
       : handle_((libusb_device_handle *)dh.native_handle()),
-        interface_number_(interface_number) {
+        interface_number_(interface_number), ctx_(&dh.owning_context()) {
     const auto status{libusb_claim_interface(handle_, interface_number)};
     if (status != 0)
       throw usb_error(static_cast<errors>(status));
@@ -254,8 +277,8 @@ public:
   interface(const interface &other) = delete;
   interface &operator=(const interface &other) = delete;
   interface(interface &&other)
-      : handle_(0),
-        interface_number_(0) { // TODO: implement swap overload, use that
+      : handle_(0), interface_number_(0),
+        ctx_(other.ctx_) { // TODO: implement swap overload, use that
     std::swap(handle_, other.handle_);
     std::swap(interface_number_, other.interface_number_);
   }
@@ -297,24 +320,46 @@ public:
     return status;
   }
 
+  // submit an asynchronous control transfer, buffer starts with the setup
+  // packet and has to stay valid until the callback of the transfer ran
+  void async_control(transfer &t, gsl::span<uint8_t> buffer,
+                     std::chrono::milliseconds timeout);
+
   native_handle_type native_handle() const noexcept {
     return (native_handle_type)handle_;
   }
+  int number() const noexcept { return interface_number_; }
+  context &owning_context() const noexcept { return *ctx_; }
 
 private:
   libusb_device_handle *handle_;
   int interface_number_;
+  context *ctx_;
 };
 
 // TODO: get max packet size
 class endpoint {
 public:
   endpoint(const interface &i, unsigned char ep)
-      : handle_((libusb_device_handle *)i.native_handle()), endpoint_(ep) {}
+      : handle_((libusb_device_handle *)i.native_handle()), endpoint_(ep),
+        ctx_(&i.owning_context()) {}
+
+  unsigned char address() const noexcept { return endpoint_; }
+  context &owning_context() const noexcept { return *ctx_; }
+  // count all transfers of the endpoint in metrics (nullptr to stop),
+  // metrics have to outlive transfers in flight
+  void set_metrics(endpoint_metrics *metrics) noexcept { metrics_ = metrics; }
+  endpoint_metrics *metrics() const noexcept { return metrics_; }
 
 protected:
+  // feeds a synchronous transfer into the metrics
+  void record(int transferred, std::chrono::steady_clock::time_point start,
+              int status) const noexcept;
+
   libusb_device_handle *handle_;
   unsigned char endpoint_;
+  context *ctx_;
+  endpoint_metrics *metrics_{nullptr};
 };
 
 class out_endpoint : public endpoint {
@@ -322,15 +367,18 @@ public:
   using endpoint::endpoint;
   int bulk_write(gsl::span<const uint8_t> data,
                  std::chrono::milliseconds timeout) {
-    int transferred;
+    int transferred{0};
+    const auto start = metrics_ ? std::chrono::steady_clock::now()
+                                : std::chrono::steady_clock::time_point{};
     // const_cast is fine since libusb does not alter data for out endpoints
     const auto status{libusb_bulk_transfer(
         handle_, endpoint_, const_cast<uint8_t *>(data.data()), data.size(),
         &transferred, static_cast<unsigned int>(timeout.count()))};
+    if (metrics_)
+      record(transferred, start, status);
     if (status != 0)
       throw usb_error(static_cast<errors>(status));
-    logging::logger->debug("TX: {:n}",
-                           spdlog::to_hex(data.begin(), data.end()));
+    LIBUSBXX_LOG_TRACE("TX: {:n}", spdlog::to_hex(data.begin(), data.end()));
     return transferred;
   }
 
@@ -344,20 +392,28 @@ public:
       data = data.subspan(written);
     } while (remaining);
   }
+
+  // submit an asynchronous write, data has to stay valid until
+  // the completion callback of the transfer was called
+  void async_bulk_write(transfer &t, gsl::span<const uint8_t> data,
+                        std::chrono::milliseconds timeout);
 };
 
 class in_endpoint : public endpoint {
 public:
   in_endpoint(const interface &i, unsigned char ep) : endpoint(i, 0x80 | ep) {}
   int bulk_read(gsl::span<uint8_t> data, std::chrono::milliseconds timeout) {
-    int transferred;
+    int transferred{0};
+    const auto start = metrics_ ? std::chrono::steady_clock::now()
+                                : std::chrono::steady_clock::time_point{};
     const auto status{libusb_bulk_transfer(
         handle_, endpoint_, data.data(), data.size(), &transferred,
         static_cast<unsigned int>(timeout.count()))};
+    if (metrics_)
+      record(transferred, start, status);
     if (status != 0)
       throw usb_error(static_cast<errors>(status));
-    logging::logger->debug("RX: {:n}",
-                           spdlog::to_hex(data.begin(), data.end()));
+    LIBUSBXX_LOG_TRACE("RX: {:n}", spdlog::to_hex(data.begin(), data.end()));
     return transferred;
   }
 
@@ -370,6 +426,11 @@ public:
       data = data.subspan(read);
     } while (remaining);
   }
+
+  // submit an asynchronous read, data has to stay valid until
+  // the completion callback of the transfer was called
+  void async_bulk_read(transfer &t, gsl::span<uint8_t> data,
+                       std::chrono::milliseconds timeout);
 };
 
 class device_list;
@@ -390,7 +451,7 @@ private:
 
 class device_list {
 public:
-  device_list(context &ctx) {
+  device_list(context &ctx) : ctx_(ctx) {
     listLen_ = libusb_get_device_list(ctx.get(), &list_);
     if (listLen_ < 0)
       throw usb_error(static_cast<errors>(listLen_));
@@ -399,7 +460,9 @@ public:
   device_list &operator=(const device_list &other) = delete;
   ~device_list() { libusb_free_device_list(list_, 1); }
 
-  device operator[](ssize_t offset) const { return device(list_[offset]); }
+  device operator[](ssize_t offset) const {
+    return device(list_[offset], ctx_);
+  }
 
   device_list_iterator begin() const { return cbegin(); }
   device_list_iterator end() const { return cend(); }
@@ -411,6 +474,7 @@ public:
   }
 
 private:
+  context &ctx_;
   libusb_device **list_;
   ssize_t listLen_;
 };
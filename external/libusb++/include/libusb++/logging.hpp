@@ -4,6 +4,29 @@
 
 #include "spdlog/fmt/bin_to_hex.h"
 
+// Calls of the LIBUSBXX_LOG_* macros below this level (one of the
+// SPDLOG_LEVEL_* values) are compiled out. The remaining ones only
+// evaluate their arguments if the logger is going to log the message.
+#ifndef LIBUSBXX_LOG_LEVEL
+#define LIBUSBXX_LOG_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+
+#define LIBUSBXX_LOG(lvl, ...)                                                 \
+  do {                                                                         \
+    if constexpr ((lvl) >= LIBUSBXX_LOG_LEVEL) {                               \
+      constexpr auto libusbxx_level_{                                          \
+          static_cast<spdlog::level::level_enum>(lvl)};                        \
+      if (::usb::logging::logger->should_log(libusbxx_level_))                 \
+        ::usb::logging::logger->log(libusbxx_level_, __VA_ARGS__);             \
+    }                                                                          \
+  } while (false)
+
+#define LIBUSBXX_LOG_TRACE(...) LIBUSBXX_LOG(SPDLOG_LEVEL_TRACE, __VA_ARGS__)
+#define LIBUSBXX_LOG_DEBUG(...) LIBUSBXX_LOG(SPDLOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LIBUSBXX_LOG_INFO(...) LIBUSBXX_LOG(SPDLOG_LEVEL_INFO, __VA_ARGS__)
+#define LIBUSBXX_LOG_WARN(...) LIBUSBXX_LOG(SPDLOG_LEVEL_WARN, __VA_ARGS__)
+#define LIBUSBXX_LOG_ERROR(...) LIBUSBXX_LOG(SPDLOG_LEVEL_ERROR, __VA_ARGS__)
+
 namespace usb::logging {
 
 inline auto logger = std::make_shared<spdlog::logger>("libusb++");
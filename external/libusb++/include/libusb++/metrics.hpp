@@ -0,0 +1,124 @@
+#pragma once
+
+#include "libusb++/error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace usb {
+
+/// Latency distribution of a histogram at one point in time
+struct histogram_snapshot {
+  struct bucket {
+    // largest value counted in the bucket
+    uint64_t upper;
+    uint64_t count;
+  };
+
+  uint64_t count{0};
+  uint64_t sum{0};
+  uint64_t min{0};
+  uint64_t max{0};
+  // only buckets that counted anything, in ascending order
+  std::vector<bucket> buckets;
+
+  // upper bound of the bucket that holds the p-th percentile (0..100)
+  [[nodiscard]] uint64_t percentile(double p) const noexcept;
+  [[nodiscard]] double mean() const noexcept;
+};
+
+/// Lock-free histogram of durations in nanoseconds
+///
+/// Buckets grow exponentially with 16 linear steps per power of two, so
+/// every value is counted with an error below 6.25%. Values above about
+/// 18 minutes end up in the last bucket. record() may be called from any
+/// thread, it costs a few relaxed atomic operations.
+class histogram {
+public:
+  constexpr static unsigned sub_bucket_bits = 4;
+  constexpr static unsigned max_value_bits = 40;
+  constexpr static std::size_t bucket_count =
+      (max_value_bits - sub_bucket_bits + 1) << sub_bucket_bits;
+
+  histogram() = default;
+  histogram(const histogram &) = delete;
+  histogram &operator=(const histogram &) = delete;
+
+  void record(uint64_t value) noexcept;
+  void record(std::chrono::nanoseconds duration) noexcept {
+    record(static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0)));
+  }
+  [[nodiscard]] histogram_snapshot snapshot() const;
+  // not atomic with respect to concurrent record() calls
+  void reset() noexcept;
+
+  [[nodiscard]] static std::size_t bucket_index(uint64_t value) noexcept;
+  [[nodiscard]] static uint64_t bucket_upper(std::size_t index) noexcept;
+
+private:
+  std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> min_{UINT64_MAX};
+  std::atomic<uint64_t> max_{0};
+};
+
+/// Name and labels of a time series, e.g. usb_transfers_total{endpoint="1"}
+struct metric_series {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> labels;
+};
+
+/// Values of a set of metrics, ready to be exported
+///
+/// Histograms hold durations in nanoseconds, they are exported in seconds
+/// as Prometheus summaries.
+struct metrics_snapshot {
+  std::vector<std::pair<metric_series, uint64_t>> counters;
+  std::vector<std::pair<metric_series, double>> gauges;
+  std::vector<std::pair<metric_series, histogram_snapshot>> histograms;
+
+  // append the series of other, e.g. to export several devices together
+  void merge(metrics_snapshot other);
+  // add a label to every series, e.g. the serial number of a board
+  void add_label(const std::string &name, const std::string &value);
+
+  [[nodiscard]] std::string to_json() const;
+  // Prometheus text exposition format
+  [[nodiscard]] std::string to_prometheus() const;
+};
+
+/// Counters of the transfers of an endpoint
+///
+/// Attach to an endpoint with endpoint::set_metrics, the counters are
+/// updated by synchronous transfers and by completions of asynchronous
+/// ones. Several endpoints may share one object.
+struct endpoint_metrics {
+  std::atomic<uint64_t> transfers{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> timeouts{0};
+  // transfers that failed for other reasons than a timeout
+  std::atomic<uint64_t> failures{0};
+  // time from submission to completion
+  histogram duration;
+
+  endpoint_metrics() noexcept;
+  void record(std::size_t transferred, std::chrono::nanoseconds took,
+              errors status) noexcept;
+  void reset() noexcept;
+  // bytes_per_second is averaged over the time since construction or the
+  // last reset
+  [[nodiscard]] metrics_snapshot snapshot(const std::string &endpoint) const;
+
+private:
+  std::atomic<std::chrono::steady_clock::rep> since_;
+};
+
+} // namespace usb
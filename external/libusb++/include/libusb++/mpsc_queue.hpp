@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+namespace usb {
+
+/// Unbounded lock-free queue from any number of producers to one consumer
+///
+/// push() may be called from any thread, pop() only by one consumer at a
+/// time (e.g. whoever holds a lock). A push that is still in progress may
+/// be invisible to pop() for a moment, size() already counts it.
+template <typename T> class mpsc_queue {
+public:
+  mpsc_queue() : head_(&stub_), tail_(&stub_) {}
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue &operator=(const mpsc_queue &) = delete;
+  ~mpsc_queue() {
+    while (pop())
+      ;
+    if (tail_ != &stub_)
+      delete tail_;
+  }
+
+  void push(T value) {
+    auto n = new node{std::move(value)};
+    size_.fetch_add(1, std::memory_order_relaxed);
+    const auto prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  std::optional<T> pop() {
+    const auto tail = tail_;
+    const auto next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+      return std::nullopt;
+    tail_ = next;
+    std::optional<T> value{std::move(next->value)};
+    next->value.reset();
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    if (tail != &stub_)
+      delete tail;
+    return value;
+  }
+
+  [[nodiscard]] std::size_t size() const noexcept {
+    return size_.load(std::memory_order_acquire);
+  }
+  [[nodiscard]] bool empty() const noexcept { return size() == 0; }
+
+private:
+  struct node {
+    node() = default;
+    explicit node(T &&v) : value(std::move(v)) {}
+    std::atomic<node *> next{nullptr};
+    std::optional<T> value;
+  };
+
+  node stub_;
+  // last node pushed, written by the producers
+  alignas(64) std::atomic<node *> head_;
+  // node before the next one to pop, owned by the consumer
+  alignas(64) node *tail_;
+  std::atomic<std::size_t> size_{0};
+};
+
+} // namespace usb
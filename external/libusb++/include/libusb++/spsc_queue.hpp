@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+namespace usb {
+
+/// Bounded lock-free queue between exactly one producer and one consumer
+///
+/// push() must only be called by the producer thread, pop() only by the
+/// consumer thread. The roles may move to other threads if the threads
+/// synchronize (e.g. join) in between.
+template <typename T> class spsc_queue {
+public:
+  explicit spsc_queue(std::size_t capacity) : slots_(capacity + 1) {}
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  // returns false if the queue is full
+  bool push(T value) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    const auto next = increment(head);
+    if (next == tail_.load(std::memory_order_acquire))
+      return false;
+    slots_[head] = std::move(value);
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  std::optional<T> pop() {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+      return std::nullopt;
+    std::optional<T> value{std::move(slots_[tail])};
+    tail_.store(increment(tail), std::memory_order_release);
+    return value;
+  }
+
+  [[nodiscard]] bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+  [[nodiscard]] std::size_t capacity() const noexcept {
+    return slots_.size() - 1;
+  }
+
+private:
+  std::size_t increment(std::size_t i) const noexcept {
+    return i + 1 == slots_.size() ? 0 : i + 1;
+  }
+
+  std::vector<T> slots_;
+  // written by the producer
+  alignas(64) std::atomic<std::size_t> head_{0};
+  // written by the consumer
+  alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+} // namespace usb
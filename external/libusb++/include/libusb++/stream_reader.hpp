@@ -0,0 +1,124 @@
+#pragma once
+
+#include "libusb++/libusb++.hpp"
+#include "libusb++/spsc_queue.hpp"
+#include "libusb++/transfer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <gsl/span>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace usb {
+
+/// Continuous reception from a bulk IN endpoint
+///
+/// Keeps a number of asynchronous transfers queued on the endpoint so the
+/// bus does not idle while the consumer works on data. Filled buffers are
+/// passed to a single consumer thread through a lock-free queue and reused
+/// once the consumer released them.
+///
+/// Events of the owning context are handled by a thread of the reader while
+/// it runs, other asynchronous transfers of the same context complete on
+/// that thread as well.
+class stream_reader {
+public:
+  struct config {
+    // transfers queued on the endpoint at any time
+    std::size_t transfers = 8;
+    // size of every transfer, should be a multiple of the max packet size
+    std::size_t buffer_size = 256 * 1024;
+    // filled buffers that may wait for the consumer
+    std::size_t queue_depth = 32;
+  };
+
+  struct statistics {
+    uint64_t bytes;
+    uint64_t buffers;
+    // buffers dropped since the consumer did not release buffers in time
+    uint64_t overflows;
+    // times the consumer had to wait for data
+    uint64_t starvations;
+  };
+
+  /// Filled buffer, returned to the reader when destroyed
+  class chunk {
+  public:
+    chunk() = default;
+    chunk(chunk &&other) noexcept;
+    chunk &operator=(chunk &&other) noexcept;
+    ~chunk() { reset(); }
+
+    [[nodiscard]] gsl::span<const uint8_t> data() const noexcept;
+    [[nodiscard]] explicit operator bool() const noexcept {
+      return reader_ != nullptr;
+    }
+    void reset() noexcept;
+
+  private:
+    friend class stream_reader;
+    chunk(stream_reader *reader, std::size_t index, std::size_t size)
+        : reader_(reader), index_(index), size_(size) {}
+
+    stream_reader *reader_{nullptr};
+    std::size_t index_{0};
+    std::size_t size_{0};
+  };
+
+  explicit stream_reader(in_endpoint &ep) : stream_reader(ep, config{}) {}
+  stream_reader(in_endpoint &ep, config cfg);
+  ~stream_reader();
+  stream_reader(const stream_reader &) = delete;
+  stream_reader &operator=(const stream_reader &) = delete;
+
+  void start();
+  // cancels all transfers, buffers received before can still be consumed
+  void stop();
+  [[nodiscard]] bool running() const noexcept { return running_; }
+
+  // next filled buffer, an empty chunk if none arrived within timeout.
+  // Errors of the transfers are rethrown here.
+  chunk next(std::chrono::milliseconds timeout);
+  [[nodiscard]] statistics stats() const noexcept;
+
+private:
+  struct filled {
+    std::size_t index;
+    std::size_t size;
+  };
+  struct slot {
+    transfer t;
+    std::size_t index;
+  };
+
+  void submit(slot &s);
+  void on_complete(slot &s) noexcept;
+  void fail(std::exception_ptr error) noexcept;
+  void handle_events();
+
+  in_endpoint &ep_;
+  config config_;
+  std::vector<std::vector<uint8_t>> buffers_;
+  std::vector<std::unique_ptr<slot>> slots_;
+  // buffers released by the consumer
+  spsc_queue<std::size_t> free_;
+  spsc_queue<filled> filled_;
+  std::atomic<bool> running_{false};
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> buffers_received_{0};
+  std::atomic<uint64_t> overflows_{0};
+  std::atomic<uint64_t> starvations_{0};
+  // only used to wait for data, the queues don't need it
+  std::mutex mutex_;
+  std::condition_variable data_available_;
+  std::exception_ptr error_;
+  std::thread events_;
+};
+
+} // namespace usb
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "libusb++/details/libusb.hpp"
+#include "libusb++/error.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <gsl/span>
+
+namespace usb {
+
+struct endpoint_metrics;
+
+enum class transfer_status {
+  completed = LIBUSB_TRANSFER_COMPLETED,
+  error = LIBUSB_TRANSFER_ERROR,
+  timed_out = LIBUSB_TRANSFER_TIMED_OUT,
+  cancelled = LIBUSB_TRANSFER_CANCELLED,
+  stall = LIBUSB_TRANSFER_STALL,
+  no_device = LIBUSB_TRANSFER_NO_DEVICE,
+  overflow = LIBUSB_TRANSFER_OVERFLOW
+};
+
+/// Runs the function passed, possibly on another thread (see work_queue)
+using executor = std::function<void(std::function<void()>)>;
+
+/// Map the status of a finished transfer to the error codes used by
+/// the synchronous API
+[[nodiscard]] errors to_error(transfer_status status) noexcept;
+
+/// Reusable asynchronous transfer
+///
+/// A transfer is filled and submitted by one of the async_ functions of
+/// the endpoints, the callback is called from within the event handling
+/// of the owning context (see context::handle_events). The object may be
+/// resubmitted from within the callback. With an executor the callback is
+/// passed to it instead, it is skipped if the transfer was destroyed
+/// before the executor ran it.
+///
+/// Transfers must not be destroyed while they are in flight, the
+/// destructor will cancel the transfer and process events until libusb
+/// released it.
+class transfer {
+public:
+  using callback_t = std::function<void(transfer &)>;
+
+  transfer();
+  ~transfer();
+  transfer(const transfer &) = delete;
+  transfer &operator=(const transfer &) = delete;
+
+  void set_callback(callback_t cb) { callback_ = std::move(cb); }
+  void set_executor(executor ex) { executor_ = std::move(ex); }
+  // count the transfer in metrics once it completes, reset by fill_*
+  void set_metrics(endpoint_metrics *metrics) noexcept { metrics_ = metrics; }
+
+  void fill_bulk(libusb_context *ctx, libusb_device_handle *handle,
+                 unsigned char endpoint, gsl::span<uint8_t> buffer,
+                 std::chrono::milliseconds timeout);
+  // buffer starts with the setup packet, see libusb_fill_control_setup
+  void fill_control(libusb_context *ctx, libusb_device_handle *handle,
+                    gsl::span<uint8_t> buffer,
+                    std::chrono::milliseconds timeout);
+  void submit();
+  // returns false if the transfer was not in flight
+  bool cancel() noexcept;
+
+  [[nodiscard]] bool in_flight() const noexcept { return in_flight_; }
+  [[nodiscard]] transfer_status status() const noexcept;
+  [[nodiscard]] gsl::span<uint8_t> buffer() const noexcept;
+  [[nodiscard]] gsl::span<uint8_t> received() const noexcept;
+  [[nodiscard]] int actual_length() const noexcept;
+  // the underlying libusb transfer, e.g. to fake completions in tests
+  [[nodiscard]] libusb_transfer *native_handle() const noexcept {
+    return transfer_;
+  }
+
+private:
+  static void LIBUSB_CALL on_complete(libusb_transfer *t);
+  // completion of a transfer whose owner is gone
+  static void LIBUSB_CALL on_orphan_complete(libusb_transfer *t);
+
+  // checked by the completion before it touches the transfer, the
+  // destructor clears self instead of changing members that the thread
+  // handling events may be reading. Recursive since the callback may
+  // destroy the transfer.
+  struct anchor {
+    std::recursive_mutex mutex;
+    transfer *self;
+  };
+
+  libusb_transfer *transfer_;
+  std::shared_ptr<anchor> anchor_;
+  libusb_context *ctx_{nullptr};
+  callback_t callback_;
+  executor executor_;
+  // written by on_complete, which may run on the thread handling events
+  std::atomic<bool> in_flight_{false};
+  endpoint_metrics *metrics_{nullptr};
+  std::chrono::steady_clock::time_point submitted_;
+};
+
+} // namespace usb
@@ -1,5 +1,7 @@
 #include "libusb++/device_filter.hpp"
 
+#include <algorithm>
+
 namespace usb {
 
 void device_filter::bus(int expected) { bus_ = expected; }
@@ -15,9 +17,13 @@ void device_filter::interface_subclass(uint8_t expected) {
 void device_filter::interface_protocol(uint8_t expected) {
   interface_protocol_ = expected;
 }
+void device_filter::serial_number(std::string expected) {
+  serial_number_ = std::move(expected);
+}
 
-bool device_filter::test(const usb::device &device) const {
-  auto dd = device.device_descriptor();
+bool device_filter::match_device(
+    const usb::device &device,
+    const libusb_device_descriptor &dd) const noexcept {
   bool bus_match = !bus_.has_value() || bus_.value() == device.bus_number();
   bool device_address_match =
       !device_address_.has_value() ||
@@ -26,12 +32,17 @@ bool device_filter::test(const usb::device &device) const {
       !vendor_id_.has_value() || vendor_id_.value() == dd.idVendor;
   bool product_id_match =
       !product_id_.has_value() || product_id_.value() == dd.idProduct;
-  if (!(bus_match && device_address_match && vendor_id_match &&
-        product_id_match))
-    return false;
+  return bus_match && device_address_match && vendor_id_match &&
+         product_id_match;
+}
 
-  auto config = device.configuration(0);
-  auto any_interface_match = std::any_of(
+bool device_filter::has_interface_predicates() const noexcept {
+  return interface_class_.has_value() || interface_subclass_.has_value() ||
+         interface_protocol_.has_value();
+}
+
+bool device_filter::match_interfaces(const config_descriptor &config) const {
+  return std::any_of(
       begin(config.interfaces), end(config.interfaces), [&](const auto &intf) {
         bool class_match = !interface_class_.has_value() ||
                            interface_class_.value() == intf.bInterfaceClass;
@@ -43,7 +54,37 @@ bool device_filter::test(const usb::device &device) const {
             interface_protocol_.value() == intf.bInterfaceProtocol;
         return class_match && subclass_match && protocol_match;
       });
-  return any_interface_match;
+}
+
+bool device_filter::test(const usb::device &device) const {
+  auto dd = device.device_descriptor();
+  if (!match_device(device, dd))
+    return false;
+  // parsing the configuration is expensive, only do it if needed
+  if (has_interface_predicates() && !match_interfaces(device.configuration(0)))
+    return false;
+
+  if (!serial_number_.has_value())
+    return true;
+  if (dd.iSerialNumber == 0)
+    return false;
+  try {
+    const device_handle handle{device};
+    return handle.string_descriptor_ascii(dd.iSerialNumber) ==
+           serial_number_.value();
+  } catch (const usb_error &) {
+    return false;
+  }
+}
+
+bool device_filter::test(const cached_device &device) const {
+  if (!match_device(device.get(), device.device_descriptor()))
+    return false;
+  if (has_interface_predicates() &&
+      !match_interfaces(device.configuration(0)))
+    return false;
+  return !serial_number_.has_value() ||
+         device.serial_number() == serial_number_;
 }
 
 std::vector<device> device_filter::filter(const device_list &list) const {
@@ -53,4 +94,13 @@ std::vector<device> device_filter::filter(const device_list &list) const {
   return matches;
 }
 
+std::vector<device_registry::entry>
+device_filter::filter(const device_registry &registry) const {
+  auto matches = registry.devices();
+  matches.erase(std::remove_if(matches.begin(), matches.end(),
+                               [&](const auto &dev) { return !test(*dev); }),
+                matches.end());
+  return matches;
+}
+
 } // namespace usb
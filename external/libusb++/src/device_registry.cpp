@@ -0,0 +1,191 @@
+#include "libusb++/device_registry.hpp"
+
+#include <tuple>
+#include <utility>
+
+namespace usb {
+
+bool device_path::operator==(const device_path &other) const noexcept {
+  return bus == other.bus && ports == other.ports;
+}
+
+bool device_path::operator!=(const device_path &other) const noexcept {
+  return !(*this == other);
+}
+
+bool device_path::operator<(const device_path &other) const noexcept {
+  return std::tie(bus, ports) < std::tie(other.bus, other.ports);
+}
+
+cached_device::cached_device(const device &dev)
+    : device_(dev), path_{dev.bus_number(), dev.port_numbers()},
+      descriptor_(dev.device_descriptor()) {}
+
+const config_descriptor &cached_device::configuration(uint8_t index) const {
+  std::lock_guard lock{mutex_};
+  auto it = configurations_.find(index);
+  if (it == configurations_.end())
+    it = configurations_.emplace(index, device_.configuration(index)).first;
+  return it->second;
+}
+
+std::optional<std::string>
+cached_device::string_descriptor(uint8_t index) const {
+  if (index == 0)
+    return std::nullopt;
+  std::lock_guard lock{mutex_};
+  auto it = strings_.find(index);
+  if (it == strings_.end()) {
+    std::optional<std::string> value;
+    try {
+      const device_handle handle{device_};
+      value = handle.string_descriptor_ascii(index);
+    } catch (const usb_error &) {
+      // not retried, the device is likely not accessible at all
+    }
+    it = strings_.emplace(index, std::move(value)).first;
+  }
+  return it->second;
+}
+
+device_registry::device_registry(context &ctx) : ctx_(ctx) {
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) == 0) {
+    rescan();
+    return;
+  }
+  // devices that are already connected are reported right away
+  libusb_hotplug_callback_handle handle;
+  const auto status{libusb_hotplug_register_callback(
+      ctx.get(),
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+      LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, &on_hotplug, this,
+      &handle)};
+  if (status != LIBUSB_SUCCESS)
+    throw usb_error(static_cast<errors>(status));
+  hotplug_ = handle;
+}
+
+device_registry::~device_registry() {
+  if (hotplug_)
+    libusb_hotplug_deregister_callback(ctx_.get(), *hotplug_);
+}
+
+void device_registry::rescan() {
+  std::map<device_path, entry> current;
+  std::vector<entry> arrivals;
+  std::vector<entry> removals;
+  {
+    const device_list list{ctx_};
+    std::lock_guard lock{mutex_};
+    for (const auto &dev : list) {
+      device_path path{dev.bus_number(), dev.port_numbers()};
+      const auto known = devices_.find(path);
+      if (known != devices_.end() &&
+          known->second->get().native_handle() == dev.native_handle()) {
+        current.emplace(std::move(path), known->second);
+        continue;
+      }
+      auto e = std::make_shared<const cached_device>(dev);
+      arrivals.push_back(e);
+      current.emplace(std::move(path), std::move(e));
+    }
+    for (const auto &[path, e] : devices_) {
+      const auto still = current.find(path);
+      if (still == current.end() || still->second != e)
+        removals.push_back(e);
+    }
+    devices_ = std::move(current);
+    if (!arrivals.empty() || !removals.empty())
+      generation_++;
+  }
+  for (const auto &e : removals)
+    notify(e, false);
+  for (const auto &e : arrivals)
+    notify(e, true);
+}
+
+void device_registry::set_listener(listener l) {
+  std::lock_guard lock{mutex_};
+  listener_ = std::move(l);
+}
+
+std::vector<device_registry::entry> device_registry::devices() const {
+  std::lock_guard lock{mutex_};
+  std::vector<entry> result;
+  result.reserve(devices_.size());
+  for (const auto &[path, e] : devices_)
+    result.push_back(e);
+  return result;
+}
+
+device_registry::entry device_registry::find(const device_path &path) const {
+  std::lock_guard lock{mutex_};
+  const auto it = devices_.find(path);
+  return it == devices_.end() ? nullptr : it->second;
+}
+
+uint64_t device_registry::generation() const noexcept {
+  return generation_;
+}
+
+int LIBUSB_CALL device_registry::on_hotplug(libusb_context *,
+                                            libusb_device *dev,
+                                            libusb_hotplug_event event,
+                                            void *user_data) {
+  auto &self = *static_cast<device_registry *>(user_data);
+  try {
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+      self.arrived(dev);
+    else
+      self.left(dev);
+  } catch (const usb_error &e) {
+    LIBUSBXX_LOG_WARN("hotplug event not handled: {}", e.what());
+  }
+  // stay registered
+  return 0;
+}
+
+void device_registry::arrived(libusb_device *dev) {
+  // only reads descriptors, libusb does not allow I/O in hotplug callbacks
+  auto e = std::make_shared<const cached_device>(device{dev, ctx_});
+  entry replaced;
+  {
+    std::lock_guard lock{mutex_};
+    auto &slot = devices_[e->path()];
+    replaced = std::exchange(slot, e);
+    generation_++;
+  }
+  if (replaced)
+    notify(replaced, false);
+  notify(e, true);
+}
+
+void device_registry::left(libusb_device *dev) {
+  const device d{dev, ctx_};
+  const device_path path{d.bus_number(), d.port_numbers()};
+  entry removed;
+  {
+    std::lock_guard lock{mutex_};
+    const auto it = devices_.find(path);
+    if (it == devices_.end() ||
+        it->second->get().native_handle() != d.native_handle())
+      return;
+    removed = std::move(it->second);
+    devices_.erase(it);
+    generation_++;
+  }
+  notify(removed, false);
+}
+
+void device_registry::notify(const entry &dev, bool arrived) {
+  listener l;
+  {
+    std::lock_guard lock{mutex_};
+    l = listener_;
+  }
+  if (l)
+    l(dev, arrived);
+}
+
+} // namespace usb
@@ -0,0 +1,145 @@
+#include "libusb++/event_loop.hpp"
+#include "libusb++/libusb++.hpp"
+
+#include <stdexcept>
+
+namespace usb {
+
+event_loop::event_loop(context &ctx) : ctx_(ctx) {}
+
+event_loop::~event_loop() {
+  stop();
+  if (added_ || removed_)
+    libusb_set_pollfd_notifiers(ctx_.get(), nullptr, nullptr, nullptr);
+}
+
+void event_loop::start() {
+  if (running_.exchange(true))
+    return;
+  thread_ = std::thread{[this] {
+    while (running_) {
+      try {
+        ctx_.handle_events(std::chrono::seconds(1));
+      } catch (const usb_error &e) {
+        LIBUSBXX_LOG_ERROR("handling events failed: {}", e.what());
+      }
+      run_posted();
+    }
+  }};
+}
+
+void event_loop::stop() {
+  if (in_event_thread())
+    throw std::logic_error("event loop can't be stopped from its own thread");
+  if (!running_.exchange(false))
+    return;
+  libusb_interrupt_event_handler(ctx_.get());
+  thread_.join();
+}
+
+bool event_loop::in_event_thread() const noexcept {
+  return thread_.get_id() == std::this_thread::get_id();
+}
+
+void event_loop::post(std::function<void()> fn) {
+  {
+    std::lock_guard lock{mutex_};
+    posted_.push_back(std::move(fn));
+  }
+  // wake up the event thread, otherwise fn runs with the next run_once
+  if (running_)
+    libusb_interrupt_event_handler(ctx_.get());
+}
+
+void event_loop::run_once(std::chrono::microseconds timeout) {
+  ctx_.handle_events(timeout);
+  run_posted();
+}
+
+void event_loop::run_posted() {
+  std::vector<std::function<void()>> posted;
+  {
+    std::lock_guard lock{mutex_};
+    std::swap(posted, posted_);
+  }
+  for (auto &fn : posted)
+    fn();
+}
+
+std::vector<event_loop::pollfd> event_loop::pollfds() const {
+  const auto fds = libusb_get_pollfds(ctx_.get());
+  if (fds == nullptr)
+    throw usb_error(errors::NOT_SUPPORTED);
+  std::vector<pollfd> result;
+  for (auto fd = fds; *fd != nullptr; fd++)
+    result.push_back({(*fd)->fd, (*fd)->events});
+  libusb_free_pollfds(fds);
+  return result;
+}
+
+void event_loop::set_pollfd_notifiers(pollfd_added added,
+                                      pollfd_removed removed) {
+  added_ = std::move(added);
+  removed_ = std::move(removed);
+  libusb_set_pollfd_notifiers(ctx_.get(), &on_pollfd_added,
+                              &on_pollfd_removed, this);
+}
+
+void LIBUSB_CALL event_loop::on_pollfd_added(int fd, short events,
+                                             void *user_data) {
+  auto &self = *static_cast<event_loop *>(user_data);
+  if (self.added_)
+    self.added_(fd, events);
+}
+
+void LIBUSB_CALL event_loop::on_pollfd_removed(int fd, void *user_data) {
+  auto &self = *static_cast<event_loop *>(user_data);
+  if (self.removed_)
+    self.removed_(fd);
+}
+
+std::optional<std::chrono::microseconds> event_loop::next_timeout() const {
+  timeval tv;
+  const auto status = libusb_get_next_timeout(ctx_.get(), &tv);
+  if (status < 0)
+    throw usb_error(static_cast<errors>(status));
+  if (status == 0)
+    return std::nullopt;
+  return std::chrono::seconds(tv.tv_sec) +
+         std::chrono::microseconds(tv.tv_usec);
+}
+
+void event_loop::handle_ready() { run_once(std::chrono::microseconds(0)); }
+
+void work_queue::post(std::function<void()> fn) {
+  {
+    std::lock_guard lock{mutex_};
+    handlers_.push_back(std::move(fn));
+  }
+  ready_.notify_one();
+}
+
+std::size_t work_queue::poll() {
+  std::deque<std::function<void()>> handlers;
+  {
+    std::lock_guard lock{mutex_};
+    std::swap(handlers, handlers_);
+  }
+  for (auto &fn : handlers)
+    fn();
+  return handlers.size();
+}
+
+std::size_t work_queue::run_for(std::chrono::microseconds timeout) {
+  {
+    std::unique_lock lock{mutex_};
+    ready_.wait_for(lock, timeout, [this] { return !handlers_.empty(); });
+  }
+  return poll();
+}
+
+executor work_queue::get_executor() {
+  return [this](std::function<void()> fn) { post(std::move(fn)); };
+}
+
+} // namespace usb
@@ -1,4 +1,5 @@
 #include "libusb++/libusb++.hpp"
+#include "libusb++/event_loop.hpp"
 
 namespace usb {
 
@@ -29,7 +30,11 @@ libusb_context *init() {
 context::context() : context(init()) {}
 context::context(libusb_context *ctx) : context_(ctx) {}
 
-context::~context() { libusb_exit(context_); }
+context::~context() {
+  // the event thread has to be gone before the context
+  events_.reset();
+  libusb_exit(context_);
+}
 
 void context::set_log_level(log_level level) {
   const auto status = libusb_set_option(context_, LIBUSB_OPTION_LOG_LEVEL,
@@ -48,6 +53,25 @@ void context::set_usbdk(bool usbdk) {
 // hide type behind typedef of native handle
 libusb_context *context::get() { return context_; }
 
+void context::handle_events(std::chrono::microseconds timeout,
+                            int *completed) {
+  const auto secs =
+      std::chrono::duration_cast<std::chrono::seconds>(timeout);
+  timeval tv{static_cast<decltype(tv.tv_sec)>(secs.count()),
+             static_cast<decltype(tv.tv_usec)>((timeout - secs).count())};
+  const auto status =
+      libusb_handle_events_timeout_completed(context_, &tv, completed);
+  if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_INTERRUPTED)
+    throw usb_error(static_cast<errors>(status));
+}
+
+event_loop &context::events() {
+  std::lock_guard lock{events_mutex_};
+  if (!events_)
+    events_ = std::make_unique<event_loop>(*this);
+  return *events_;
+}
+
 context &context::default_context() {
   static context ctx{nullptr};
   return ctx;
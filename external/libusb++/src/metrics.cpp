@@ -0,0 +1,315 @@
+#include "libusb++/metrics.hpp"
+#include "libusb++/libusb++.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+
+namespace usb {
+
+namespace {
+
+constexpr uint64_t sub_buckets = uint64_t{1} << histogram::sub_bucket_bits;
+
+unsigned highest_bit(uint64_t v) noexcept {
+  unsigned bit{0};
+  for (unsigned shift = 32; shift != 0; shift /= 2) {
+    if (v >> (bit + shift))
+      bit += shift;
+  }
+  return bit;
+}
+
+std::string escape(const std::string &s) {
+  std::string result;
+  result.reserve(s.size());
+  for (const char c : s) {
+    if (c == '"' || c == '\\')
+      result += '\\';
+    if (c == '\n') {
+      result += "\\n";
+      continue;
+    }
+    result += c;
+  }
+  return result;
+}
+
+std::string number(double v) {
+  if (std::isnan(v))
+    return "NaN";
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.9g", v);
+  return buffer;
+}
+
+std::string seconds(uint64_t ns) {
+  return number(static_cast<double>(ns) / 1e9);
+}
+
+// {a="1",b="2"} including extra labels, empty without any labels
+std::string prometheus_labels(
+    const metric_series &series,
+    const std::vector<std::pair<std::string, std::string>> &extra = {}) {
+  std::string result;
+  auto append = [&](const auto &label) {
+    result += result.empty() ? "{" : ",";
+    result += label.first + "=\"" + escape(label.second) + "\"";
+  };
+  for (const auto &label : series.labels)
+    append(label);
+  for (const auto &label : extra)
+    append(label);
+  return result.empty() ? result : result + "}";
+}
+
+std::string json_series(const metric_series &series) {
+  std::string result = "\"name\":\"" + escape(series.name) + "\",\"labels\":{";
+  for (std::size_t i = 0; i < series.labels.size(); i++) {
+    if (i != 0)
+      result += ',';
+    result += "\"" + escape(series.labels[i].first) + "\":\"" +
+              escape(series.labels[i].second) + "\"";
+  }
+  return result + "}";
+}
+
+// prints the TYPE line once per metric name
+class prometheus_writer {
+public:
+  void type(const std::string &name, const char *type) {
+    if (typed_.emplace(name, type).second)
+      out_ += "# TYPE " + name + ' ' + type + '\n';
+  }
+  void sample(const std::string &name, const std::string &labels,
+              const std::string &value) {
+    out_ += name + labels + ' ' + value + '\n';
+  }
+  std::string take() { return std::move(out_); }
+
+private:
+  std::string out_;
+  std::map<std::string, const char *> typed_;
+};
+
+constexpr std::array<double, 4> exported_quantiles{50, 90, 99, 99.9};
+
+} // namespace
+
+uint64_t histogram_snapshot::percentile(double p) const noexcept {
+  if (count == 0)
+    return 0;
+  const auto rank = static_cast<uint64_t>(std::ceil(
+      std::clamp(p, 0.0, 100.0) / 100.0 * static_cast<double>(count)));
+  uint64_t seen{0};
+  for (const auto &b : buckets) {
+    seen += b.count;
+    if (seen >= std::max<uint64_t>(rank, 1))
+      return std::min(b.upper, max);
+  }
+  return max;
+}
+
+double histogram_snapshot::mean() const noexcept {
+  return count == 0 ? 0.0
+                    : static_cast<double>(sum) / static_cast<double>(count);
+}
+
+std::size_t histogram::bucket_index(uint64_t value) noexcept {
+  if (value < sub_buckets)
+    return static_cast<std::size_t>(value);
+  const auto msb = highest_bit(value);
+  if (msb >= max_value_bits)
+    return bucket_count - 1;
+  const auto shift = msb - sub_bucket_bits;
+  return static_cast<std::size_t>(
+      ((msb - sub_bucket_bits + 1) << sub_bucket_bits) +
+      ((value >> shift) & (sub_buckets - 1)));
+}
+
+uint64_t histogram::bucket_upper(std::size_t index) noexcept {
+  if (index < sub_buckets)
+    return index;
+  const auto msb = (index >> sub_bucket_bits) + sub_bucket_bits - 1;
+  const auto shift = msb - sub_bucket_bits;
+  const auto lower = (sub_buckets + (index & (sub_buckets - 1))) << shift;
+  return lower + (uint64_t{1} << shift) - 1;
+}
+
+void histogram::record(uint64_t value) noexcept {
+  buckets_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  auto min = min_.load(std::memory_order_relaxed);
+  while (value < min &&
+         !min_.compare_exchange_weak(min, value, std::memory_order_relaxed))
+    ;
+  auto max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    ;
+}
+
+histogram_snapshot histogram::snapshot() const {
+  histogram_snapshot result;
+  for (std::size_t i = 0; i < bucket_count; i++) {
+    const auto n = buckets_[i].load(std::memory_order_relaxed);
+    if (n == 0)
+      continue;
+    result.buckets.push_back({bucket_upper(i), n});
+    // the total is taken from the buckets so percentiles add up even
+    // while values are recorded
+    result.count += n;
+  }
+  result.sum = sum_.load(std::memory_order_relaxed);
+  result.max = max_.load(std::memory_order_relaxed);
+  result.min = result.count == 0 ? 0 : min_.load(std::memory_order_relaxed);
+  return result;
+}
+
+void histogram::reset() noexcept {
+  for (auto &b : buckets_)
+    b.store(0, std::memory_order_relaxed);
+  count_ = 0;
+  sum_ = 0;
+  min_ = UINT64_MAX;
+  max_ = 0;
+}
+
+void metrics_snapshot::merge(metrics_snapshot other) {
+  std::move(other.counters.begin(), other.counters.end(),
+            std::back_inserter(counters));
+  std::move(other.gauges.begin(), other.gauges.end(),
+            std::back_inserter(gauges));
+  std::move(other.histograms.begin(), other.histograms.end(),
+            std::back_inserter(histograms));
+}
+
+void metrics_snapshot::add_label(const std::string &name,
+                                 const std::string &value) {
+  for (auto &[series, v] : counters)
+    series.labels.emplace_back(name, value);
+  for (auto &[series, v] : gauges)
+    series.labels.emplace_back(name, value);
+  for (auto &[series, h] : histograms)
+    series.labels.emplace_back(name, value);
+}
+
+std::string metrics_snapshot::to_json() const {
+  std::string out = "{\"counters\":[";
+  for (std::size_t i = 0; i < counters.size(); i++) {
+    out += i == 0 ? "{" : ",{";
+    out += json_series(counters[i].first) +
+           ",\"value\":" + std::to_string(counters[i].second) + "}";
+  }
+  out += "],\"gauges\":[";
+  for (std::size_t i = 0; i < gauges.size(); i++) {
+    out += i == 0 ? "{" : ",{";
+    out += json_series(gauges[i].first) +
+           ",\"value\":" + number(gauges[i].second) + "}";
+  }
+  out += "],\"histograms\":[";
+  for (std::size_t i = 0; i < histograms.size(); i++) {
+    const auto &h = histograms[i].second;
+    out += i == 0 ? "{" : ",{";
+    out += json_series(histograms[i].first);
+    out += ",\"count\":" + std::to_string(h.count);
+    out += ",\"sum_ns\":" + std::to_string(h.sum);
+    out += ",\"min_ns\":" + std::to_string(h.min);
+    out += ",\"max_ns\":" + std::to_string(h.max);
+    out += ",\"mean_ns\":" + number(h.mean());
+    out += ",\"p50_ns\":" + std::to_string(h.percentile(50));
+    out += ",\"p90_ns\":" + std::to_string(h.percentile(90));
+    out += ",\"p99_ns\":" + std::to_string(h.percentile(99));
+    out += ",\"p999_ns\":" + std::to_string(h.percentile(99.9));
+    out += "}";
+  }
+  return out + "]}";
+}
+
+std::string metrics_snapshot::to_prometheus() const {
+  prometheus_writer out;
+  for (const auto &[series, value] : counters) {
+    out.type(series.name, "counter");
+    out.sample(series.name, prometheus_labels(series),
+               std::to_string(value));
+  }
+  for (const auto &[series, value] : gauges) {
+    out.type(series.name, "gauge");
+    out.sample(series.name, prometheus_labels(series), number(value));
+  }
+  for (const auto &[series, h] : histograms) {
+    out.type(series.name, "summary");
+    for (const auto q : exported_quantiles) {
+      out.sample(series.name,
+                 prometheus_labels(series, {{"quantile", number(q / 100)}}),
+                 seconds(h.percentile(q)));
+    }
+    out.sample(series.name + "_sum", prometheus_labels(series),
+               seconds(h.sum));
+    out.sample(series.name + "_count", prometheus_labels(series),
+               std::to_string(h.count));
+  }
+  return out.take();
+}
+
+endpoint_metrics::endpoint_metrics() noexcept
+    : since_(std::chrono::steady_clock::now().time_since_epoch().count()) {}
+
+void endpoint_metrics::record(std::size_t transferred,
+                              std::chrono::nanoseconds took,
+                              errors status) noexcept {
+  transfers.fetch_add(1, std::memory_order_relaxed);
+  // partial transfers still moved data
+  bytes.fetch_add(transferred, std::memory_order_relaxed);
+  // cancelled transfers did not fail
+  if (status == errors::TIMEOUT)
+    timeouts.fetch_add(1, std::memory_order_relaxed);
+  else if (status != errors::SUCCESS && status != errors::INTERRUPTED)
+    failures.fetch_add(1, std::memory_order_relaxed);
+  duration.record(took);
+}
+
+void endpoint_metrics::reset() noexcept {
+  transfers = 0;
+  bytes = 0;
+  timeouts = 0;
+  failures = 0;
+  duration.reset();
+  since_ = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+metrics_snapshot
+endpoint_metrics::snapshot(const std::string &endpoint) const {
+  const std::vector<std::pair<std::string, std::string>> labels{
+      {"endpoint", endpoint}};
+  metrics_snapshot result;
+  const auto total = bytes.load(std::memory_order_relaxed);
+  result.counters = {
+      {{"usb_transfers_total", labels}, transfers.load()},
+      {{"usb_transfer_bytes_total", labels}, total},
+      {{"usb_transfer_timeouts_total", labels}, timeouts.load()},
+      {{"usb_transfer_failures_total", labels}, failures.load()},
+  };
+  const std::chrono::duration<double> elapsed{
+      std::chrono::steady_clock::now() -
+      std::chrono::steady_clock::time_point{
+          std::chrono::steady_clock::duration{since_.load()}}};
+  result.gauges = {{{"usb_transfer_bytes_per_second", labels},
+                    elapsed.count() > 0
+                        ? static_cast<double>(total) / elapsed.count()
+                        : 0.0}};
+  result.histograms = {
+      {{"usb_transfer_duration_seconds", labels}, duration.snapshot()}};
+  return result;
+}
+
+void endpoint::record(int transferred,
+                      std::chrono::steady_clock::time_point start,
+                      int status) const noexcept {
+  metrics_->record(static_cast<std::size_t>(std::max(transferred, 0)),
+                   std::chrono::steady_clock::now() - start,
+                   static_cast<errors>(status));
+}
+
+} // namespace usb
@@ -0,0 +1,171 @@
+#include "libusb++/stream_reader.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace usb {
+
+stream_reader::chunk::chunk(chunk &&other) noexcept
+    : reader_(std::exchange(other.reader_, nullptr)), index_(other.index_),
+      size_(other.size_) {}
+
+stream_reader::chunk &stream_reader::chunk::operator=(chunk &&other) noexcept {
+  if (this != &other) {
+    reset();
+    reader_ = std::exchange(other.reader_, nullptr);
+    index_ = other.index_;
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+gsl::span<const uint8_t> stream_reader::chunk::data() const noexcept {
+  if (reader_ == nullptr)
+    return {};
+  return gsl::span<const uint8_t>(reader_->buffers_[index_]).first(size_);
+}
+
+void stream_reader::chunk::reset() noexcept {
+  // the free queue has room for all buffers, pushing can't fail
+  if (reader_ != nullptr)
+    std::exchange(reader_, nullptr)->free_.push(index_);
+}
+
+stream_reader::stream_reader(in_endpoint &ep, config cfg)
+    : ep_(ep), config_(cfg),
+      buffers_(std::max<std::size_t>(cfg.transfers, 1) + cfg.queue_depth,
+               std::vector<uint8_t>(cfg.buffer_size)),
+      free_(buffers_.size()), filled_(buffers_.size()) {
+  const auto transfers = std::max<std::size_t>(cfg.transfers, 1);
+  for (std::size_t i = 0; i < buffers_.size(); i++) {
+    if (i < transfers) {
+      auto &s = *slots_.emplace_back(std::make_unique<slot>());
+      s.index = i;
+      s.t.set_callback([this, &s](transfer &) { on_complete(s); });
+    } else {
+      free_.push(i);
+    }
+  }
+}
+
+stream_reader::~stream_reader() { stop(); }
+
+void stream_reader::start() {
+  if (running_)
+    return;
+  // the event thread may still be around after an error
+  if (events_.joinable())
+    events_.join();
+  {
+    std::lock_guard lock{mutex_};
+    error_ = nullptr;
+  }
+  running_ = true;
+  try {
+    for (auto &s : slots_)
+      submit(*s);
+  } catch (...) {
+    running_ = false;
+    for (auto &s : slots_)
+      s->t.cancel();
+    // let the transfers that were submitted finish
+    handle_events();
+    throw;
+  }
+  events_ = std::thread{[this] { handle_events(); }};
+}
+
+void stream_reader::stop() {
+  running_ = false;
+  if (events_.joinable())
+    events_.join();
+  data_available_.notify_all();
+}
+
+void stream_reader::handle_events() {
+  auto &ctx = ep_.owning_context();
+  try {
+    while (running_)
+      ctx.handle_events(std::chrono::milliseconds(100));
+    for (auto &s : slots_)
+      s->t.cancel();
+    while (std::any_of(slots_.begin(), slots_.end(),
+                       [](const auto &s) { return s->t.in_flight(); }))
+      ctx.handle_events(std::chrono::milliseconds(100));
+  } catch (...) {
+    fail(std::current_exception());
+  }
+}
+
+void stream_reader::submit(slot &s) {
+  // no timeout, the device decides when data is available
+  ep_.async_bulk_read(s.t, buffers_[s.index], std::chrono::milliseconds(0));
+}
+
+void stream_reader::on_complete(slot &s) noexcept {
+  const auto status = s.t.status();
+  if (status == transfer_status::cancelled)
+    return;
+  if (status != transfer_status::completed) {
+    fail(std::make_exception_ptr(usb_error(to_error(status))));
+    return;
+  }
+
+  const auto size = static_cast<std::size_t>(s.t.actual_length());
+  if (size > 0) {
+    if (auto next = free_.pop()) {
+      filled_.push({s.index, size});
+      s.index = *next;
+      bytes_ += size;
+      buffers_received_++;
+      // the consumer might just be about to wait, make sure it is either
+      // waiting or sees the new buffer
+      { std::lock_guard lock{mutex_}; }
+      data_available_.notify_one();
+    } else {
+      // nowhere to put the data without stalling the endpoint
+      overflows_++;
+    }
+  }
+
+  if (!running_)
+    return;
+  try {
+    submit(s);
+  } catch (...) {
+    fail(std::current_exception());
+  }
+}
+
+void stream_reader::fail(std::exception_ptr error) noexcept {
+  {
+    std::lock_guard lock{mutex_};
+    if (!error_)
+      error_ = error;
+  }
+  running_ = false;
+  data_available_.notify_all();
+}
+
+stream_reader::chunk stream_reader::next(std::chrono::milliseconds timeout) {
+  if (auto f = filled_.pop())
+    return chunk{this, f->index, f->size};
+
+  starvations_++;
+  std::unique_lock lock{mutex_};
+  data_available_.wait_for(lock, timeout, [this] {
+    return !filled_.empty() || error_ || !running_;
+  });
+  if (auto f = filled_.pop())
+    return chunk{this, f->index, f->size};
+  if (error_)
+    std::rethrow_exception(std::exchange(error_, nullptr));
+  return {};
+}
+
+stream_reader::statistics stream_reader::stats() const noexcept {
+  return {bytes_.load(), buffers_received_.load(), overflows_.load(),
+          starvations_.load()};
+}
+
+} // namespace usb
@@ -0,0 +1,176 @@
+#include "libusb++/transfer.hpp"
+#include "libusb++/libusb++.hpp"
+#include "libusb++/metrics.hpp"
+
+namespace usb {
+
+errors to_error(transfer_status status) noexcept {
+  switch (status) {
+  case transfer_status::completed:
+    return errors::SUCCESS;
+  case transfer_status::timed_out:
+    return errors::TIMEOUT;
+  case transfer_status::cancelled:
+    return errors::INTERRUPTED;
+  case transfer_status::stall:
+    return errors::BROKEN_PIPE;
+  case transfer_status::no_device:
+    return errors::NO_DEVICE;
+  case transfer_status::overflow:
+    return errors::BUFFER_OVERFLOW;
+  case transfer_status::error:
+    break;
+  }
+  return errors::IO_ERROR;
+}
+
+transfer::transfer()
+    : transfer_(libusb_alloc_transfer(0)),
+      anchor_(std::make_shared<anchor>()) {
+  if (transfer_ == nullptr)
+    throw usb_error(errors::NO_MEM);
+  transfer_->user_data = this;
+  anchor_->self = this;
+}
+
+transfer::~transfer() {
+  {
+    // waits for a callback running on another thread
+    std::lock_guard lock{anchor_->mutex};
+    anchor_->self = nullptr;
+  }
+  if (in_flight_) {
+    // libusb owns the transfer until the completion was reported through
+    // the callback. That is also the case if cancelling fails because the
+    // transfer completed, but the callback was not dispatched yet.
+    cancel();
+    while (in_flight_) {
+      timeval tv{0, 100000};
+      const auto result =
+          libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+      if (result != 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+        // freeing now would let libusb complete freed memory, the
+        // transfer is released once it completes instead
+        transfer_->callback = &on_orphan_complete;
+        return;
+      }
+    }
+  }
+  libusb_free_transfer(transfer_);
+}
+
+void transfer::fill_bulk(libusb_context *ctx, libusb_device_handle *handle,
+                         unsigned char endpoint, gsl::span<uint8_t> buffer,
+                         std::chrono::milliseconds timeout) {
+  if (in_flight_)
+    throw usb_error(errors::BUSY);
+  ctx_ = ctx;
+  metrics_ = nullptr;
+  libusb_fill_bulk_transfer(transfer_, handle, endpoint, buffer.data(),
+                            static_cast<int>(buffer.size()), &on_complete,
+                            this, static_cast<unsigned int>(timeout.count()));
+}
+
+void transfer::fill_control(libusb_context *ctx, libusb_device_handle *handle,
+                            gsl::span<uint8_t> buffer,
+                            std::chrono::milliseconds timeout) {
+  if (in_flight_)
+    throw usb_error(errors::BUSY);
+  if (buffer.size() < LIBUSB_CONTROL_SETUP_SIZE)
+    throw usb_error(errors::INVALID_PARAM);
+  ctx_ = ctx;
+  metrics_ = nullptr;
+  libusb_fill_control_transfer(transfer_, handle, buffer.data(), &on_complete,
+                               this,
+                               static_cast<unsigned int>(timeout.count()));
+}
+
+void transfer::submit() {
+  if (metrics_ != nullptr)
+    submitted_ = std::chrono::steady_clock::now();
+  // set before submitting, the completion may run on another thread
+  in_flight_ = true;
+  const auto status{libusb_submit_transfer(transfer_)};
+  if (status != LIBUSB_SUCCESS) {
+    in_flight_ = false;
+    throw usb_error(static_cast<errors>(status));
+  }
+}
+
+bool transfer::cancel() noexcept {
+  return in_flight_ && libusb_cancel_transfer(transfer_) == LIBUSB_SUCCESS;
+}
+
+transfer_status transfer::status() const noexcept {
+  return static_cast<transfer_status>(transfer_->status);
+}
+
+gsl::span<uint8_t> transfer::buffer() const noexcept {
+  return {transfer_->buffer, static_cast<std::size_t>(transfer_->length)};
+}
+
+gsl::span<uint8_t> transfer::received() const noexcept {
+  return {transfer_->buffer,
+          static_cast<std::size_t>(transfer_->actual_length)};
+}
+
+int transfer::actual_length() const noexcept {
+  return transfer_->actual_length;
+}
+
+void LIBUSB_CALL transfer::on_complete(libusb_transfer *t) {
+  // the destructor waits for in_flight_ to be cleared, until then self
+  // is valid even if it is being destroyed
+  auto &self = *static_cast<transfer *>(t->user_data);
+  const auto anchor = self.anchor_;
+  std::lock_guard lock{anchor->mutex};
+  if (self.metrics_ != nullptr)
+    self.metrics_->record(static_cast<std::size_t>(t->actual_length),
+                          std::chrono::steady_clock::now() - self.submitted_,
+                          to_error(self.status()));
+  const bool notify = anchor->self != nullptr && self.callback_;
+  self.in_flight_ = false;
+  if (!notify)
+    return;
+  if (self.executor_) {
+    // the owner sees the transfer done and may destroy it before the
+    // handler runs, the anchor tells
+    self.executor_([anchor] {
+      std::lock_guard lock{anchor->mutex};
+      if (anchor->self != nullptr && anchor->self->callback_)
+        anchor->self->callback_(*anchor->self);
+    });
+  } else {
+    self.callback_(self);
+  }
+}
+
+void LIBUSB_CALL transfer::on_orphan_complete(libusb_transfer *t) {
+  libusb_free_transfer(t);
+}
+
+void out_endpoint::async_bulk_write(transfer &t, gsl::span<const uint8_t> data,
+                                    std::chrono::milliseconds timeout) {
+  // const_cast is fine since libusb does not alter data for out endpoints
+  t.fill_bulk(ctx_->get(), handle_, endpoint_,
+              gsl::span<uint8_t>(const_cast<uint8_t *>(data.data()),
+                                 data.size()),
+              timeout);
+  t.set_metrics(metrics_);
+  t.submit();
+}
+
+void in_endpoint::async_bulk_read(transfer &t, gsl::span<uint8_t> data,
+                                  std::chrono::milliseconds timeout) {
+  t.fill_bulk(ctx_->get(), handle_, endpoint_, data, timeout);
+  t.set_metrics(metrics_);
+  t.submit();
+}
+
+void interface::async_control(transfer &t, gsl::span<uint8_t> buffer,
+                              std::chrono::milliseconds timeout) {
+  t.fill_control(ctx_->get(), handle_, buffer, timeout);
+  t.submit();
+}
+
+} // namespace usb
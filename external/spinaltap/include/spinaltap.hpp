@@ -2,8 +2,21 @@
 #define spinaltap_spinaltap_h
 
 #include "gsl/gsl"
+#include "libusb++/mpsc_queue.hpp"
+#include "spinaltap/bitstream.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace usb {
 class out_endpoint;
@@ -13,6 +26,11 @@ class interface;
 
 namespace spinaltap {
 
+class transport;
+class trace_ring;
+struct device_metrics;
+enum class trace_event : uint8_t;
+
 enum class cmd : uint8_t {
   write = 0x01,
   read = 0x02,
@@ -20,31 +38,287 @@ enum class cmd : uint8_t {
   writeStream8 = 0x03,
   readStream8 = 0x04,
   readStream32 = 0x05,
-  readModifyWrite = 0x06
+  readModifyWrite = 0x06,
+  wait = 0x07
+};
+
+enum class condition : uint8_t { equal = 0, not_equal = 1, greater_equal = 2 };
+
+// condition on the masked value of a register, e.g. for poll()
+struct wait_condition {
+  uint32_t address;
+  uint32_t mask;
+  uint32_t expected;
+  condition cond = condition::equal;
+
+  [[nodiscard]] bool matches(uint32_t value) const noexcept;
+};
+
+// optional protocol extensions the bridge implements
+struct features {
+  // cmd::wait is evaluated on the device, otherwise it is emulated by
+  // polling from the host
+  bool wait = false;
+};
+
+// how the device caches configuration registers, see device::setCaching
+enum class caching : uint8_t {
+  // every access goes to the device
+  none,
+  // reads are served from a shadow copy, writes are sent right away
+  write_through,
+  // reads are served from a shadow copy, writes are only recorded and sent
+  // together with the next command that goes to the device (or sync()).
+  // Several writes to the same register are combined to a single one.
+  write_back
+};
+
+/// Buffer for stream payloads that is sent without copying
+///
+/// Room for the command header is reserved in front of the payload, the
+/// whole buffer is handed to libusb as is. Get one from
+/// device::allocateBuffer() to reuse the memory of earlier transfers.
+class stream_buffer {
+public:
+  constexpr static std::size_t header_room = 6;
+
+  stream_buffer() : storage_(header_room) {}
+  explicit stream_buffer(std::size_t size) : storage_(header_room + size) {}
+
+  [[nodiscard]] gsl::span<std::byte> payload() noexcept {
+    return gsl::as_writable_bytes(gsl::span(storage_)).subspan(header_room);
+  }
+  [[nodiscard]] std::size_t size() const noexcept {
+    return storage_.size() - header_room;
+  }
+  void resize(std::size_t size) { storage_.resize(header_room + size); }
+
+private:
+  friend class device;
+  stream_buffer(std::vector<uint8_t> &&storage, std::size_t size)
+      : storage_(std::move(storage)) {
+    resize(size);
+  }
+
+  std::vector<uint8_t> storage_;
 };
+
+/// Connection to a bridge
+///
+/// A device may be used from several threads. The thread that currently
+/// drives the transport (the I/O owner) stages its own commands and the
+/// ones other threads queued meanwhile, so they share transfers. Threads
+/// blocked in a call either become the owner or wait for the owner to
+/// complete their commands. Handlers are called by the owner, which may
+/// be any of the threads using the device.
 class device {
 public:
-  device(usb::out_endpoint &out_ep, usb::in_endpoint &in_ep);
+  using handler = std::function<void(std::exception_ptr)>;
+  using read_handler = std::function<void(std::exception_ptr, uint32_t)>;
+  using wait_handler = std::function<void(std::exception_ptr, bool)>;
+
+  constexpr static std::size_t default_max_in_flight = 16;
+  constexpr static std::chrono::milliseconds default_timeout{500};
+
+  device(usb::out_endpoint &out_ep, usb::in_endpoint &in_ep,
+         std::size_t max_in_flight = default_max_in_flight);
+  // the transport has to outlive the device
+  explicit device(transport &transport,
+                  std::size_t max_in_flight = default_max_in_flight);
+  explicit device(std::unique_ptr<transport> transport,
+                  std::size_t max_in_flight = default_max_in_flight);
+  ~device();
+  device(const device &) = delete;
+  device &operator=(const device &) = delete;
 
   uint32_t readRegister(uint32_t address);
+  // reads all registers with a single transfer, out[i] is the value of
+  // addresses[i]. Note that readStream reads a single address repeatedly,
+  // it can't be used for blocks of registers.
+  void readRegisters(gsl::span<const uint32_t> addresses,
+                     gsl::span<uint32_t> out);
+  // streams of any length are split into several commands that are
+  // pipelined like other commands
   void readStream(uint32_t address, gsl::span<std::byte> data);
   void readStream(uint32_t address, gsl::span<uint32_t> data);
 
+  // writes are posted: they return as soon as the command is queued,
+  // errors are reported by the next blocking call or sync()
   void writeRegister(uint32_t address, uint32_t value);
   void writeStream(uint32_t address, gsl::span<const std::byte> data);
+  // zero-copy variant, the memory of buffer is reused for later transfers.
+  // Buffers longer than a single command can carry are copied.
+  void writeStream(uint32_t address, stream_buffer buffer);
   void
   writeRegisters(const std::vector<std::pair<uint32_t, uint32_t>> &toWrite);
 
+  // update the bits selected by mask to value in a single command,
+  // the register is set to (old & ~mask) | (value & mask). Like writes
+  // the command is posted, fetchModifyWrite waits and returns the old value
   void readModifyWrite(uint32_t address, uint32_t mask, uint32_t value);
+  uint32_t fetchModifyWrite(uint32_t address, uint32_t mask, uint32_t value);
+  // wait until (register & mask) == expected, returns false on timeout
   [[nodiscard]] bool
   poll(uint32_t address, uint32_t mask, uint32_t expected,
        std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
+  [[nodiscard]] bool poll(const wait_condition &condition,
+                          std::chrono::milliseconds timeout);
+
+  void setFeatures(const features &supported) noexcept;
+  [[nodiscard]] const features &supportedFeatures() const noexcept;
+
+  // configuration registers are only changed by the host and may be
+  // cached, all other registers are volatile (e.g. status or FIFOs).
+  // Drivers mark their configuration registers, caching is off unless
+  // enabled with setCaching.
+  void markConfiguration(uint32_t address);
+  void markVolatile(uint32_t address);
+  void setCaching(caching mode);
+  [[nodiscard]] caching registerCaching() const noexcept;
+  // forget all cached values, e.g. after the bridge was reset.
+  // Writes that were not sent yet are sent first.
+  void invalidateCache();
+
+  // record every command sent and completed in ring (nullptr to stop),
+  // the ring has to outlive the device or be removed before
+  void setTrace(trace_ring *ring);
+  // latency histograms and counters, always recorded
+  [[nodiscard]] device_metrics &metrics() noexcept { return *metrics_; }
+  [[nodiscard]] const device_metrics &metrics() const noexcept {
+    return *metrics_;
+  }
+
+  // asynchronous interface, handlers are called from within
+  // processEvents (also called by all blocking functions) and must not throw.
+  // Reads served from the register cache complete right away.
+  void readRegisterAsync(uint32_t address, read_handler done);
+  std::future<uint32_t> readRegisterAsync(uint32_t address);
+  void readRegistersAsync(gsl::span<const uint32_t> addresses,
+                          gsl::span<uint32_t> out, handler done);
+  void writeRegisterAsync(uint32_t address, uint32_t value, handler done);
+  std::future<void> writeRegisterAsync(uint32_t address, uint32_t value);
+  void readModifyWriteAsync(uint32_t address, uint32_t mask, uint32_t value,
+                            read_handler done);
+  void readStreamAsync(uint32_t address, gsl::span<std::byte> data,
+                       handler done);
+  void writeStreamAsync(uint32_t address, gsl::span<const std::byte> data,
+                        handler done);
+  void writeStreamAsync(uint32_t address, stream_buffer buffer, handler done);
+  // done is called with false if the condition was not met within timeout
+  void waitAsync(const wait_condition &condition,
+                 std::chrono::milliseconds timeout, wait_handler done);
+
+  // run fn as the I/O owner: right away if no other thread drives the
+  // device, otherwise by the thread that does. Commands staged by
+  // submissions that are run together share a transfer. Exceptions thrown
+  // by fn if it did not run right away are reported like errors of
+  // posted writes.
+  void post(std::function<void()> fn);
+  // run fn as the I/O owner, waiting until other threads released the
+  // device. Commands fn queues are not interleaved with those of other
+  // threads, a flush at its end sends them in a single transfer.
+  void exclusive(const std::function<void()> &fn);
+
+  // low level interface: queue an encoded command (see protocol.hpp),
+  // the payload of the reply is written to reply. Queued commands are
+  // sent together as a single transfer on flush(). Commands that take time
+  // on the device (cmd::wait) pass the additional time as device_time.
+  void enqueue(gsl::span<const uint8_t> command, gsl::span<uint8_t> reply,
+               handler done, std::chrono::milliseconds device_time = {});
+  void flush();
+
+  // process completions for at most timeout
+  void processEvents(std::chrono::milliseconds timeout);
+  // wait for completion of all commands in flight
+  void sync();
+  template <typename T> T wait(std::future<T> future);
+  [[nodiscard]] std::size_t inFlight() const;
+
+  // buffer with room for size payload bytes, backed by memory of
+  // earlier transfers if possible
+  [[nodiscard]] stream_buffer allocateBuffer(std::size_t size);
 
 private:
-  usb::out_endpoint &out_ep_;
-  usb::in_endpoint &in_ep_;
+  struct request;
+  class io_lock;
+  struct shadow_register {
+    uint32_t value{0};
+    bool valid{false};
+    bool dirty{false};
+    // counts commands that access the register, replies only update the
+    // shadow if no other command was queued after them
+    uint64_t generation{0};
+  };
+
+  request &stage(gsl::span<const uint8_t> command, std::size_t reply_size);
+  request &stage_request(std::size_t reply_size);
+  void recycle(std::vector<uint8_t> &&buffer);
+  void wait_for_capacity();
+  void post_reads();
+  void on_receive(gsl::span<const uint8_t> data);
+  void fail_all(std::exception_ptr error);
+  void rethrow_deferred();
+  void defer_error(std::exception_ptr error) noexcept;
+  void emulate_wait(const wait_condition &condition,
+                    std::chrono::steady_clock::time_point deadline,
+                    wait_handler done);
+  shadow_register *shadowed(uint32_t address) noexcept;
+  void snoop(request &r, gsl::span<const uint8_t> command);
+  void update_shadow(const request &r);
+  void stage_dirty();
+  template <typename Fn> io_lock try_own(Fn &&fn);
+  void acquired() noexcept;
+  void release() noexcept;
+  void drain() noexcept;
+  void flush_now();
+  void make_progress();
+  void notify_progress();
+  void trace(const request &r, trace_event event) noexcept;
+
+  std::unique_ptr<transport> owned_transport_;
+  transport &transport_;
+  const std::size_t max_in_flight_;
+  uint8_t sequence_{0};
+  features features_;
+  // time of the last reply data received, used for timeouts
+  std::chrono::steady_clock::time_point last_progress_;
+  std::vector<uint8_t> staging_;
+  std::vector<std::unique_ptr<request>> staged_;
+  std::deque<std::unique_ptr<request>> pending_;
+  std::exception_ptr deferred_error_;
+  // memory of finished stream buffers
+  std::vector<std::vector<uint8_t>> free_buffers_;
+  // sink for replies nobody is interested in
+  std::array<uint8_t, 4> discard_;
+  caching caching_{caching::none};
+  std::map<uint32_t, shadow_register> shadow_;
+  // write back registers in the order they were first written
+  std::vector<uint32_t> dirty_;
+  trace_ring *trace_{nullptr};
+  std::unique_ptr<device_metrics> metrics_;
+
+  // held by the I/O owner, all state above is guarded by it
+  mutable std::recursive_mutex io_mutex_;
+  int io_depth_{0};
+  // flushes are held back while submissions are run to merge them
+  bool draining_{false};
+  // submissions of threads that are not the owner
+  usb::mpsc_queue<std::function<void()>> submissions_;
+  // guards deferred_error_, which is set from handlers of any thread
+  std::mutex error_mutex_;
+  // signaled whenever the owner processed events or released the device
+  std::mutex progress_mutex_;
+  std::condition_variable progress_;
+  uint64_t progress_epoch_{0};
 };
 
+template <typename T> T device::wait(std::future<T> future) {
+  while (future.wait_for(std::chrono::seconds(0)) !=
+         std::future_status::ready)
+    make_progress();
+  return future.get();
+}
+
 namespace endian {
 void store(uint16_t v, gsl::span<uint8_t, 2> buffer) noexcept;
 void store(uint32_t v, gsl::span<uint8_t, 4> buffer) noexcept;
@@ -59,9 +333,12 @@ template <> uint32_t inline load(gsl::span<uint8_t> buffer) noexcept {
 } // namespace endian
 
 namespace control {
-void load_bitstream(const usb::interface &intf,
-                    const std::filesystem::path &location);
-}
+// streams a bitstream file to the bridge, progress is reported after
+// every chunk sent
+void load_bitstream(usb::interface &intf,
+                    const std::filesystem::path &location,
+                    progress_handler on_progress = {});
+} // namespace control
 } // namespace spinaltap
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef spinaltap_bitstream_h
+#define spinaltap_bitstream_h
+
+#include "gsl/gsl"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <vector>
+
+namespace spinaltap {
+
+struct upload_progress {
+  std::uintmax_t done;
+  std::uintmax_t total;
+  std::chrono::steady_clock::duration elapsed;
+
+  // bytes per second
+  [[nodiscard]] double rate() const noexcept;
+};
+using progress_handler = std::function<void(const upload_progress &)>;
+
+/// Reads Xilinx bitstreams in chunks instead of loading the whole file
+///
+/// Vivado writes bitstreams in serial or parallel (SelectMAP) bitorder,
+/// the order is detected from the synchronization word close to the
+/// start of the file. read() always returns data in parallel bitorder.
+///
+/// see Series 7 Configuration Guide, p. 83
+/// https://www.xilinx.com/support/documentation/user_guides/ug470_7Series_Config.pdf
+class bitstream_reader {
+public:
+  // the synchronization word is searched for within that many bytes
+  constexpr static std::size_t sync_search_limit = 64 * 1024;
+
+  explicit bitstream_reader(const std::filesystem::path &location);
+
+  [[nodiscard]] std::uintmax_t size() const noexcept { return size_; }
+  [[nodiscard]] std::uintmax_t position() const noexcept { return position_; }
+  // true if the file is in serial bitorder and is flipped while reading
+  [[nodiscard]] bool flipped() const noexcept { return flip_; }
+
+  // returns the number of bytes read, less than out.size() only at the
+  // end of the file
+  std::size_t read(gsl::span<char> out);
+
+private:
+  std::ifstream file_;
+  std::uintmax_t size_;
+  std::uintmax_t position_{0};
+  bool flip_;
+  // start of the file, read for bitorder detection
+  std::vector<char> head_;
+};
+
+} // namespace spinaltap
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef spinaltap_coro_h
+#define spinaltap_coro_h
+
+#include "libusb++/coro.hpp"
+
+// like libusb++/coro.hpp this is empty unless compiled as C++20
+#ifdef LIBUSBXX_COROUTINES
+
+#include "spinaltap.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace spinaltap {
+
+using usb::spawn;
+using usb::task;
+
+namespace details {
+
+// state shared by the awaitables, completions may happen right away (e.g.
+// cached reads), the coroutine then continues without suspending
+class operation_base {
+public:
+  bool await_ready() const noexcept { return false; }
+
+protected:
+  bool suspend(std::coroutine_handle<> h) noexcept {
+    handle_ = h;
+    // done before the handler was passed on, don't suspend
+    return !suspended_.exchange(true, std::memory_order_acq_rel);
+  }
+  void complete(std::exception_ptr error) noexcept {
+    error_ = error;
+    if (suspended_.exchange(true, std::memory_order_acq_rel))
+      std::coroutine_handle<>{handle_}.resume();
+  }
+  void rethrow() const {
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+private:
+  std::coroutine_handle<> handle_;
+  std::exception_ptr error_;
+  // set by whichever of suspend and complete runs first, complete may run
+  // on the thread handling events while await_suspend is still running
+  std::atomic<bool> suspended_{false};
+};
+
+template <typename T> class operation : public operation_base {
+public:
+  using initiate_fn = std::function<void(
+      std::function<void(std::exception_ptr, T)> done)>;
+
+  explicit operation(initiate_fn initiate) : initiate_(std::move(initiate)) {}
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    initiate_([this](std::exception_ptr error, T value) {
+      value_ = value;
+      complete(error);
+    });
+    return suspend(h);
+  }
+  T await_resume() {
+    rethrow();
+    return *value_;
+  }
+
+private:
+  initiate_fn initiate_;
+  std::optional<T> value_;
+};
+
+template <> class operation<void> : public operation_base {
+public:
+  using initiate_fn = std::function<void(device::handler done)>;
+
+  explicit operation(initiate_fn initiate) : initiate_(std::move(initiate)) {}
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    initiate_([this](std::exception_ptr error) { complete(error); });
+    return suspend(h);
+  }
+  void await_resume() { rethrow(); }
+
+private:
+  initiate_fn initiate_;
+};
+
+} // namespace details
+
+// co_await-able register and stream access, built on the asynchronous
+// interface of device. Coroutines are resumed from within
+// device::processEvents, so a single thread calling processEvents can
+// drive any number of sessions. Unlike the blocking calls writes are not
+// posted, the coroutine continues once the bridge acknowledged them.
+
+[[nodiscard]] inline details::operation<uint32_t>
+async_read_register(device &dev, uint32_t address) {
+  return details::operation<uint32_t>{[&dev, address](auto done) {
+    dev.readRegisterAsync(address, std::move(done));
+  }};
+}
+
+[[nodiscard]] inline details::operation<void>
+async_write_register(device &dev, uint32_t address, uint32_t value) {
+  return details::operation<void>{[&dev, address, value](auto done) {
+    dev.writeRegisterAsync(address, value, std::move(done));
+  }};
+}
+
+// returns the old value of the register
+[[nodiscard]] inline details::operation<uint32_t>
+async_read_modify_write(device &dev, uint32_t address, uint32_t mask,
+                        uint32_t value) {
+  return details::operation<uint32_t>{[&dev, address, mask, value](auto done) {
+    dev.readModifyWriteAsync(address, mask, value, std::move(done));
+  }};
+}
+
+[[nodiscard]] inline details::operation<void>
+async_read_stream(device &dev, uint32_t address, gsl::span<std::byte> data) {
+  return details::operation<void>{[&dev, address, data](auto done) {
+    dev.readStreamAsync(address, data, std::move(done));
+  }};
+}
+
+[[nodiscard]] inline details::operation<void>
+async_write_stream(device &dev, uint32_t address,
+                   gsl::span<const std::byte> data) {
+  return details::operation<void>{[&dev, address, data](auto done) {
+    dev.writeStreamAsync(address, data, std::move(done));
+  }};
+}
+
+// returns false if the condition was not met within timeout
+[[nodiscard]] inline details::operation<bool>
+async_wait(device &dev, const wait_condition &condition,
+           std::chrono::milliseconds timeout) {
+  return details::operation<bool>{[&dev, condition, timeout](auto done) {
+    dev.waitAsync(condition, timeout, std::move(done));
+  }};
+}
+
+} // namespace spinaltap
+
+#endif
+#endif
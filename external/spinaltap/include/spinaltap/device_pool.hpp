@@ -0,0 +1,114 @@
+#ifndef spinaltap_device_pool_h
+#define spinaltap_device_pool_h
+
+#include "libusb++/device_filter.hpp"
+#include "libusb++/libusb++.hpp"
+#include "spinaltap.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace spinaltap {
+
+/// Single board of a device_pool
+///
+/// Every board uses its own USB context, so events of one board are
+/// handled by the thread working on it and boards don't share any state.
+class board {
+public:
+  struct identity {
+    uint8_t bus;
+    uint8_t address;
+    // empty if the board has no serial number
+    std::string serial;
+  };
+  struct config {
+    // reset the board before it is configured
+    bool reset = false;
+    int configuration = 1;
+    int interface = 0;
+    unsigned char out_endpoint = 2;
+    // without the direction bit
+    unsigned char in_endpoint = 1;
+    std::size_t max_in_flight = device::default_max_in_flight;
+  };
+
+  board(const identity &id, const config &cfg);
+  ~board();
+  board(const board &) = delete;
+  board &operator=(const board &) = delete;
+
+  [[nodiscard]] const identity &id() const noexcept { return id_; }
+  // e.g. to load a bitstream before device() is used
+  [[nodiscard]] usb::interface &usb_interface() noexcept { return *intf_; }
+  // opened on first use, the bridge has to be running by then
+  [[nodiscard]] device &dev();
+  // close the device, e.g. before the bridge is reconfigured
+  void close_device() noexcept;
+
+  // error of the last job that failed, boards that failed are skipped by
+  // device_pool::run until the error is cleared
+  [[nodiscard]] bool failed() const noexcept { return error_ != nullptr; }
+  [[nodiscard]] std::exception_ptr error() const noexcept { return error_; }
+  void clear_error() noexcept { error_ = nullptr; }
+
+private:
+  friend class device_pool;
+
+  identity id_;
+  config config_;
+  usb::context ctx_;
+  std::optional<usb::device_handle> handle_;
+  std::optional<usb::interface> intf_;
+  std::optional<usb::out_endpoint> out_ep_;
+  std::optional<usb::in_endpoint> in_ep_;
+  std::unique_ptr<device> device_;
+  std::exception_ptr error_;
+};
+
+/// All boards matching a filter, driven in parallel
+///
+/// Jobs run on one thread per board, errors of a board are recorded on
+/// the board and don't affect the others. Since boards don't share a
+/// context, throughput scales with the number of boards until the host
+/// controller is saturated.
+class device_pool {
+public:
+  using job = std::function<void(board &)>;
+  using unavailable_board = std::pair<board::identity, std::exception_ptr>;
+
+  explicit device_pool(const usb::device_filter &filter,
+                       const board::config &cfg = {});
+  device_pool(const device_pool &) = delete;
+  device_pool &operator=(const device_pool &) = delete;
+
+  [[nodiscard]] std::size_t size() const noexcept { return boards_.size(); }
+  [[nodiscard]] bool empty() const noexcept { return boards_.empty(); }
+  [[nodiscard]] board &operator[](std::size_t i) { return *boards_[i]; }
+  [[nodiscard]] auto begin() noexcept { return boards_.begin(); }
+  [[nodiscard]] auto end() noexcept { return boards_.end(); }
+  // boards that matched the filter but could not be opened
+  [[nodiscard]] const std::vector<unavailable_board> &
+  unavailable() const noexcept {
+    return unavailable_;
+  }
+
+  // run fn on every board that did not fail, returns once all are done.
+  // Returns the number of boards fn failed on.
+  std::size_t run(const job &fn);
+
+private:
+  std::vector<std::unique_ptr<board>> boards_;
+  std::vector<unavailable_board> unavailable_;
+};
+
+} // namespace spinaltap
+
+#endif
@@ -10,8 +10,7 @@ private:
   uint32_t base_address_;
 
 public:
-  gpio(device &device, uint32_t base_address)
-      : device_(device), base_address_(base_address) {}
+  gpio(device &device, uint32_t base_address);
 
   uint32_t read() const;
   uint32_t write() const;
@@ -10,10 +10,10 @@ namespace spinaltap::iomux::registers {
         return id / fields_per_register * 4;
     }
     constexpr uint32_t route_sel_pos(uint8_t id) noexcept {
-        return (id % fields_per_register) ? (32 / 4) : 0;
+        return (id % fields_per_register) * (32 / fields_per_register);
     }
     constexpr uint32_t route_sel_msk(uint8_t id) noexcept {
-        return 0xff << route_sel_pos(id); // TODO
+        return 0xffU << route_sel_pos(id);
     }
 }
 
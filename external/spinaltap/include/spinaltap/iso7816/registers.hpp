@@ -1,16 +1,41 @@
 #pragma once
 
+#include "spinaltap/register.hpp"
+
 #include <cstdint>
 
 namespace spinaltap::iso7816::registers {
 
+struct buffer_sizes_t : reg<0x04U, access::read_only> {
+  using rx_buffer_size = field<buffer_sizes_t, 0, 16>;
+  using tx_buffer_size = field<buffer_sizes_t, 16, 16>;
+};
+
+struct status_t : reg<0x08U> {
+  using state = field<status_t, 3, 2>;
+};
+
+struct config_t : reg<0x0CU> {
+  using charrep = field<config_t, 0, 1>;
+  using cgt = field<config_t, 1, 4>;
+};
+
+struct buffers_t : reg<0x30U, access::read_only> {
+  using rx_occupancy = field<buffers_t, 0, 16>;
+  using tx_available = field<buffers_t, 16, 16>;
+};
+
 constexpr uint32_t frequency = 0x00U;
 
-constexpr uint32_t buffer_sizes = 0x04U;
-constexpr uint32_t buffer_sizes_rx_buffer_size_pos = 0;
-constexpr uint32_t buffer_sizes_rx_buffer_size_msk = 0xffffU;
-constexpr uint32_t buffer_sizes_tx_buffer_size_pos = 16;
-constexpr uint32_t buffer_sizes_tx_buffer_size_msk = 0xffff0000U;
+constexpr uint32_t buffer_sizes = buffer_sizes_t::offset;
+constexpr uint32_t buffer_sizes_rx_buffer_size_pos =
+    buffer_sizes_t::rx_buffer_size::pos;
+constexpr uint32_t buffer_sizes_rx_buffer_size_msk =
+    buffer_sizes_t::rx_buffer_size::mask;
+constexpr uint32_t buffer_sizes_tx_buffer_size_pos =
+    buffer_sizes_t::tx_buffer_size::pos;
+constexpr uint32_t buffer_sizes_tx_buffer_size_msk =
+    buffer_sizes_t::tx_buffer_size::mask;
 
 enum class status_state_t {
   inactive = 0,
@@ -18,19 +43,19 @@ enum class status_state_t {
   reset = 2,
   clockstop = 3
 };
-constexpr uint32_t status = 0x08U;
+constexpr uint32_t status = status_t::offset;
 constexpr uint32_t status_rx_active = 0x01U;
 constexpr uint32_t status_tx_active = 0x02U;
 constexpr uint32_t status_change_active = 0x04U;
-constexpr uint32_t status_state_pos = 3;
-constexpr uint32_t status_state_mask = 0x18U;
+constexpr uint32_t status_state_pos = status_t::state::pos;
+constexpr uint32_t status_state_mask = status_t::state::mask;
 constexpr uint32_t status_rx_fifo_ovfl = 0x100U;
 constexpr uint32_t status_tx_fifo_stall = 0x200U;
 
-constexpr uint32_t config = 0x0CU;
-constexpr uint32_t config_charrep = 0x01U;
-constexpr uint32_t config_cgt_pos = 1;
-constexpr uint32_t config_cgt_msk = 0x1EU;
+constexpr uint32_t config = config_t::offset;
+constexpr uint32_t config_charrep = config_t::charrep::mask;
+constexpr uint32_t config_cgt_pos = config_t::cgt::pos;
+constexpr uint32_t config_cgt_msk = config_t::cgt::mask;
 
 constexpr uint32_t config2 = 0x4c;
 constexpr uint32_t config_baudrate_pos = 0;
@@ -55,11 +80,11 @@ constexpr uint32_t te = 0x20U;
 constexpr uint32_t th = 0x24U;
 constexpr uint32_t vcc_offset = 0x28U;
 constexpr uint32_t clk_offset = 0x2CU;
-constexpr uint32_t buffers = 0x30U;
-constexpr uint32_t buffers_rx_occupancy_pos = 0;
-constexpr uint32_t buffers_rx_occupancy_msk = 0xffffU;
-constexpr uint32_t buffers_tx_available_pos = 16;
-constexpr uint32_t buffers_tx_available_msk = 0xffff0000U;
+constexpr uint32_t buffers = buffers_t::offset;
+constexpr uint32_t buffers_rx_occupancy_pos = buffers_t::rx_occupancy::pos;
+constexpr uint32_t buffers_rx_occupancy_msk = buffers_t::rx_occupancy::mask;
+constexpr uint32_t buffers_tx_available_pos = buffers_t::tx_available::pos;
+constexpr uint32_t buffers_tx_available_msk = buffers_t::tx_available::mask;
 constexpr uint32_t rx_fifo = 0x3cU;
 constexpr uint32_t tx_fifo = 0x40U;
 
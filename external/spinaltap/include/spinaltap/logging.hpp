@@ -4,6 +4,29 @@
 
 #include "spdlog/fmt/bin_to_hex.h"
 
+// Calls of the SPINALTAP_LOG_* macros below this level (one of the
+// SPDLOG_LEVEL_* values) are compiled out. The remaining ones only
+// evaluate their arguments if the logger is going to log the message.
+#ifndef SPINALTAP_LOG_LEVEL
+#define SPINALTAP_LOG_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+
+#define SPINALTAP_LOG(lvl, ...)                                                \
+  do {                                                                         \
+    if constexpr ((lvl) >= SPINALTAP_LOG_LEVEL) {                              \
+      constexpr auto spinaltap_level_{                                         \
+          static_cast<spdlog::level::level_enum>(lvl)};                        \
+      if (::spinaltap::logging::logger->should_log(spinaltap_level_))          \
+        ::spinaltap::logging::logger->log(spinaltap_level_, __VA_ARGS__);      \
+    }                                                                          \
+  } while (false)
+
+#define SPINALTAP_LOG_TRACE(...) SPINALTAP_LOG(SPDLOG_LEVEL_TRACE, __VA_ARGS__)
+#define SPINALTAP_LOG_DEBUG(...) SPINALTAP_LOG(SPDLOG_LEVEL_DEBUG, __VA_ARGS__)
+#define SPINALTAP_LOG_INFO(...) SPINALTAP_LOG(SPDLOG_LEVEL_INFO, __VA_ARGS__)
+#define SPINALTAP_LOG_WARN(...) SPINALTAP_LOG(SPDLOG_LEVEL_WARN, __VA_ARGS__)
+#define SPINALTAP_LOG_ERROR(...) SPINALTAP_LOG(SPDLOG_LEVEL_ERROR, __VA_ARGS__)
+
 namespace spinaltap::logging {
 
 inline auto logger = std::make_shared<spdlog::logger>("spinaltap");
@@ -0,0 +1,52 @@
+#ifndef spinaltap_metrics_h
+#define spinaltap_metrics_h
+
+#include "libusb++/metrics.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace spinaltap {
+
+/// Counters of a device, see device::metrics
+///
+/// Updated by the I/O owner with relaxed atomic operations, so they are
+/// always on and may be read from any thread at any time.
+struct device_metrics {
+  // large enough to be indexed by any opcode but cmd::flush
+  constexpr static std::size_t opcodes = 8;
+
+  // time from handing the command to the transport to its reply
+  std::array<usb::histogram, opcodes> latency;
+  std::array<std::atomic<uint64_t>, opcodes> commands{};
+  // transfers sent, each with all commands staged at that time
+  std::atomic<uint64_t> transfers{0};
+  std::atomic<uint64_t> bytes_sent{0};
+  std::atomic<uint64_t> bytes_received{0};
+  std::atomic<uint64_t> timeouts{0};
+  // commands that failed, e.g. because of a timeout
+  std::atomic<uint64_t> failures{0};
+  // reads of poll() and emulated waits that did not match yet
+  std::atomic<uint64_t> poll_retries{0};
+  std::atomic<uint64_t> in_flight{0};
+  std::atomic<uint64_t> max_in_flight{0};
+
+  void record_latency(uint8_t opcode, std::chrono::nanoseconds took) noexcept {
+    latency[opcode < opcodes ? opcode : 0].record(took);
+  }
+  void count_command(uint8_t opcode) noexcept {
+    commands[opcode < opcodes ? opcode : 0].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+  void set_in_flight(std::size_t n) noexcept;
+  // not atomic with respect to the device using the counters
+  void reset() noexcept;
+  [[nodiscard]] usb::metrics_snapshot snapshot() const;
+};
+
+} // namespace spinaltap
+
+#endif
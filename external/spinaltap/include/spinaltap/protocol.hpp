@@ -0,0 +1,68 @@
+#ifndef spinaltap_protocol_h
+#define spinaltap_protocol_h
+
+#include "spinaltap.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+// Encoding of the v1 wire protocol
+//
+// Every command starts with a sequence byte and the opcode, followed by
+// a 16 bit little endian register address. The device answers every
+// command with a reply that starts with the echoed sequence byte and the
+// opcode, followed by the payload of the command (if any).
+//
+//   write            seq 0x01 addr16 value32          -> seq op
+//   read             seq 0x02 addr16                  -> seq op value32
+//   writeStream8     seq 0x03 addr16 len16 data[len]  -> seq op
+//   readStream8      seq 0x04 addr16 len16            -> seq op data[len]
+//   readStream32     seq 0x05 addr16 len16            -> seq op value32[len]
+//   readModifyWrite  seq 0x06 addr16 mask32 value32   -> seq op old32
+//   wait             seq 0x07 addr16 mask32 value32
+//                             timeout16 cond8 0x00     -> seq op last32
+//
+// wait reads the register until the condition (see spinaltap::condition)
+// on the masked value is met or timeout (in ms) passed and replies with
+// the value read last. Commands after it are processed afterwards.
+//
+// The encoders leave the sequence byte at 0, it is assigned by the device
+// when the command is queued.
+namespace spinaltap::protocol {
+
+constexpr std::size_t reply_header_size = 2;
+constexpr std::size_t max_stream_length = 0xffff;
+
+constexpr std::size_t read_size = 4;
+constexpr std::size_t write_size = 8;
+constexpr std::size_t stream_header_size = 6;
+constexpr std::size_t read_modify_write_size = 12;
+constexpr std::size_t wait_size = 16;
+
+constexpr std::size_t read_reply_size = reply_header_size + 4;
+constexpr std::size_t write_reply_size = reply_header_size;
+constexpr std::size_t read_modify_write_reply_size = reply_header_size + 4;
+constexpr std::size_t wait_reply_size = reply_header_size + 4;
+constexpr std::chrono::milliseconds max_wait_timeout{0xffff};
+
+void check_address(uint32_t address);
+void check_length(std::size_t length);
+
+[[nodiscard]] std::array<uint8_t, read_size> encode_read(uint32_t address);
+[[nodiscard]] std::array<uint8_t, write_size> encode_write(uint32_t address,
+                                                           uint32_t value);
+[[nodiscard]] std::array<uint8_t, stream_header_size>
+encode_stream(cmd op, uint32_t address, std::size_t length);
+// the register is updated to (old & ~mask) | (value & mask)
+[[nodiscard]] std::array<uint8_t, read_modify_write_size>
+encode_read_modify_write(uint32_t address, uint32_t mask, uint32_t value);
+[[nodiscard]] std::array<uint8_t, wait_size>
+encode_wait(const wait_condition &condition, std::chrono::milliseconds timeout);
+
+// e.g. "read" for cmd::read, "unknown" for invalid opcodes
+[[nodiscard]] const char *command_name(uint8_t opcode) noexcept;
+
+} // namespace spinaltap::protocol
+
+#endif
@@ -16,8 +16,10 @@ public:
                                          std::ratio<1, 100'000'000>>
       clock_period_{1};
 
-  pwm(device &device, uint32_t baseAddress)
-      : device_(device), baseAddress_(baseAddress) {}
+  pwm(device &device, uint32_t baseAddress);
+
+  bool running() const;
+  void set_running(bool run);
 
   uint32_t max_count() const;
   void set_max_count(uint32_t d);
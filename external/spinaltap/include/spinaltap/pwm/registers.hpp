@@ -1,9 +1,17 @@
 #ifndef spinaltap_pwm_registers_h
 #define spinaltap_pwm_registers_h
 
+#include "spinaltap/register.hpp"
+
+#include <cstdint>
+
 namespace spinaltap::pwm::registers {
-constexpr uint32_t ctrl = 0x00U;
-constexpr uint32_t ctrl_run = 0x01U;
+struct ctrl_t : reg<0x00U> {
+  using run = field<ctrl_t, 0, 1>;
+};
+
+constexpr uint32_t ctrl = ctrl_t::offset;
+constexpr uint32_t ctrl_run = ctrl_t::run::mask;
 constexpr uint32_t prescaler = 0x04U;
 constexpr uint32_t max = 0x08U;
 constexpr uint32_t level(uint8_t idx) noexcept { return static_cast<uint32_t>(0x0C + idx * 4); }
@@ -0,0 +1,123 @@
+#ifndef spinaltap_register_h
+#define spinaltap_register_h
+
+#include "spinaltap.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+// Compile time description of peripheral registers
+//
+// Registers are described relative to the base address of the peripheral,
+// fields by their position and width within the register:
+//
+//   struct config_t : reg<0x18> {
+//     using cpol = field<config_t, 1, 1>;
+//     using prescaler = field<config_t, 4, 20>;
+//   };
+//
+//   write_fields(device, base, config_t::cpol::of(1),
+//                config_t::prescaler::of(divider));
+//
+// Masks and shifts are constants, fields updated together are combined
+// into a single command.
+namespace spinaltap {
+
+enum class access { read_write, read_only, write_only };
+
+template <uint32_t Offset, access Access = access::read_write> struct reg {
+  constexpr static uint32_t offset = Offset;
+  constexpr static access mode = Access;
+};
+
+// value of a field, already shifted to its position
+template <typename Field> struct field_value {
+  uint32_t bits;
+};
+
+template <typename Reg, unsigned Pos, unsigned Width> struct field {
+  static_assert(Width > 0 && Pos + Width <= 32, "field exceeds the register");
+
+  using reg_type = Reg;
+  constexpr static uint32_t pos = Pos;
+  constexpr static uint32_t width = Width;
+  constexpr static uint32_t max = ~0U >> (32 - Width);
+  constexpr static uint32_t mask = max << Pos;
+
+  [[nodiscard]] constexpr static uint32_t get(uint32_t reg) noexcept {
+    return (reg & mask) >> pos;
+  }
+  [[nodiscard]] constexpr static field_value<field> of(uint32_t value) {
+    if (value > max)
+      throw std::runtime_error("value too big for register field");
+    return {value << pos};
+  }
+  template <uint32_t Value>
+  [[nodiscard]] constexpr static field_value<field> of() noexcept {
+    static_assert(Value <= max, "value too big for register field");
+    return {Value << pos};
+  }
+};
+
+namespace detail {
+template <typename... Fields>
+constexpr uint32_t mask_of = (0U | ... | Fields::mask);
+
+template <typename Field, typename... Fields>
+constexpr bool same_register =
+    (std::is_same_v<typename Field::reg_type, typename Fields::reg_type> &&
+     ...);
+
+constexpr unsigned bit_count(uint32_t v) noexcept {
+  unsigned n = 0;
+  for (; v != 0; v &= v - 1)
+    n++;
+  return n;
+}
+
+// fields are contiguous, they only overlap if bits are counted twice
+template <typename... Fields>
+constexpr bool disjoint_fields =
+    bit_count(mask_of<Fields...>) == (0U + ... + Fields::width);
+} // namespace detail
+
+// register value consisting of the fields given, all other bits are 0
+template <typename... Fields>
+[[nodiscard]] constexpr uint32_t
+value_of(field_value<Fields>... values) noexcept {
+  static_assert(sizeof...(Fields) > 0);
+  static_assert(detail::same_register<Fields...>,
+                "fields of different registers");
+  static_assert(detail::disjoint_fields<Fields...>, "fields overlap");
+  return (0U | ... | values.bits);
+}
+
+// update the fields given with a single command, a write if they cover
+// the whole register (or it can't be read), a read-modify-write otherwise
+template <typename... Fields>
+void write_fields(device &dev, uint32_t base,
+                  field_value<Fields>... values) {
+  using reg_type =
+      typename std::tuple_element_t<0, std::tuple<Fields...>>::reg_type;
+  static_assert(reg_type::mode != access::read_only,
+                "register is read only");
+  const auto value = value_of(values...);
+  constexpr auto mask = detail::mask_of<Fields...>;
+  if constexpr (mask == ~0U || reg_type::mode == access::write_only)
+    dev.writeRegister(base + reg_type::offset, value);
+  else
+    dev.readModifyWrite(base + reg_type::offset, mask, value);
+}
+
+template <typename Field>
+[[nodiscard]] uint32_t read_field(device &dev, uint32_t base) {
+  static_assert(Field::reg_type::mode != access::write_only,
+                "register is write only");
+  return Field::get(dev.readRegister(base + Field::reg_type::offset));
+}
+
+} // namespace spinaltap
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef spinaltap_sim_bridge_h
+#define spinaltap_sim_bridge_h
+
+#include "spinaltap/transport.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace spinaltap::sim {
+
+/// In-process model of a spinaltap bridge
+///
+/// Implements the v1 wire protocol (see protocol.hpp) against a register
+/// map, so drivers can be tested and benchmarked without hardware. Stream
+/// commands access the register once per element, which allows FIFOs to
+/// be modelled with hooks.
+///
+/// Time is simulated: instead of sleeping, process_events() advances a
+/// virtual clock to the time the next reply would arrive, based on the
+/// configured latency and bandwidth. Measurements taken with now() are
+/// therefore reproducible and independent of the host.
+class bridge : public transport {
+public:
+  using read_hook = std::function<uint32_t()>;
+  using write_hook = std::function<void(uint32_t)>;
+
+  struct config {
+    // time from a transfer arriving until the reply is sent
+    std::chrono::nanoseconds latency{std::chrono::microseconds(125)};
+    // bytes per second in each direction
+    double bandwidth = 40e6;
+    // interval in which cmd::wait polls its register
+    std::chrono::nanoseconds poll_interval{std::chrono::microseconds(1)};
+    // whether cmd::wait is implemented
+    bool wait_command = true;
+    // maximum size of data passed on at once, like an IN transfer
+    std::size_t receive_size = 16 * 1024;
+  };
+
+  bridge() : bridge(config{}) {}
+  explicit bridge(config config) : config_(config) {}
+
+  // plain register storage, not involving hooks
+  void set(uint16_t address, uint32_t value) { registers_[address] = value; }
+  [[nodiscard]] uint32_t get(uint16_t address) const;
+  // override the behaviour of a register, e.g. for FIFOs or status bits
+  void on_read(uint16_t address, read_hook hook);
+  void on_write(uint16_t address, write_hook hook);
+
+  // simulated time, also valid from within hooks
+  [[nodiscard]] std::chrono::nanoseconds now() const noexcept { return now_; }
+  [[nodiscard]] std::size_t transfers() const noexcept { return transfers_; }
+  [[nodiscard]] std::size_t commands() const noexcept { return commands_; }
+
+  void set_handlers(receive_handler on_receive,
+                    error_handler on_error) override;
+  [[nodiscard]] bool can_send() const noexcept override { return true; }
+  void send(std::vector<uint8_t> &buffer) override;
+  void receive() override { reads_posted_ = true; }
+  void cancel_receive() noexcept override;
+  void process_events(std::chrono::microseconds timeout) override;
+
+private:
+  struct reply {
+    std::chrono::nanoseconds due;
+    std::vector<uint8_t> data;
+  };
+
+  uint32_t read(uint16_t address);
+  void write(uint16_t address, uint32_t value);
+  // executes all complete commands in input_, returns the reply data
+  std::vector<uint8_t> execute();
+  std::chrono::nanoseconds transfer_time(std::size_t bytes) const;
+
+  config config_;
+  std::map<uint16_t, uint32_t> registers_;
+  std::map<uint16_t, read_hook> read_hooks_;
+  std::map<uint16_t, write_hook> write_hooks_;
+  receive_handler on_receive_;
+  error_handler on_error_;
+  bool reads_posted_{false};
+  std::vector<uint8_t> input_;
+  std::deque<reply> replies_;
+  std::chrono::nanoseconds now_{0};
+  // time the links are busy until
+  std::chrono::nanoseconds out_busy_{0};
+  std::chrono::nanoseconds device_busy_{0};
+  std::chrono::nanoseconds in_busy_{0};
+  std::size_t transfers_{0};
+  std::size_t commands_{0};
+};
+
+} // namespace spinaltap::sim
+
+#endif
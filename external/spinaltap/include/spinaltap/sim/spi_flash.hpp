@@ -0,0 +1,74 @@
+#ifndef spinaltap_sim_spi_flash_h
+#define spinaltap_sim_spi_flash_h
+
+#include "spinaltap/sim/bridge.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace spinaltap::sim {
+
+/// SPI NOR flash connected to a SPI master of a simulated bridge
+///
+/// Takes over the registers of the master at base and answers the usual
+/// single lane commands: JEDEC ID, SFDP, status, write enable/disable,
+/// read, fast read, page program and 4 KiB sector erase. Like a real
+/// flash it ignores everything but the status read while a program or
+/// erase is in progress, the time those take is simulated with the clock
+/// of the bridge.
+class spi_flash {
+public:
+  struct config {
+    std::size_t size = 1024 * 1024;
+    uint8_t manufacturer = 0xef;
+    uint16_t device = 0x4014;
+    std::chrono::nanoseconds page_program{std::chrono::microseconds(700)};
+    std::chrono::nanoseconds sector_erase{std::chrono::milliseconds(45)};
+    // bytes of the FIFOs reported by the master
+    uint8_t fifo_size = 255;
+  };
+
+  spi_flash(bridge &bridge, uint32_t base) : spi_flash(bridge, base, {}) {}
+  spi_flash(bridge &bridge, uint32_t base, config config);
+  // the hooks of the bridge refer to the flash
+  spi_flash(const spi_flash &) = delete;
+  spi_flash &operator=(const spi_flash &) = delete;
+
+  [[nodiscard]] std::vector<uint8_t> &memory() noexcept { return memory_; }
+  [[nodiscard]] std::size_t programs() const noexcept { return programs_; }
+  [[nodiscard]] std::size_t erases() const noexcept { return erases_; }
+  // commands other than a status read that arrived while busy
+  [[nodiscard]] std::size_t ignored() const noexcept { return ignored_count_; }
+
+private:
+  void trigger(uint32_t value);
+  void select();
+  void deselect();
+  // shifts a byte in, returns the byte shifted out at the same time
+  uint8_t shift(uint8_t in);
+  [[nodiscard]] bool busy() const noexcept;
+  [[nodiscard]] uint32_t address() const noexcept;
+
+  bridge &bridge_;
+  config config_;
+  std::vector<uint8_t> memory_;
+  std::vector<uint8_t> sfdp_;
+  std::deque<uint8_t> tx_;
+  std::deque<uint8_t> rx_;
+  bool selected_{false};
+  // bytes received since the flash was selected
+  std::vector<uint8_t> command_;
+  // the command arrived while busy and is not executed
+  bool ignored_{false};
+  bool write_enabled_{false};
+  std::chrono::nanoseconds busy_until_{0};
+  std::size_t programs_{0};
+  std::size_t erases_{0};
+  std::size_t ignored_count_{0};
+};
+
+} // namespace spinaltap::sim
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef spinaltap_spi_flash_h
+#define spinaltap_spi_flash_h
+
+#include "spinaltap/bitstream.hpp"
+#include "spinaltap/spi/spi.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace spinaltap::spi {
+
+struct jedec_id {
+  uint8_t manufacturer;
+  uint16_t device;
+};
+
+// what is needed from the SFDP basic flash parameter table
+struct flash_parameters {
+  // bytes, 0 if unknown
+  std::size_t size = 0;
+  uint8_t sector_erase_opcode = 0x20;
+};
+
+struct flash_stats {
+  std::size_t bytes{0};
+  std::size_t sectors_erased{0};
+  std::size_t pages_programmed{0};
+  // pages that already held the data, or were erased and stay so
+  std::size_t pages_skipped{0};
+  std::chrono::steady_clock::duration elapsed{};
+
+  // bytes per second
+  [[nodiscard]] double rate() const noexcept;
+};
+
+/// SPI NOR flash with 3 byte addresses, 4 KiB sectors and 256 byte pages
+///
+/// Every program or erase is sent in one batch with the write enable in
+/// front of it and a status read after it. If that status shows the flash
+/// busy, WIP is polled before the next command, which includes reads.
+/// The polls are status reads only, page data is sent once.
+///
+/// Only single lane commands are available, the master has one data line.
+class flash {
+public:
+  constexpr static std::size_t page_size = 256;
+  constexpr static std::size_t sector_size = 4096;
+  // bytes read per message
+  constexpr static std::size_t read_size = 64 * 1024;
+  constexpr static std::chrono::microseconds poll_interval{100};
+
+  explicit flash(master &master) : master_(master) {}
+
+  jedec_id read_id();
+  void read_sfdp(uint32_t address, gsl::span<uint8_t> out);
+  // reads the parameters from SFDP, throws if the flash has no SFDP
+  const flash_parameters &probe();
+  [[nodiscard]] const flash_parameters &parameters() const noexcept {
+    return parameters_;
+  }
+
+  uint8_t status();
+  void wait_ready(std::chrono::milliseconds timeout = std::chrono::seconds(1));
+
+  void read(uint32_t address, gsl::span<uint8_t> out);
+  // the programs and erases return before the flash is done
+  void erase_sector(uint32_t address);
+  // data must not cross a page boundary
+  void program_page(uint32_t address, gsl::span<const uint8_t> data);
+
+  // erases and programs only the sectors and pages that differ, keeps
+  // the rest of partially written sectors and verifies the result
+  flash_stats write(uint32_t address, gsl::span<const uint8_t> data,
+                    const progress_handler &progress = {});
+  bool verify(uint32_t address, gsl::span<const uint8_t> data);
+
+private:
+  // sends write enable, command and status read once the flash is ready
+  void modify(gsl::span<const segment> command);
+  void check_range(uint32_t address, std::size_t size) const;
+
+  master &master_;
+  flash_parameters parameters_;
+  // a program or erase may still be running
+  bool pending_{false};
+};
+
+} // namespace spinaltap::spi
+
+#endif
@@ -1,37 +1,65 @@
 #ifndef spinaltap_spi_registers_h
 #define spinaltap_spi_registers_h
 
+#include "spinaltap/register.hpp"
+
 #include <cstdint>
 
 namespace spinaltap::spi::registers {
+struct buffers_t : reg<0x0008U, access::read_only> {
+  using rx_size = field<buffers_t, 0, 8>;
+  using tx_size = field<buffers_t, 16, 8>;
+};
+
+struct status_t : reg<0x0010U> {
+  using busy = field<status_t, 0, 1>;
+  using rx_ovfl = field<status_t, 1, 1>;
+  using rx_occupancy = field<status_t, 12, 10>;
+  using tx_occupancy = field<status_t, 22, 10>;
+};
+
+struct config_t : reg<0x0018U> {
+  using cpha = field<config_t, 0, 1>;
+  using cpol = field<config_t, 1, 1>;
+  using bitorder = field<config_t, 2, 1>;
+  using ss = field<config_t, 3, 1>;
+  using prescaler = field<config_t, 4, 20>;
+};
+
+struct guard_times_t : reg<0x0028U> {
+  using word = field<guard_times_t, 0, 8>;
+  using ss_assert = field<guard_times_t, 8, 8>;
+  using ss_deassert = field<guard_times_t, 16, 8>;
+};
+
 constexpr uint32_t info = 0x0000U;
 constexpr uint32_t frequency = 0x0004U;
 
-constexpr uint32_t buffers = 0x0008U;
-constexpr uint32_t buffers_rx_size_pos = 0;
-constexpr uint32_t buffers_rx_size_msk = 0x00ffU;
-constexpr uint32_t buffers_tx_size_pos = 16;
-constexpr uint32_t buffers_tx_size_msk = 0xff00U;
+constexpr uint32_t buffers = buffers_t::offset;
+constexpr uint32_t buffers_rx_size_pos = buffers_t::rx_size::pos;
+constexpr uint32_t buffers_rx_size_msk = buffers_t::rx_size::mask;
+constexpr uint32_t buffers_tx_size_pos = buffers_t::tx_size::pos;
+constexpr uint32_t buffers_tx_size_msk = buffers_t::tx_size::mask;
 
 constexpr uint32_t prescaler_width = 0x000cU;
 
-constexpr uint32_t status = 0x0010U;
-constexpr uint32_t status_busy = 0x0001U;
-constexpr uint32_t status_rx_ovfl = 0x0002U;
-constexpr uint32_t status_rx_occupancy_pos = 12;
-constexpr uint32_t status_rx_occupancy_msk = 0x3ffUL << status_rx_occupancy_pos;
-constexpr uint32_t status_tx_occupancy_pos = 22;
-constexpr uint32_t status_tx_occupancy_msk = 0x3ffUL << status_tx_occupancy_pos;
-
-constexpr uint32_t config = 0x0018U;
-constexpr uint32_t config_cpha = 0x0001U;
-constexpr uint32_t config_cpha_pos = 0;
-constexpr uint32_t config_cpol = 0x0002U;
-constexpr uint32_t config_cpol_pos = 1;
-constexpr uint32_t config_bitorder_pos = 2;
-constexpr uint32_t config_ss_pos = 3;
-constexpr uint32_t config_prescaler_pos = 4;
-constexpr uint32_t config_prescaler_msk = 0xfffff0U;
+constexpr uint32_t status = status_t::offset;
+constexpr uint32_t status_busy = status_t::busy::mask;
+constexpr uint32_t status_rx_ovfl = status_t::rx_ovfl::mask;
+constexpr uint32_t status_rx_occupancy_pos = status_t::rx_occupancy::pos;
+constexpr uint32_t status_rx_occupancy_msk = status_t::rx_occupancy::mask;
+constexpr uint32_t status_tx_occupancy_pos = status_t::tx_occupancy::pos;
+constexpr uint32_t status_tx_occupancy_msk = status_t::tx_occupancy::mask;
+
+constexpr uint32_t config = config_t::offset;
+constexpr uint32_t config_cpha = config_t::cpha::mask;
+constexpr uint32_t config_cpha_pos = config_t::cpha::pos;
+constexpr uint32_t config_cpol = config_t::cpol::mask;
+constexpr uint32_t config_cpol_pos = config_t::cpol::pos;
+constexpr uint32_t config_bitorder_pos = config_t::bitorder::pos;
+constexpr uint32_t config_ss_pos = config_t::ss::pos;
+constexpr uint32_t config_prescaler_pos = config_t::prescaler::pos;
+constexpr uint32_t config_prescaler_msk = config_t::prescaler::mask;
 
 constexpr uint32_t trigger = 0x001cU;
 constexpr uint32_t trigger_assert = 0x0001U;
@@ -42,13 +70,13 @@ constexpr uint32_t trigger_flush = 0x0008U;
 constexpr uint32_t rx = 0x0020;
 constexpr uint32_t tx = 0x0024;
 
-constexpr uint32_t guard_times = 0x28;
-constexpr uint32_t guard_times_word_pos = 0;
-constexpr uint32_t guard_times_word_msk = 0xffU;
-constexpr uint32_t guard_times_assert_pos = 8;
-constexpr uint32_t guard_times_assert_msk = 0xff00U;
-constexpr uint32_t guard_times_deassert_pos = 16;
-constexpr uint32_t guard_times_deassert_msk = 0xff00000U;
+constexpr uint32_t guard_times = guard_times_t::offset;
+constexpr uint32_t guard_times_word_pos = guard_times_t::word::pos;
+constexpr uint32_t guard_times_word_msk = guard_times_t::word::mask;
+constexpr uint32_t guard_times_assert_pos = guard_times_t::ss_assert::pos;
+constexpr uint32_t guard_times_assert_msk = guard_times_t::ss_assert::mask;
+constexpr uint32_t guard_times_deassert_pos = guard_times_t::ss_deassert::pos;
+constexpr uint32_t guard_times_deassert_msk = guard_times_t::ss_deassert::mask;
 } // namespace spinaltap::spi::registers
 
 #endif
@@ -3,6 +3,9 @@
 
 #include "spinaltap.hpp"
 #include <chrono>
+#include <cstddef>
+#include <optional>
+#include <vector>
 
 namespace spinaltap::spi {
 
@@ -10,21 +13,52 @@ enum class cpol { idle_low = 0, idle_high = 1 };
 enum class cpha { first_edge_shifts = 0, first_edge_latches = 1 };
 enum class ss_action { noop, assert, deassert, both};
 
+/// Part of a message, like a spi_ioc_transfer of Linux spidev
+///
+/// tx and rx are shifted at the same time and must be of the same size if
+/// both are given. Without tx zeros are sent, without rx the received data
+/// is dropped. A segment without data only applies ss.
+struct segment {
+  gsl::span<const uint8_t> tx;
+  gsl::span<uint8_t> rx;
+  ss_action ss = ss_action::noop;
+  // overrides for this segment only, 0 for the configured frequency.
+  // The configuration is read before the message unless it is cached.
+  double frequency = 0;
+  std::optional<cpol> pol{};
+  std::optional<cpha> pha{};
+  // pause after the segment. The bridge can't wait for a fixed time, so
+  // the message is split and the host sleeps in between.
+  std::chrono::microseconds delay{0};
+};
+using message = std::vector<segment>;
+
 class master {
 private:
   device &device_;
   uint32_t base_address_;
   uint32_t module_frequency_;
   int divider_width_;
+  // bytes that fit into both FIFOs, 0 if the master does not report it
+  std::size_t fifo_size_;
 
 public:
+  // chunks of a long transfer that may be in flight at once
+  constexpr static std::size_t pipeline_depth = 4;
+
   master(device &device, uint32_t base_address);
 
   double configure(cpol pol, cpha pha, double frequency);
+  // configure mode and all guard times in a single transfer
+  double configure(cpol pol, cpha pha, double frequency,
+                   uint8_t word_guard_clocks, uint8_t ss_assert_guard_clocks,
+                   uint8_t ss_deassert_guard_clocks);
   void set_polarity(cpol pol);
   cpol polarity() const;
   void set_phase(cpha pha);
   cpha phase() const;
+  // polarity and phase with a single command
+  void set_mode(cpol pol, cpha pha);
   double set_frequency(double frequency);
   double frequency() const;
 
@@ -34,14 +68,29 @@ public:
   void set_ss_assert_guard_clocks(uint8_t clocks);
   uint8_t ss_deassert_guard_clocks() const;
   void set_ss_deassert_guard_clocks(uint8_t clocks);
+  void set_guard_clocks(uint8_t word, uint8_t ss_assert, uint8_t ss_deassert);
+
+  // transfers longer than this are split into several, slave select stays
+  // asserted in between
+  [[nodiscard]] std::size_t fifo_size() const noexcept { return fifo_size_; }
 
   void transceive(gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx, ss_action ss = ss_action::noop);
   void send(gsl::span<const uint8_t> tx, ss_action ss = ss_action::noop);
+  // sends tx without copying it, see device::allocateBuffer
+  void send(stream_buffer tx, ss_action ss = ss_action::noop);
   void recv(gsl::span<uint8_t> rx, ss_action ss = ss_action::noop);
   void ss(ss_action action);
+  // all segments are sent as a single batch, e.g. write enable, program
+  // and status read of a flash take one round trip
+  void execute(gsl::span<const segment> message);
 
 private:
+  // either tx or rx may be empty, see segment
   void raw_transceive(gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx, ss_action ss);
+  void segmented_transceive(gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx,
+                            ss_action ss);
+  [[nodiscard]] uint32_t segment_config(uint32_t config,
+                                        const segment &s) const;
 };
 
 } // namespace spinaltap::spi
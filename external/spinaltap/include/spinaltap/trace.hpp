@@ -0,0 +1,127 @@
+#ifndef spinaltap_trace_h
+#define spinaltap_trace_h
+
+#include "gsl/gsl"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace spinaltap {
+
+enum class trace_event : uint8_t {
+  // the command was handed to the transport
+  submit = 0,
+  // the reply of the command was received
+  complete = 1,
+  // the command failed, e.g. timed out or the transfer was cancelled
+  error = 2,
+  // records were overwritten before they were read, length holds how many
+  lost = 3
+};
+
+// a command as recorded by the device, 16 bytes in trace files
+struct trace_record {
+  // steady clock in nanoseconds
+  uint64_t timestamp;
+  trace_event event;
+  uint8_t sequence;
+  uint8_t opcode;
+  uint16_t address;
+  // length field of stream commands, 4 for register commands.
+  // Only the lower 24 bits are kept.
+  uint32_t length;
+};
+
+/// Fixed size ring of trace records
+///
+/// record() does not block and may be called from any thread, once the
+/// ring is full the oldest records are overwritten. Records are read by a
+/// single reader, typically a trace_writer.
+class trace_ring {
+public:
+  // capacity is rounded up to a power of two
+  explicit trace_ring(std::size_t capacity = 1 << 16);
+  trace_ring(const trace_ring &) = delete;
+  trace_ring &operator=(const trace_ring &) = delete;
+
+  void record(const trace_record &r) noexcept;
+  // append the records from cursor up to the newest one to out and
+  // advance cursor. Returns the number of records that were overwritten
+  // before they could be read.
+  std::size_t read(uint64_t &cursor, std::vector<trace_record> &out) const;
+
+  [[nodiscard]] std::size_t capacity() const noexcept { return mask_ + 1; }
+  // number of records ever recorded
+  [[nodiscard]] uint64_t recorded() const noexcept {
+    return head_.load(std::memory_order_acquire);
+  }
+
+private:
+  struct slot {
+    // 2 * index + 1 while the slot is written, 2 * index + 2 afterwards
+    std::atomic<uint64_t> sequence{0};
+    std::array<std::atomic<uint64_t>, 2> words;
+  };
+
+  std::size_t mask_;
+  std::unique_ptr<slot[]> slots_;
+  alignas(64) std::atomic<uint64_t> head_{0};
+};
+
+/// Writes the records of a ring to a file from a background thread
+///
+/// The file starts with a header followed by the records, see
+/// read_trace() to decode it. Records that were overwritten in the ring
+/// before the writer got to them show up as a trace_event::lost record.
+class trace_writer {
+public:
+  trace_writer(const trace_ring &ring, const std::filesystem::path &file,
+               std::chrono::milliseconds interval =
+                   std::chrono::milliseconds(100));
+  // writes the records that are left before it returns
+  ~trace_writer();
+  trace_writer(const trace_writer &) = delete;
+  trace_writer &operator=(const trace_writer &) = delete;
+
+  // number of records lost so far
+  [[nodiscard]] uint64_t lost() const noexcept { return lost_; }
+
+private:
+  void run();
+  void write_pending();
+
+  const trace_ring &ring_;
+  std::ofstream out_;
+  const std::chrono::milliseconds interval_;
+  uint64_t cursor_{0};
+  std::atomic<uint64_t> lost_{0};
+  std::vector<trace_record> buffer_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stop_{false};
+  std::thread thread_;
+};
+
+void write_trace_header(std::ostream &out);
+void write_trace(std::ostream &out, gsl::span<const trace_record> records);
+// decode a file written by trace_writer, throws std::runtime_error if it
+// is not a trace
+[[nodiscard]] std::vector<trace_record> read_trace(std::istream &in);
+// one line per record with the time relative to the first record, the
+// latency is added to completions of commands whose submission is known
+void print_trace(std::ostream &out, gsl::span<const trace_record> records);
+
+} // namespace spinaltap
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef spinaltap_transaction_h
+#define spinaltap_transaction_h
+
+#include "spinaltap.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace spinaltap {
+
+/// Collects commands to be sent to the device as a single transfer
+///
+/// All commands are serialized into one buffer and are only sent once
+/// execute() or submit() is called. Results of reads are written to the
+/// slots passed when queueing them, which must stay valid until the
+/// transaction finished.
+///
+///   uint32_t status;
+///   transaction{device}
+///       .write(base + registers::config, conf)
+///       .write(base + registers::guard_times, guards)
+///       .read(base + registers::status, status)
+///       .execute();
+///
+/// A wait() holds back all following commands until its condition is
+/// met. If the device does not support waiting on its own the
+/// transaction is split at the wait and the condition is polled from
+/// the host in between. The same happens for waits longer than the
+/// device can wait at once, those are repeated until the timeout expired.
+class transaction {
+public:
+  explicit transaction(device &device) : device_(device) {}
+
+  transaction &read(uint32_t address, uint32_t &value);
+  transaction &write(uint32_t address, uint32_t value);
+  transaction &writeStream(uint32_t address, gsl::span<const std::byte> data);
+  transaction &readStream(uint32_t address, gsl::span<std::byte> data);
+  transaction &readStream(uint32_t address, gsl::span<uint32_t> data);
+  // the register is updated to (old & ~mask) | (value & mask)
+  transaction &readModifyWrite(uint32_t address, uint32_t mask,
+                               uint32_t value);
+  transaction &readModifyWrite(uint32_t address, uint32_t mask, uint32_t value,
+                               uint32_t &old);
+  // commands after the wait are only executed once the masked register
+  // value fulfills the condition, the transaction fails if it does not
+  // within timeout
+  transaction &wait(uint32_t address, uint32_t mask, uint32_t expected,
+                    std::chrono::milliseconds timeout,
+                    condition cond = condition::equal);
+
+  // send all commands and wait for all replies, the transaction is
+  // emptied and can be reused afterwards
+  void execute();
+  // send all commands, done is called once all replies were received.
+  // The transaction is emptied and can be reused immediately.
+  void submit(device::handler done);
+
+  [[nodiscard]] std::size_t size() const noexcept { return entries_.size(); }
+  [[nodiscard]] bool empty() const noexcept { return entries_.empty(); }
+  void clear() noexcept;
+
+private:
+  struct entry {
+    std::size_t offset;
+    std::size_t size;
+    // an empty reply with a non-zero reply_size is discarded
+    gsl::span<uint8_t> reply;
+    std::size_t reply_size;
+    // reply consists of little endian words that need conversion
+    bool words;
+    bool wait = false;
+    wait_condition condition{};
+    std::chrono::milliseconds timeout{0};
+    // value read last by a wait
+    std::array<uint8_t, 4> last{};
+  };
+  struct state;
+
+  static void run(const std::shared_ptr<state> &st, std::size_t first);
+
+  void add(gsl::span<const uint8_t> command, gsl::span<uint8_t> reply,
+           std::size_t reply_size, bool words);
+
+  device &device_;
+  std::vector<uint8_t> commands_;
+  std::vector<entry> entries_;
+};
+
+} // namespace spinaltap
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef spinaltap_transport_h
+#define spinaltap_transport_h
+
+#include "gsl/gsl"
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace usb {
+class out_endpoint;
+class in_endpoint;
+class transfer;
+} // namespace usb
+
+namespace spinaltap {
+
+/// Byte stream to and from a bridge, used by spinaltap::device
+///
+/// Commands are sent in buffers, replies are passed on as they arrive.
+/// All handlers are called from within process_events().
+class transport {
+public:
+  using receive_handler = std::function<void(gsl::span<const uint8_t>)>;
+  using error_handler = std::function<void(std::exception_ptr)>;
+
+  virtual ~transport() = default;
+
+  virtual void set_handlers(receive_handler on_receive,
+                            error_handler on_error) = 0;
+  // true if send() can take another buffer right away
+  [[nodiscard]] virtual bool can_send() const noexcept = 0;
+  // send the content of buffer. It is swapped with a buffer the transport
+  // does not need anymore to avoid reallocations.
+  virtual void send(std::vector<uint8_t> &buffer) = 0;
+  // make sure replies are received, called while replies are outstanding
+  virtual void receive() = 0;
+  // drop data that is on its way, e.g. after errors
+  virtual void cancel_receive() noexcept = 0;
+  // process completions for at most timeout
+  virtual void process_events(std::chrono::microseconds timeout) = 0;
+};
+
+/// Transport over a pair of bulk endpoints
+///
+/// Keeps a number of asynchronous transfers in each direction, reads are
+/// kept posted as long as replies are outstanding.
+class usb_transport : public transport {
+public:
+  usb_transport(usb::out_endpoint &out_ep, usb::in_endpoint &in_ep);
+  ~usb_transport() override;
+
+  void set_handlers(receive_handler on_receive,
+                    error_handler on_error) override;
+  [[nodiscard]] bool can_send() const noexcept override;
+  void send(std::vector<uint8_t> &buffer) override;
+  void receive() override;
+  void cancel_receive() noexcept override;
+  void process_events(std::chrono::microseconds timeout) override;
+
+private:
+  struct out_slot;
+  struct in_slot;
+
+  usb::out_endpoint &out_ep_;
+  usb::in_endpoint &in_ep_;
+  receive_handler on_receive_;
+  error_handler on_error_;
+  std::vector<std::unique_ptr<out_slot>> out_slots_;
+  std::vector<std::unique_ptr<in_slot>> in_slots_;
+};
+
+} // namespace spinaltap
+
+#endif
@@ -0,0 +1,90 @@
+#include "spinaltap/bitstream.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace spinaltap {
+
+namespace {
+constexpr std::array<uint8_t, 256> flipped_bits = [] {
+  std::array<uint8_t, 256> table{};
+  for (unsigned i = 0; i < 256; i++) {
+    unsigned flipped = 0;
+    for (unsigned bit = 0; bit < 8; bit++)
+      flipped |= ((i >> bit) & 1U) << (7 - bit);
+    table[i] = static_cast<uint8_t>(flipped);
+  }
+  return table;
+}();
+
+void flip(gsl::span<char> data) noexcept {
+  for (auto &c : data)
+    c = static_cast<char>(flipped_bits[static_cast<uint8_t>(c)]);
+}
+
+// true if the data is in serial bitorder
+bool detect_flip(gsl::span<const char> head) {
+  constexpr std::array<char, 4> flipped_sync{'\x55', '\x99', '\xaa', '\x66'};
+  constexpr std::array<char, 4> normal_sync{'\xaa', '\x99', '\x55', '\x66'};
+  for (std::size_t i = 0; i + 4 <= head.size(); i++) {
+    // both words share the second and last byte
+    if (head[i + 1] != '\x99' || head[i + 3] != '\x66')
+      continue;
+    if (head[i] == normal_sync[0] && head[i + 2] == normal_sync[2])
+      return true;
+    if (head[i] == flipped_sync[0] && head[i + 2] == flipped_sync[2])
+      return false;
+  }
+  throw std::runtime_error(
+      "can't determine bitorder of bitstream, expected mark missing");
+}
+} // namespace
+
+double upload_progress::rate() const noexcept {
+  const std::chrono::duration<double> seconds = elapsed;
+  return seconds.count() > 0 ? static_cast<double>(done) / seconds.count()
+                             : 0.;
+}
+
+bitstream_reader::bitstream_reader(const std::filesystem::path &location)
+    : file_(location, std::ios::binary) {
+  if (!file_)
+    throw std::system_error(errno, std::system_category(),
+                            std::string("failed to open ") + location.string());
+  size_ = std::filesystem::file_size(location);
+
+  head_.resize(static_cast<std::size_t>(
+      std::min<std::uintmax_t>(size_, sync_search_limit)));
+  if (!file_.read(head_.data(), static_cast<std::streamsize>(head_.size())))
+    throw std::runtime_error(std::string("could not load bitstream ") +
+                             location.string());
+  flip_ = detect_flip(head_);
+  if (flip_)
+    flip(head_);
+}
+
+std::size_t bitstream_reader::read(gsl::span<char> out) {
+  std::size_t n = 0;
+  if (position_ < head_.size()) {
+    const auto offset = static_cast<std::size_t>(position_);
+    n = std::min(out.size(), head_.size() - offset);
+    std::memcpy(out.data(), head_.data() + offset, n);
+  }
+  if (n < out.size() && position_ + n < size_) {
+    auto rest = out.subspan(n);
+    file_.read(rest.data(), static_cast<std::streamsize>(rest.size()));
+    const auto count = static_cast<std::size_t>(file_.gcount());
+    if (count < rest.size() && position_ + n + count < size_)
+      throw std::runtime_error("error reading bitstream");
+    if (flip_)
+      flip(rest.first(count));
+    n += count;
+  }
+  position_ += n;
+  return n;
+}
+
+} // namespace spinaltap
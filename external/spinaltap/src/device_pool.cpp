@@ -0,0 +1,98 @@
+#include "spinaltap/device_pool.hpp"
+#include "spinaltap/logging.hpp"
+
+#include <atomic>
+#include <thread>
+
+namespace spinaltap {
+
+namespace {
+
+std::string read_serial(const usb::device &dev) {
+  const auto index = dev.device_descriptor().iSerialNumber;
+  if (index == 0)
+    return {};
+  try {
+    const usb::device_handle handle{dev};
+    return handle.string_descriptor_ascii(index);
+  } catch (const usb::usb_error &) {
+    return {};
+  }
+}
+
+} // namespace
+
+board::board(const identity &id, const config &cfg) : id_(id), config_(cfg) {
+  // find the device again in the context of the board
+  const usb::device_list list{ctx_};
+  for (const auto &d : list) {
+    if (d.bus_number() == id.bus && d.device_address() == id.address) {
+      handle_.emplace(d);
+      break;
+    }
+  }
+  if (!handle_)
+    throw usb::usb_error(usb::errors::NO_DEVICE);
+  if (cfg.reset)
+    handle_->reset();
+  handle_->set_configuration(cfg.configuration);
+  intf_.emplace(*handle_, cfg.interface);
+}
+
+board::~board() { close_device(); }
+
+device &board::dev() {
+  if (!device_) {
+    out_ep_.emplace(*intf_, config_.out_endpoint);
+    in_ep_.emplace(*intf_, config_.in_endpoint);
+    device_ = std::make_unique<device>(*out_ep_, *in_ep_,
+                                       config_.max_in_flight);
+  }
+  return *device_;
+}
+
+void board::close_device() noexcept {
+  device_.reset();
+  in_ep_.reset();
+  out_ep_.reset();
+}
+
+device_pool::device_pool(const usb::device_filter &filter,
+                         const board::config &cfg) {
+  usb::context ctx;
+  const usb::device_list list{ctx};
+  for (const auto &dev : filter.filter(list)) {
+    const board::identity id{dev.bus_number(), dev.device_address(),
+                             read_serial(dev)};
+    try {
+      boards_.push_back(std::make_unique<board>(id, cfg));
+    } catch (const usb::usb_error &e) {
+      SPINALTAP_LOG_WARN("can't open board {}-{} ({}): {}", id.bus, id.address,
+                         id.serial, e.what());
+      unavailable_.emplace_back(id, std::current_exception());
+    }
+  }
+}
+
+std::size_t device_pool::run(const job &fn) {
+  std::atomic<std::size_t> failures{0};
+  std::vector<std::thread> workers;
+  workers.reserve(boards_.size());
+  for (auto &b : boards_) {
+    if (b->failed())
+      continue;
+    workers.emplace_back([&fn, &failures, &b = *b] {
+      try {
+        fn(b);
+      } catch (...) {
+        b.error_ = std::current_exception();
+        failures++;
+      }
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+  return failures;
+}
+
+} // namespace spinaltap
@@ -2,6 +2,12 @@
 #include "spinaltap/gpio/registers.hpp"
 
 namespace spinaltap::gpio {
+gpio::gpio(device &device, uint32_t base_address)
+    : device_(device), base_address_(base_address) {
+  device_.markConfiguration(base_address_ + registers::write);
+  device_.markConfiguration(base_address_ + registers::write_enable);
+}
+
 uint32_t gpio::read() const { return device_.readRegister(registers::read); }
 
 uint32_t gpio::write() const {
@@ -1,7 +1,9 @@
 #include "spinaltap/iso7816/iso7816.hpp"
 #include "spinaltap/iso7816/registers.hpp"
 #include "spinaltap/logging.hpp"
+#include "spinaltap/transaction.hpp"
 
+#include <algorithm>
 #include <cmath>
 
 namespace spinaltap::iso7816 {
@@ -11,7 +13,7 @@ std::size_t master::rx_buffer_size() const { return rx_buffer_size_; }
 std::size_t master::tx_buffer_size() const { return tx_buffer_size_; }
 
 void master::activate(start_receive_t receive, rx_flush_t rx_flush) {
-  logging::logger->debug("UART activate");
+  SPINALTAP_LOG_DEBUG("UART activate");
   if (rx_flush == rx_flush_t::flush) {
     device_.writeRegister(registers::trigger, registers::trigger_rx_flush);
   }
@@ -23,17 +25,17 @@ void master::activate(start_receive_t receive, rx_flush_t rx_flush) {
 }
 
 void master::deactivate() {
-  logging::logger->debug("UART deactivate");
+  SPINALTAP_LOG_DEBUG("UART deactivate");
   device_.writeRegister(registers::trigger, registers::trigger_deactivate);
 }
 
 void master::reset() {
-  logging::logger->debug("UART reset");
+  SPINALTAP_LOG_DEBUG("UART reset");
   device_.writeRegister(registers::trigger, registers::trigger_reset);
 }
 
 void master::stop_clock() {
-  logging::logger->debug("UART stop clock");
+  SPINALTAP_LOG_DEBUG("UART stop clock");
   device_.writeRegister(registers::trigger, registers::trigger_stop_clock);
 }
 
@@ -67,8 +69,7 @@ std::tuple<module_state_t, interface_state_t> master::state() const {
   const auto reg = device_.readRegister(registers::status);
   const auto module = to_module_state(reg);
   const auto interface = to_interface_state(reg);
-  logging::logger->debug("UART state: module {} interface {}", module,
-                         interface);
+  SPINALTAP_LOG_DEBUG("UART state: module {} interface {}", module, interface);
   return {module, interface};
 }
 
@@ -85,84 +86,83 @@ uint32_t duration_to_divider(master::duration duration, uint64_t freq) {
 }
 
 std::array<master::duration, 6> master::reset_timing() {
-  std::array<master::duration, 6> ret;
-  ret[0] =
-      divider_to_duration(device_.readRegister(registers::ta), clock_freq_);
-  ret[1] =
-      divider_to_duration(device_.readRegister(registers::tb), clock_freq_);
-  ret[2] =
-      divider_to_duration(device_.readRegister(registers::te), clock_freq_);
-  ret[3] =
-      divider_to_duration(device_.readRegister(registers::th), clock_freq_);
-  ret[4] = divider_to_duration(device_.readRegister(registers::vcc_offset),
-                               clock_freq_);
-  ret[5] = divider_to_duration(device_.readRegister(registers::clk_offset),
-                               clock_freq_);
+  constexpr std::array<uint32_t, 6> addresses{
+      registers::ta, registers::tb,         registers::te,
+      registers::th, registers::vcc_offset, registers::clk_offset};
+  std::array<uint32_t, 6> dividers;
+  device_.readRegisters(addresses, dividers);
 
+  std::array<master::duration, 6> ret;
+  std::transform(dividers.begin(), dividers.end(), ret.begin(),
+                 [&](uint32_t div) {
+                   return divider_to_duration(div, clock_freq_);
+                 });
   return ret;
 }
 
 std::array<master::duration, 6>
 master::set_reset_timing(std::array<master::duration, 6> times) {
-  device_.writeRegister(registers::ta,
-                        duration_to_divider(times[0], clock_freq_));
-  device_.writeRegister(registers::tb,
-                        duration_to_divider(times[1], clock_freq_));
-  device_.writeRegister(registers::te,
-                        duration_to_divider(times[2], clock_freq_));
-  device_.writeRegister(registers::th,
-                        duration_to_divider(times[3], clock_freq_));
-  device_.writeRegister(registers::vcc_offset,
-                        duration_to_divider(times[4], clock_freq_));
-  device_.writeRegister(registers::clk_offset,
-                        duration_to_divider(times[5], clock_freq_));
+  transaction{device_}
+      .write(registers::ta, duration_to_divider(times[0], clock_freq_))
+      .write(registers::tb, duration_to_divider(times[1], clock_freq_))
+      .write(registers::te, duration_to_divider(times[2], clock_freq_))
+      .write(registers::th, duration_to_divider(times[3], clock_freq_))
+      .write(registers::vcc_offset,
+             duration_to_divider(times[4], clock_freq_))
+      .write(registers::clk_offset,
+             duration_to_divider(times[5], clock_freq_))
+      .execute();
 
   // TODO return correct times
   return times;
 }
+static wait_condition rx_occupancy_at_least(std::size_t n) {
+  return {registers::buffers, registers::buffers_rx_occupancy_msk,
+          static_cast<uint32_t>(n) << registers::buffers_rx_occupancy_pos,
+          condition::greater_equal};
+}
+
 // read
 std::vector<std::byte> master::receive() {
-  logging::logger->debug("UART read buffer");
+  SPINALTAP_LOG_DEBUG("UART read buffer");
   auto rx_level = rx_fifo_available();
 
   std::vector<std::byte> ret;
   ret.resize(rx_level);
   device_.readStream(registers::rx_fifo, gsl::span<std::byte>(ret));
-  logging::logger->debug("UART read: < {:n}",
-                         spdlog::to_hex(ret.begin(), ret.end()));
+  SPINALTAP_LOG_TRACE("UART read: < {:n}",
+                      spdlog::to_hex(ret.begin(), ret.end()));
   return ret;
 }
 // wait and read
 bool master::receive(gsl::span<std::byte> buffer,
                      duration timeout /* = std::chrono::seconds(1) */) {
-  logging::logger->debug("UART read {} bytes", buffer.size());
-  const auto end = std::chrono::system_clock::now() + timeout;
-  while (rx_fifo_available() < buffer.size()) {
-    if (std::chrono::system_clock::now() > end)
-      return false;
-  }
+  SPINALTAP_LOG_DEBUG("UART read {} bytes", buffer.size());
+  // don't chain the read with the wait, it would drain the FIFO even
+  // if the wait timed out
+  if (!device_.poll(rx_occupancy_at_least(buffer.size()),
+                    std::chrono::ceil<std::chrono::milliseconds>(timeout)))
+    return false;
 
   device_.readStream(registers::rx_fifo, buffer);
-  logging::logger->debug("UART read: < {:n}",
-                         spdlog::to_hex(cbegin(buffer), cend(buffer)));
+  SPINALTAP_LOG_TRACE("UART read: < {:n}",
+                      spdlog::to_hex(cbegin(buffer), cend(buffer)));
   return true;
 }
 //wait and read
 std::vector<std::byte>
 master::receive(std::size_t n,
                 duration timeout /* = std::chrono::seconds(1) */) {
-  logging::logger->debug("UART read {} bytes", n);
-  const auto end = std::chrono::system_clock::now() + timeout;
-  while (rx_fifo_available() < n) {
-    if (std::chrono::system_clock::now() > end)
-      return {};
-  }
+  SPINALTAP_LOG_DEBUG("UART read {} bytes", n);
+  if (!device_.poll(rx_occupancy_at_least(n),
+                    std::chrono::ceil<std::chrono::milliseconds>(timeout)))
+    return {};
 
   std::vector<std::byte> ret;
   ret.resize(n);
   device_.readStream(registers::rx_fifo, gsl::span<std::byte>(ret));
-  logging::logger->debug("UART read: < {:n}",
-                         spdlog::to_hex(cbegin(ret), cend(ret)));
+  SPINALTAP_LOG_TRACE("UART read: < {:n}",
+                      spdlog::to_hex(cbegin(ret), cend(ret)));
   return ret;
 }
 // read
@@ -176,25 +176,19 @@ master::receive(duration timeout /* = std::chrono::seconds(1) */) {
 }
 
 bool master::character_repetition() {
-  auto reg = device_.readRegister(registers::config);
-  return (reg & registers::config_charrep) != 0;
+  return read_field<registers::config_t::charrep>(device_, 0) != 0;
 }
 
 void master::set_character_repetition(bool charrep) {
-  device_.readModifyWrite(registers::config, registers::config_charrep,
-                          charrep ? registers::config_charrep : 0);
+  write_fields(device_, 0, registers::config_t::charrep::of(charrep));
 }
 
 uint32_t master::character_guard_time() {
-  auto reg = device_.readRegister(registers::config);
-  return (reg & registers::config_cgt_msk) >> registers::config_cgt_pos;
+  return read_field<registers::config_t::cgt>(device_, 0);
 }
 
 void master::set_character_guard_time(uint32_t cgt) {
-  if (((uint64_t)cgt << registers::config_cgt_pos) > registers::config_cgt_msk)
-    throw std::runtime_error("cgt too big for available bits in register");
-  device_.readModifyWrite(registers::config, registers::config_cgt_msk,
-                          cgt << registers::config_cgt_pos);
+  write_fields(device_, 0, registers::config_t::cgt::of(cgt));
 }
 
 master::duration master::iso_clock() const {
@@ -256,20 +250,28 @@ void master::disable_character_timeout() {
 }
 
 uint16_t master::rx_fifo_available() const {
-  auto ret = device_.readRegister(registers::buffers);
-  return (ret & registers::buffers_rx_occupancy_msk) >>
-         registers::buffers_rx_occupancy_pos;
+  return static_cast<uint16_t>(
+      read_field<registers::buffers_t::rx_occupancy>(device_, 0));
 }
 
 uint16_t master::tx_fifo_free() const {
-  auto ret = device_.readRegister(registers::buffers);
-  return (ret & registers::buffers_tx_available_msk) >>
-         registers::buffers_tx_available_pos;
+  return static_cast<uint16_t>(
+      read_field<registers::buffers_t::tx_available>(device_, 0));
 }
 
 void master::read_cache() {
-  clock_freq_ = device_.readRegister(registers::frequency);
-  auto buffers = device_.readRegister(registers::buffer_sizes);
+  for (auto address : {registers::config, registers::config2,
+                       registers::clockrate, registers::config7,
+                       registers::config8})
+    device_.markConfiguration(address);
+
+  uint32_t frequency;
+  uint32_t buffers;
+  transaction{device_}
+      .read(registers::frequency, frequency)
+      .read(registers::buffer_sizes, buffers)
+      .execute();
+  clock_freq_ = frequency;
   rx_buffer_size_ = (buffers & registers::buffer_sizes_rx_buffer_size_msk) >>
                     registers::buffer_sizes_rx_buffer_size_pos;
   tx_buffer_size_ = (buffers & registers::buffer_sizes_tx_buffer_size_msk) >>
@@ -0,0 +1,61 @@
+#include "spinaltap/metrics.hpp"
+#include "spinaltap/protocol.hpp"
+
+namespace spinaltap {
+
+void device_metrics::set_in_flight(std::size_t n) noexcept {
+  in_flight.store(n, std::memory_order_relaxed);
+  auto max = max_in_flight.load(std::memory_order_relaxed);
+  while (n > max && !max_in_flight.compare_exchange_weak(
+                        max, n, std::memory_order_relaxed))
+    ;
+}
+
+void device_metrics::reset() noexcept {
+  for (auto &h : latency)
+    h.reset();
+  for (auto &c : commands)
+    c = 0;
+  transfers = 0;
+  bytes_sent = 0;
+  bytes_received = 0;
+  timeouts = 0;
+  failures = 0;
+  poll_retries = 0;
+  max_in_flight = in_flight.load();
+}
+
+usb::metrics_snapshot device_metrics::snapshot() const {
+  usb::metrics_snapshot result;
+  for (std::size_t op = 0; op < opcodes; op++) {
+    const auto n = commands[op].load(std::memory_order_relaxed);
+    // only report the commands that were used
+    if (n == 0)
+      continue;
+    const std::vector<std::pair<std::string, std::string>> labels{
+        {"opcode", protocol::command_name(static_cast<uint8_t>(op))}};
+    result.counters.push_back({{"spinaltap_commands_total", labels}, n});
+    result.histograms.push_back(
+        {{"spinaltap_command_latency_seconds", labels},
+         latency[op].snapshot()});
+  }
+  result.counters.push_back(
+      {{"spinaltap_transfers_total", {}}, transfers.load()});
+  result.counters.push_back(
+      {{"spinaltap_bytes_sent_total", {}}, bytes_sent.load()});
+  result.counters.push_back(
+      {{"spinaltap_bytes_received_total", {}}, bytes_received.load()});
+  result.counters.push_back(
+      {{"spinaltap_timeouts_total", {}}, timeouts.load()});
+  result.counters.push_back(
+      {{"spinaltap_command_failures_total", {}}, failures.load()});
+  result.counters.push_back(
+      {{"spinaltap_poll_retries_total", {}}, poll_retries.load()});
+  result.gauges.push_back(
+      {{"spinaltap_in_flight", {}}, static_cast<double>(in_flight.load())});
+  result.gauges.push_back({{"spinaltap_in_flight_max", {}},
+                           static_cast<double>(max_in_flight.load())});
+  return result;
+}
+
+} // namespace spinaltap
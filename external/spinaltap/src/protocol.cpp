@@ -0,0 +1,91 @@
+#include "spinaltap/protocol.hpp"
+
+#include <limits>
+#include <stdexcept>
+
+namespace spinaltap::protocol {
+
+template <std::size_t N>
+static std::array<uint8_t, N> make_command(cmd op, uint32_t address) {
+  check_address(address);
+  std::array<uint8_t, N> msg{};
+  msg[1] = static_cast<uint8_t>(op);
+  endian::store(static_cast<uint16_t>(address),
+                gsl::span(msg).template subspan<2, 2>());
+  return msg;
+}
+
+void check_address(uint32_t address) {
+  if (address >= std::numeric_limits<uint16_t>::max())
+    throw std::logic_error("impossible register address");
+}
+
+void check_length(std::size_t length) {
+  if (length > max_stream_length)
+    throw std::logic_error("stream too long for a single command");
+}
+
+std::array<uint8_t, read_size> encode_read(uint32_t address) {
+  return make_command<read_size>(cmd::read, address);
+}
+
+std::array<uint8_t, write_size> encode_write(uint32_t address,
+                                             uint32_t value) {
+  auto msg = make_command<write_size>(cmd::write, address);
+  endian::store(value, gsl::span(msg).subspan<4, 4>());
+  return msg;
+}
+
+std::array<uint8_t, stream_header_size>
+encode_stream(cmd op, uint32_t address, std::size_t length) {
+  check_length(length);
+  auto msg = make_command<stream_header_size>(op, address);
+  endian::store(static_cast<uint16_t>(length), gsl::span(msg).subspan<4, 2>());
+  return msg;
+}
+
+std::array<uint8_t, read_modify_write_size>
+encode_read_modify_write(uint32_t address, uint32_t mask, uint32_t value) {
+  auto msg = make_command<read_modify_write_size>(cmd::readModifyWrite,
+                                                  address);
+  endian::store(mask, gsl::span(msg).subspan<4, 4>());
+  endian::store(value, gsl::span(msg).subspan<8, 4>());
+  return msg;
+}
+
+std::array<uint8_t, wait_size> encode_wait(const wait_condition &condition,
+                                           std::chrono::milliseconds timeout) {
+  if (timeout > max_wait_timeout || timeout.count() < 0)
+    throw std::logic_error("invalid wait timeout");
+  auto msg = make_command<wait_size>(cmd::wait, condition.address);
+  endian::store(condition.mask, gsl::span(msg).subspan<4, 4>());
+  endian::store(condition.expected, gsl::span(msg).subspan<8, 4>());
+  endian::store(static_cast<uint16_t>(timeout.count()),
+                gsl::span(msg).subspan<12, 2>());
+  msg[14] = static_cast<uint8_t>(condition.cond);
+  return msg;
+}
+
+const char *command_name(uint8_t opcode) noexcept {
+  switch (static_cast<cmd>(opcode)) {
+  case cmd::write:
+    return "write";
+  case cmd::read:
+    return "read";
+  case cmd::flush:
+    return "flush";
+  case cmd::writeStream8:
+    return "writeStream8";
+  case cmd::readStream8:
+    return "readStream8";
+  case cmd::readStream32:
+    return "readStream32";
+  case cmd::readModifyWrite:
+    return "readModifyWrite";
+  case cmd::wait:
+    return "wait";
+  }
+  return "unknown";
+}
+
+} // namespace spinaltap::protocol
@@ -1,14 +1,35 @@
 #include "spinaltap/pwm/pwm.hpp"
 #include "spinaltap/pwm/registers.hpp"
 
+#include <algorithm>
+
 namespace spinaltap::pwm {
 
+using registers::ctrl_t;
+
+pwm::pwm(device &device, uint32_t baseAddress)
+    : device_(device), baseAddress_(baseAddress) {
+  device_.markConfiguration(baseAddress_ + registers::prescaler);
+  device_.markConfiguration(baseAddress_ + registers::max);
+  for (int idx = 0; idx < 3; idx++)
+    device_.markConfiguration(idx_to_address(idx));
+}
+
 uint32_t pwm::idx_to_address(int idx) const {
   if (idx > 2)
     throw std::runtime_error("invalid PWM index"); // TODO custom exception
   return baseAddress_ + registers::level(static_cast<uint8_t>(idx));
 }
 
+bool pwm::running() const {
+  return read_field<ctrl_t::run>(device_, baseAddress_) != 0;
+}
+
+void pwm::set_running(bool run) {
+  write_fields(device_, baseAddress_,
+               ctrl_t::run::of(static_cast<uint32_t>(run)));
+}
+
 uint32_t pwm::max_count() const {
   return device_.readRegister(baseAddress_ + registers::max);
 }
@@ -34,10 +55,14 @@ void pwm::set_width(uint8_t idx, uint8_t w) {
 }
 
 std::array<uint8_t, 3> pwm::widths() const {
+  const std::array<uint32_t, 3> addresses{
+      idx_to_address(0), idx_to_address(1), idx_to_address(2)};
+  std::array<uint32_t, 3> levels;
+  device_.readRegisters(addresses, levels);
+
   std::array<uint8_t, 3> w;
-  // TODO read all at once
-  for (int idx = 0; idx < w.size(); idx++)
-    w[idx] = static_cast<uint8_t>(device_.readRegister(idx_to_address(idx)));
+  std::transform(levels.begin(), levels.end(), w.begin(),
+                 [](uint32_t level) { return static_cast<uint8_t>(level); });
   return w;
 }
 
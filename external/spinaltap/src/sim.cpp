@@ -0,0 +1,213 @@
+#include "spinaltap/sim/bridge.hpp"
+#include "spinaltap.hpp"
+#include "spinaltap/protocol.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace spinaltap::sim {
+
+uint32_t bridge::get(uint16_t address) const {
+  auto it = registers_.find(address);
+  return it == registers_.end() ? 0 : it->second;
+}
+
+void bridge::on_read(uint16_t address, read_hook hook) {
+  read_hooks_[address] = std::move(hook);
+}
+
+void bridge::on_write(uint16_t address, write_hook hook) {
+  write_hooks_[address] = std::move(hook);
+}
+
+uint32_t bridge::read(uint16_t address) {
+  auto it = read_hooks_.find(address);
+  return it == read_hooks_.end() ? get(address) : it->second();
+}
+
+void bridge::write(uint16_t address, uint32_t value) {
+  auto it = write_hooks_.find(address);
+  if (it == write_hooks_.end())
+    set(address, value);
+  else
+    it->second(value);
+}
+
+std::chrono::nanoseconds bridge::transfer_time(std::size_t bytes) const {
+  return std::chrono::nanoseconds(static_cast<std::chrono::nanoseconds::rep>(
+      static_cast<double>(bytes) * 1e9 / config_.bandwidth));
+}
+
+void bridge::set_handlers(receive_handler on_receive, error_handler on_error) {
+  on_receive_ = std::move(on_receive);
+  on_error_ = std::move(on_error);
+}
+
+void bridge::send(std::vector<uint8_t> &buffer) {
+  transfers_++;
+  const auto arrival =
+      std::max(now_, out_busy_) + transfer_time(buffer.size());
+  out_busy_ = arrival;
+  input_.insert(input_.end(), buffer.begin(), buffer.end());
+  buffer.clear();
+
+  // commands are executed in order, hooks see the time of execution
+  const auto host_time = now_;
+  now_ = std::max(device_busy_, arrival + config_.latency);
+  std::vector<uint8_t> data;
+  try {
+    data = execute();
+  } catch (...) {
+    now_ = host_time;
+    throw;
+  }
+  device_busy_ = now_;
+  now_ = host_time;
+
+  if (data.empty())
+    return;
+  const auto due =
+      std::max(device_busy_, in_busy_) + transfer_time(data.size());
+  in_busy_ = due;
+  replies_.push_back({due, std::move(data)});
+}
+
+std::vector<uint8_t> bridge::execute() {
+  std::vector<uint8_t> out;
+  auto in = gsl::span<uint8_t>(input_);
+  auto word = [](gsl::span<uint8_t> data, std::size_t offset) {
+    return endian::load<uint32_t>(data.subspan(offset, 4));
+  };
+  auto append = [&](uint32_t value) {
+    std::array<uint8_t, 4> bytes;
+    endian::store(value, bytes);
+    out.insert(out.end(), bytes.begin(), bytes.end());
+  };
+
+  std::size_t offset = 0;
+  while (in.size() - offset >= protocol::read_size) {
+    auto command = in.subspan(offset);
+    const auto op = static_cast<cmd>(command[1]);
+    const auto address = endian::load<uint16_t>(command.subspan(2, 2));
+    std::size_t size;
+    switch (op) {
+    case cmd::write:
+      size = protocol::write_size;
+      break;
+    case cmd::read:
+      size = protocol::read_size;
+      break;
+    case cmd::writeStream8:
+      size = command.size() < protocol::stream_header_size
+                 ? protocol::stream_header_size
+                 : protocol::stream_header_size +
+                       endian::load<uint16_t>(command.subspan(4, 2));
+      break;
+    case cmd::readStream8:
+    case cmd::readStream32:
+      size = protocol::stream_header_size;
+      break;
+    case cmd::readModifyWrite:
+      size = protocol::read_modify_write_size;
+      break;
+    case cmd::wait:
+      if (!config_.wait_command)
+        throw std::runtime_error("sim: wait command not supported");
+      size = protocol::wait_size;
+      break;
+    default:
+      input_.clear();
+      throw std::runtime_error("sim: invalid opcode");
+    }
+    // wait for the rest of the command
+    if (command.size() < size)
+      break;
+    command = command.first(size);
+    offset += size;
+    commands_++;
+
+    out.push_back(command[0]);
+    out.push_back(command[1]);
+    switch (op) {
+    case cmd::write:
+      write(address, word(command, 4));
+      break;
+    case cmd::read:
+      append(read(address));
+      break;
+    case cmd::writeStream8:
+      for (auto b : command.subspan(protocol::stream_header_size))
+        write(address, b);
+      break;
+    case cmd::readStream8: {
+      const auto length = endian::load<uint16_t>(command.subspan(4, 2));
+      for (std::size_t i = 0; i < length; i++)
+        out.push_back(static_cast<uint8_t>(read(address)));
+      break;
+    }
+    case cmd::readStream32: {
+      const auto length = endian::load<uint16_t>(command.subspan(4, 2));
+      for (std::size_t i = 0; i < length; i++)
+        append(read(address));
+      break;
+    }
+    case cmd::readModifyWrite: {
+      const auto mask = word(command, 4);
+      const auto old = read(address);
+      write(address, (old & ~mask) | (word(command, 8) & mask));
+      append(old);
+      break;
+    }
+    case cmd::wait: {
+      const wait_condition condition{address, word(command, 4),
+                                     word(command, 8),
+                                     static_cast<spinaltap::condition>(
+                                         command[14])};
+      const auto deadline =
+          now_ + std::chrono::milliseconds(
+                     endian::load<uint16_t>(command.subspan(12, 2)));
+      auto value = read(address);
+      while (!condition.matches(value) && now_ < deadline) {
+        now_ += config_.poll_interval;
+        value = read(address);
+      }
+      append(value);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  input_.erase(input_.begin(), input_.begin() + offset);
+  return out;
+}
+
+void bridge::cancel_receive() noexcept {
+  // data on its way is lost, like in a cancelled transfer
+  replies_.clear();
+  reads_posted_ = false;
+}
+
+void bridge::process_events(std::chrono::microseconds timeout) {
+  if (replies_.empty() || !reads_posted_ ||
+      replies_.front().due > now_ + timeout) {
+    now_ += timeout;
+    return;
+  }
+
+  auto &front = replies_.front();
+  now_ = std::max(now_, front.due);
+  const auto n = std::min(front.data.size(), config_.receive_size);
+  std::vector<uint8_t> data(front.data.begin(), front.data.begin() + n);
+  if (n == front.data.size())
+    replies_.pop_front();
+  else
+    front.data.erase(front.data.begin(), front.data.begin() + n);
+
+  // like a completed IN transfer, reads have to be posted again
+  reads_posted_ = false;
+  if (on_receive_)
+    on_receive_(data);
+}
+
+} // namespace spinaltap::sim
@@ -0,0 +1,191 @@
+#include "spinaltap/sim/spi_flash.hpp"
+#include "spinaltap/spi/registers.hpp"
+
+#include <algorithm>
+
+namespace spinaltap::sim {
+
+namespace regs = spinaltap::spi::registers;
+
+namespace {
+enum opcode : uint8_t {
+  write_enable = 0x06,
+  write_disable = 0x04,
+  read_status = 0x05,
+  read_data = 0x03,
+  fast_read = 0x0b,
+  page_program = 0x02,
+  sector_erase = 0x20,
+  read_sfdp = 0x5a,
+  read_jedec_id = 0x9f,
+};
+
+constexpr uint8_t status_wip = 0x01;
+constexpr uint8_t status_wel = 0x02;
+constexpr std::size_t page_size = 256;
+constexpr std::size_t sector_size = 4096;
+// offset of the basic flash parameter table within the SFDP area
+constexpr std::size_t basic_table = 0x80;
+
+void store(std::vector<uint8_t> &out, std::size_t offset, uint32_t value) {
+  for (std::size_t i = 0; i < 4; i++)
+    out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+// SFDP header, one parameter header and the JESD216 basic table
+std::vector<uint8_t> make_sfdp(std::size_t size) {
+  std::vector<uint8_t> sfdp(basic_table + 9 * 4, 0xff);
+  store(sfdp, 0x00, 0x50444653); // "SFDP"
+  store(sfdp, 0x04, 0xff000100); // v1.0, 1 parameter header
+  store(sfdp, 0x08, 0x09000100); // basic table v1.0, 9 dwords
+  store(sfdp, 0x0c, 0xff000000 | basic_table);
+  // 4 KiB erase with 0x20, 3 byte addresses
+  store(sfdp, basic_table + 0x00, 0xfff120e5);
+  // density in bits - 1
+  store(sfdp, basic_table + 0x04, static_cast<uint32_t>(size * 8 - 1));
+  // erase types 4 KiB/0x20, 32 KiB/0x52, 64 KiB/0xd8
+  store(sfdp, basic_table + 0x1c, 0x520f200c);
+  store(sfdp, basic_table + 0x20, 0x0000d810);
+  return sfdp;
+}
+} // namespace
+
+spi_flash::spi_flash(bridge &bridge, uint32_t base, config config)
+    : bridge_(bridge), config_(config), memory_(config.size, 0xff),
+      sfdp_(make_sfdp(config.size)) {
+  bridge_.set(base + regs::frequency, 100'000'000);
+  bridge_.set(base + regs::prescaler_width, 20);
+  bridge_.set(base + regs::buffers,
+              regs::buffers_t::rx_size::of(config.fifo_size).bits |
+                  regs::buffers_t::tx_size::of(config.fifo_size).bits);
+  // shifting is instantaneous, the master is never busy
+  bridge_.set(base + regs::status, 0);
+
+  bridge_.on_write(base + regs::tx, [this](uint32_t v) {
+    tx_.push_back(static_cast<uint8_t>(v));
+  });
+  bridge_.on_read(base + regs::rx, [this]() -> uint32_t {
+    if (rx_.empty())
+      return 0;
+    const auto v = rx_.front();
+    rx_.pop_front();
+    return v;
+  });
+  bridge_.on_write(base + regs::trigger, [this](uint32_t v) { trigger(v); });
+}
+
+void spi_flash::trigger(uint32_t value) {
+  if ((value & regs::trigger_flush) != 0)
+    rx_.clear();
+  if ((value & regs::trigger_assert) != 0)
+    select();
+  if ((value & regs::trigger_transceive) != 0) {
+    for (const auto b : tx_)
+      rx_.push_back(shift(b));
+    tx_.clear();
+  }
+  if ((value & regs::trigger_deassert) != 0)
+    deselect();
+}
+
+void spi_flash::select() {
+  selected_ = true;
+  command_.clear();
+  ignored_ = false;
+}
+
+bool spi_flash::busy() const noexcept { return bridge_.now() < busy_until_; }
+
+uint32_t spi_flash::address() const noexcept {
+  return (static_cast<uint32_t>(command_[1]) << 16) |
+         (static_cast<uint32_t>(command_[2]) << 8) | command_[3];
+}
+
+uint8_t spi_flash::shift(uint8_t in) {
+  if (!selected_)
+    return 0xff;
+  command_.push_back(in);
+  const auto position = command_.size() - 1;
+  if (position == 0) {
+    ignored_ = busy() && in != read_status;
+    if (ignored_)
+      ignored_count_++;
+    return 0xff;
+  }
+  if (ignored_)
+    return 0xff;
+
+  switch (command_[0]) {
+  case read_status:
+    return static_cast<uint8_t>((busy() ? status_wip : 0) |
+                                (write_enabled_ ? status_wel : 0));
+  case read_jedec_id: {
+    const uint8_t id[] = {config_.manufacturer,
+                          static_cast<uint8_t>(config_.device >> 8),
+                          static_cast<uint8_t>(config_.device)};
+    return position <= 3 ? id[position - 1] : 0xff;
+  }
+  case read_data:
+    if (position < 4)
+      return 0xff;
+    return memory_[(address() + position - 4) % memory_.size()];
+  case fast_read:
+    if (position < 5)
+      return 0xff;
+    return memory_[(address() + position - 5) % memory_.size()];
+  case read_sfdp: {
+    if (position < 5)
+      return 0xff;
+    const auto offset = address() + position - 5;
+    return offset < sfdp_.size() ? sfdp_[offset] : 0xff;
+  }
+  default:
+    return 0xff;
+  }
+}
+
+void spi_flash::deselect() {
+  selected_ = false;
+  if (command_.empty() || ignored_)
+    return;
+
+  switch (command_[0]) {
+  case write_enable:
+    write_enabled_ = true;
+    break;
+  case write_disable:
+    write_enabled_ = false;
+    break;
+  case page_program: {
+    if (!write_enabled_ || command_.size() < 4)
+      break;
+    // addresses wrap around within the page
+    const auto start = address() % memory_.size();
+    const auto page = start - start % page_size;
+    for (std::size_t i = 4; i < command_.size(); i++) {
+      const auto offset = page + (start + i - 4) % page_size;
+      memory_[offset] &= command_[i];
+    }
+    programs_++;
+    busy_until_ = bridge_.now() + config_.page_program;
+    write_enabled_ = false;
+    break;
+  }
+  case sector_erase: {
+    if (!write_enabled_ || command_.size() != 4)
+      break;
+    const auto start = address() % memory_.size();
+    const auto sector = start - start % sector_size;
+    std::fill_n(memory_.begin() + static_cast<std::ptrdiff_t>(sector),
+                sector_size, 0xff);
+    erases_++;
+    busy_until_ = bridge_.now() + config_.sector_erase;
+    write_enabled_ = false;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+} // namespace spinaltap::sim
@@ -1,6 +1,14 @@
 #include "spinaltap/spi/spi.hpp"
 #include "spinaltap/logging.hpp"
 #include "spinaltap/spi/registers.hpp"
+#include "spinaltap/transaction.hpp"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <future>
+#include <memory>
+#include <thread>
 
 namespace spinaltap::spi {
 
@@ -19,6 +27,9 @@ static double calc_frequency(uint32_t divider, double module_freq,
   return module_freq / static_cast<double>(divider);
 }
 
+// upper bound for the device to finish shifting out a transfer
+constexpr static std::chrono::milliseconds transfer_timeout{1000};
+
 constexpr static uint32_t ss_to_trigger(ss_action ss) noexcept {
   uint32_t trigger = 0;
   if (ss == ss_action::assert || ss == ss_action::both)
@@ -30,156 +41,385 @@ constexpr static uint32_t ss_to_trigger(ss_action ss) noexcept {
 
 master::master(device &device, uint32_t base_address)
     : device_(device), base_address_(base_address) {
-  module_frequency_ = device.readRegister(base_address_ + registers::frequency);
-  divider_width_ =
-      device.readRegister(base_address_ + registers::prescaler_width);
-  device.writeRegister(base_address_ + registers::trigger,
-                       registers::trigger_flush);
+  device_.markConfiguration(base_address_ + registers::config);
+  device_.markConfiguration(base_address_ + registers::guard_times);
+
+  uint32_t divider_width;
+  uint32_t buffers;
+  transaction{device}
+      .read(base_address_ + registers::frequency, module_frequency_)
+      .read(base_address_ + registers::prescaler_width, divider_width)
+      .read(base_address_ + registers::buffers, buffers)
+      .write(base_address_ + registers::trigger, registers::trigger_flush)
+      .execute();
+  divider_width_ = static_cast<int>(divider_width);
+  fifo_size_ = std::min(registers::buffers_t::rx_size::get(buffers),
+                        registers::buffers_t::tx_size::get(buffers));
+}
+
+using registers::config_t;
+using registers::guard_times_t;
+
+static uint32_t config_value(cpol pol, cpha pha, uint32_t divider) {
+  return value_of(config_t::cpol::of(static_cast<uint32_t>(pol)),
+                  config_t::cpha::of(static_cast<uint32_t>(pha)),
+                  config_t::prescaler::of(divider));
 }
 
 double master::configure(cpol pol, cpha pha, double frequency) {
   uint32_t divider = calc_divider(frequency, module_frequency_, divider_width_);
-  uint32_t conf = (static_cast<uint32_t>(pol) << registers::config_cpol_pos) |
-                  (static_cast<uint32_t>(pha) << registers::config_cpha_pos) |
-                  (divider << registers::config_prescaler_pos);
-  device_.writeRegister(base_address_ + registers::config, conf);
+  device_.writeRegister(base_address_ + registers::config,
+                        config_value(pol, pha, divider));
+  return module_frequency_ / divider;
+}
+
+double master::configure(cpol pol, cpha pha, double frequency,
+                         uint8_t word_guard_clocks,
+                         uint8_t ss_assert_guard_clocks,
+                         uint8_t ss_deassert_guard_clocks) {
+  uint32_t divider = calc_divider(frequency, module_frequency_, divider_width_);
+  uint32_t guard_times =
+      value_of(guard_times_t::word::of(word_guard_clocks),
+               guard_times_t::ss_assert::of(ss_assert_guard_clocks),
+               guard_times_t::ss_deassert::of(ss_deassert_guard_clocks));
+  transaction{device_}
+      .write(base_address_ + registers::config,
+             config_value(pol, pha, divider))
+      .write(base_address_ + registers::guard_times, guard_times)
+      .execute();
   return module_frequency_ / divider;
 }
 
 void master::set_polarity(cpol pol) {
-  device_.readModifyWrite(
-      base_address_ + registers::config, ~registers::config_cpol,
-      static_cast<uint32_t>(pol) << registers::config_cpol_pos);
+  write_fields(device_, base_address_,
+               config_t::cpol::of(static_cast<uint32_t>(pol)));
 }
 
 cpol master::polarity() const {
-  uint32_t config = device_.readRegister(base_address_ + registers::config);
-  return static_cast<cpol>((config & registers::config_cpol) >>
-                           registers::config_cpol_pos);
+  return static_cast<cpol>(
+      read_field<config_t::cpol>(device_, base_address_));
 }
 
 void master::set_phase(cpha pha) {
-  device_.readModifyWrite(
-      base_address_ + registers::config, ~registers::config_cpha,
-      static_cast<uint32_t>(pha) << registers::config_cpha_pos);
+  write_fields(device_, base_address_,
+               config_t::cpha::of(static_cast<uint32_t>(pha)));
 }
 
 cpha master::phase() const {
-  uint32_t config = device_.readRegister(base_address_ + registers::config);
-  return static_cast<cpha>((config & registers::config_cpha) >>
-                           registers::config_cpha_pos);
+  return static_cast<cpha>(
+      read_field<config_t::cpha>(device_, base_address_));
+}
+
+void master::set_mode(cpol pol, cpha pha) {
+  write_fields(device_, base_address_,
+               config_t::cpol::of(static_cast<uint32_t>(pol)),
+               config_t::cpha::of(static_cast<uint32_t>(pha)));
 }
 
 double master::set_frequency(double frequency) {
   uint32_t divider = calc_divider(frequency, module_frequency_, divider_width_);
-  device_.readModifyWrite(base_address_ + registers::config,
-                          registers::config_prescaler_msk,
-                          divider << registers::config_prescaler_pos);
+  write_fields(device_, base_address_, config_t::prescaler::of(divider));
   return calc_frequency(divider, module_frequency_, divider_width_);
 }
 
 double master::frequency() const {
-  uint32_t divider = (device_.readRegister(base_address_ + registers::config) &
-                      registers::config_prescaler_msk) >>
-                     registers::config_prescaler_pos;
+  uint32_t divider = read_field<config_t::prescaler>(device_, base_address_);
   return calc_frequency(divider, module_frequency_, divider_width_);
 }
 
 uint8_t master::word_guard_clocks() const {
-  uint8_t clocks = (device_.readRegister(registers::guard_times) &
-                    registers::guard_times_word_msk) >>
-                   registers::guard_times_word_pos;
-
-  return clocks;
+  return static_cast<uint8_t>(
+      read_field<guard_times_t::word>(device_, base_address_));
 }
 
 void master::set_word_guard_clocks(uint8_t clocks) {
-  logging::logger->debug("SPI set {} word guard clocks", clocks);
+  SPINALTAP_LOG_DEBUG("SPI set {} word guard clocks", clocks);
 
-  device_.readModifyWrite(registers::guard_times,
-                          registers::guard_times_word_msk,
-                          clocks << registers::guard_times_word_pos);
+  write_fields(device_, base_address_, guard_times_t::word::of(clocks));
 }
 
 uint8_t master::ss_assert_guard_clocks() const {
-  uint8_t clocks = (device_.readRegister(registers::guard_times) &
-                    registers::guard_times_assert_msk) >>
-                   registers::guard_times_assert_pos;
-
-  return clocks;
+  return static_cast<uint8_t>(
+      read_field<guard_times_t::ss_assert>(device_, base_address_));
 }
 
 void master::set_ss_assert_guard_clocks(uint8_t clocks) {
-  logging::logger->debug("SPI set {} assert clocks", clocks);
+  SPINALTAP_LOG_DEBUG("SPI set {} assert clocks", clocks);
 
-  device_.readModifyWrite(registers::guard_times,
-                          registers::guard_times_assert_msk,
-                          clocks << registers::guard_times_assert_pos);
+  write_fields(device_, base_address_, guard_times_t::ss_assert::of(clocks));
 }
 
 uint8_t master::ss_deassert_guard_clocks() const {
-  auto clocks = (device_.readRegister(registers::guard_times) &
-                 registers::guard_times_deassert_msk) >>
-                registers::guard_times_deassert_pos;
-
-  return static_cast<uint8_t>(clocks);
+  return static_cast<uint8_t>(
+      read_field<guard_times_t::ss_deassert>(device_, base_address_));
 }
 
 void master::set_ss_deassert_guard_clocks(uint8_t clocks) {
-  logging::logger->debug("SPI set {} word guard clocks", clocks);
+  SPINALTAP_LOG_DEBUG("SPI set {} deassert clocks", clocks);
 
-  device_.readModifyWrite(registers::guard_times,
-                          registers::guard_times_deassert_msk,
-                          clocks << registers::guard_times_deassert_pos);
+  write_fields(device_, base_address_,
+               guard_times_t::ss_deassert::of(clocks));
+}
+
+void master::set_guard_clocks(uint8_t word, uint8_t ss_assert,
+                              uint8_t ss_deassert) {
+  SPINALTAP_LOG_DEBUG("SPI set {}/{}/{} guard clocks", word, ss_assert,
+                      ss_deassert);
+
+  // the fields leave only reserved bits, so the register is written as a
+  // whole instead of read-modify-write
+  device_.writeRegister(
+      base_address_ + registers::guard_times,
+      value_of(guard_times_t::word::of(word),
+               guard_times_t::ss_assert::of(ss_assert),
+               guard_times_t::ss_deassert::of(ss_deassert)));
 }
 
 void master::transceive(gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx,
                         ss_action ss) {
-  logging::logger->debug("SPI txrx: > {:n}",
-                         spdlog::to_hex(tx.begin(), tx.end()));
+  SPINALTAP_LOG_TRACE("SPI txrx: > {:n}", spdlog::to_hex(tx.begin(), tx.end()));
 
   raw_transceive(tx, rx, ss);
 
-  logging::logger->debug("SPI txrx: < {:n}",
-                         spdlog::to_hex(rx.begin(), rx.end()));
+  SPINALTAP_LOG_TRACE("SPI txrx: < {:n}", spdlog::to_hex(rx.begin(), rx.end()));
 }
 
 void master::send(gsl::span<const uint8_t> tx, ss_action ss) {
-  logging::logger->debug("SPI txrx: > {:n}",
-                         spdlog::to_hex(tx.begin(), tx.end()));
+  SPINALTAP_LOG_TRACE("SPI txrx: > {:n}", spdlog::to_hex(tx.begin(), tx.end()));
+
+  raw_transceive(tx, {}, ss);
+}
 
-  device_.writeStream(base_address_ + registers::tx, gsl::as_bytes(tx));
-  device_.writeRegister(base_address_ + registers::trigger,
-                        registers::trigger_flush |
-                            registers::trigger_transceive | ss_to_trigger(ss));
-  if (!device_.poll(base_address_ + registers::status, registers::status_busy,
-                    0))
-    throw std::runtime_error("timeout, poll never finished");
+void master::send(stream_buffer tx, ss_action ss) {
+  SPINALTAP_LOG_DEBUG("SPI tx {} bytes", tx.size());
+
+  if (fifo_size_ != 0 && tx.size() > fifo_size_) {
+    const auto payload = tx.payload();
+    raw_transceive(gsl::span(reinterpret_cast<const uint8_t *>(payload.data()),
+                             payload.size()),
+                   {}, ss);
+    return;
+  }
+
+  device_.writeStream(base_address_ + registers::tx, std::move(tx));
+  transaction{device_}
+      .write(base_address_ + registers::trigger,
+             registers::trigger_flush | registers::trigger_transceive |
+                 ss_to_trigger(ss))
+      .wait(base_address_ + registers::status, registers::status_busy, 0,
+            transfer_timeout)
+      .execute();
 }
 
 void master::recv(gsl::span<uint8_t> rx, ss_action ss) {
-  logging::logger->debug("SPI rx {} bytes", rx.size());
+  SPINALTAP_LOG_DEBUG("SPI rx {} bytes", rx.size());
 
-  std::vector<uint8_t> dummy(rx.size(), 0);
-  transceive(dummy, rx, ss);
+  raw_transceive({}, rx, ss);
 
-  logging::logger->debug("SPI rx: < {:n}",
-                         spdlog::to_hex(rx.begin(), rx.end()));
+  SPINALTAP_LOG_TRACE("SPI rx: < {:n}", spdlog::to_hex(rx.begin(), rx.end()));
+}
+
+void master::ss(ss_action action) {
+  if (action == ss_action::noop)
+    return;
+  transaction{device_}
+      .write(base_address_ + registers::trigger, ss_to_trigger(action))
+      .wait(base_address_ + registers::status, registers::status_busy, 0,
+            transfer_timeout)
+      .execute();
+}
+
+// sent in place of a missing tx buffer
+constexpr static std::array<uint8_t, 256> zeros{};
+
+// slave select bits of one of several chunks of a transfer
+static uint32_t chunk_trigger(ss_action ss, bool first, bool last) {
+  uint32_t trigger = 0;
+  if (first && (ss == ss_action::assert || ss == ss_action::both))
+    trigger |= registers::trigger_assert;
+  if (last && (ss == ss_action::deassert || ss == ss_action::both))
+    trigger |= registers::trigger_deassert;
+  return trigger;
+}
+
+// fills, starts and drains a single chunk of size bytes, trigger holds the
+// ss bits. tx and rx may be empty, see segment.
+static void queue_chunk(transaction &t, uint32_t base,
+                        gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx,
+                        std::size_t size, uint32_t trigger) {
+  if (!tx.empty()) {
+    t.writeStream(base + registers::tx, gsl::as_bytes(tx));
+  } else {
+    for (std::size_t done = 0; done < size; done += zeros.size()) {
+      t.writeStream(base + registers::tx,
+                    gsl::as_bytes(gsl::span(zeros).first(
+                        std::min(zeros.size(), size - done))));
+    }
+  }
+  t.write(base + registers::trigger,
+          registers::trigger_flush | registers::trigger_transceive | trigger)
+      .wait(base + registers::status, registers::status_busy, 0,
+            transfer_timeout);
+  if (!rx.empty())
+    t.readStream(base + registers::rx, gsl::as_writable_bytes(rx));
+}
+
+// splits the segment at FIFO boundaries like segmented_transceive
+static void queue_segment(transaction &t, uint32_t base,
+                          std::size_t fifo_size, const segment &s) {
+  const auto size = std::max(s.tx.size(), s.rx.size());
+  if (size == 0) {
+    if (s.ss != ss_action::noop) {
+      t.write(base + registers::trigger, ss_to_trigger(s.ss))
+          .wait(base + registers::status, registers::status_busy, 0,
+                transfer_timeout);
+    }
+    return;
+  }
+
+  const auto chunk = fifo_size == 0 ? size : fifo_size;
+  for (std::size_t offset = 0; offset < size; offset += chunk) {
+    const auto n = std::min(chunk, size - offset);
+    queue_chunk(t, base, s.tx.empty() ? s.tx : s.tx.subspan(offset, n),
+                s.rx.empty() ? s.rx : s.rx.subspan(offset, n), n,
+                chunk_trigger(s.ss, offset == 0, offset + n == size));
+  }
 }
 
 void master::raw_transceive(gsl::span<const uint8_t> tx, gsl::span<uint8_t> rx,
                             ss_action ss) {
-  if (rx.size() < tx.size())
+  if (!tx.empty() && !rx.empty() && tx.size() != rx.size())
     throw std::runtime_error("invalid buffer sizes");
 
-  device_.writeStream(base_address_ + registers::tx, gsl::as_bytes(tx));
-  device_.writeRegister(base_address_ + registers::trigger,
-                        registers::trigger_flush |
-                            registers::trigger_transceive | ss_to_trigger(ss));
-  if (!device_.poll(base_address_ + registers::status, registers::status_busy,
-                    0))
-    throw std::runtime_error("timeout, poll never finished");
-  device_.readStream(base_address_ + registers::rx, gsl::as_writable_bytes(rx));
+  const auto size = tx.empty() ? rx.size() : tx.size();
+  if (fifo_size_ != 0 && size > fifo_size_) {
+    segmented_transceive(tx, rx, ss);
+    return;
+  }
+
+  transaction t{device_};
+  queue_chunk(t, base_address_, tx, rx, size, ss_to_trigger(ss));
+  t.execute();
+}
+
+// Splits the transfer at FIFO boundaries. The device executes commands in
+// order, so if it waits on its own the chunks are queued back to back and
+// the USB round trip of one chunk overlaps with shifting the others. With
+// emulated waits the host has to see a chunk finish before starting the
+// next one.
+void master::segmented_transceive(gsl::span<const uint8_t> tx,
+                                  gsl::span<uint8_t> rx, ss_action ss) {
+  const auto size = tx.empty() ? rx.size() : tx.size();
+  SPINALTAP_LOG_DEBUG("SPI txrx {} bytes in chunks of {}", size, fifo_size_);
+
+  const bool pipelined = device_.supportedFeatures().wait;
+  std::deque<std::future<void>> in_flight;
+  std::exception_ptr error;
+  const auto wait_oldest = [&] {
+    try {
+      device_.wait(std::move(in_flight.front()));
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+    in_flight.pop_front();
+  };
+
+  for (std::size_t offset = 0; offset < size && !error;
+       offset += fifo_size_) {
+    const auto n = std::min(fifo_size_, size - offset);
+    transaction t{device_};
+    queue_chunk(t, base_address_, tx.empty() ? tx : tx.subspan(offset, n),
+                rx.empty() ? rx : rx.subspan(offset, n), n,
+                chunk_trigger(ss, offset == 0, offset + n == size));
+    if (!pipelined) {
+      t.execute();
+      continue;
+    }
+
+    if (in_flight.size() == pipeline_depth)
+      wait_oldest();
+    auto promise = std::make_shared<std::promise<void>>();
+    in_flight.push_back(promise->get_future());
+    t.submit([promise](std::exception_ptr e) {
+      if (e)
+        promise->set_exception(e);
+      else
+        promise->set_value();
+    });
+  }
+  while (!in_flight.empty())
+    wait_oldest();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+uint32_t master::segment_config(uint32_t config, const segment &s) const {
+  if (s.frequency != 0) {
+    const auto divider =
+        calc_divider(s.frequency, module_frequency_, divider_width_);
+    config = (config & ~config_t::prescaler::mask) |
+             config_t::prescaler::of(divider).bits;
+  }
+  if (s.pol) {
+    config = (config & ~config_t::cpol::mask) |
+             config_t::cpol::of(static_cast<uint32_t>(*s.pol)).bits;
+  }
+  if (s.pha) {
+    config = (config & ~config_t::cpha::mask) |
+             config_t::cpha::of(static_cast<uint32_t>(*s.pha)).bits;
+  }
+  return config;
+}
+
+void master::execute(gsl::span<const segment> message) {
+  SPINALTAP_LOG_DEBUG("SPI message of {} segments", message.size());
+
+  for (const auto &s : message) {
+    if (!s.tx.empty() && !s.rx.empty() && s.tx.size() != s.rx.size())
+      throw std::runtime_error("invalid buffer sizes");
+  }
+
+  // the configuration is only read if a segment overrides it, segments
+  // switch between it and their own with plain writes
+  const bool overrides =
+      std::any_of(message.begin(), message.end(), [](const segment &s) {
+        return s.frequency != 0 || s.pol || s.pha;
+      });
+  const auto config_address = base_address_ + registers::config;
+  const uint32_t configured =
+      overrides ? device_.readRegister(config_address) : 0;
+  uint32_t current = configured;
+
+  transaction t{device_};
+  try {
+    for (const auto &s : message) {
+      if (overrides) {
+        const auto wanted = segment_config(configured, s);
+        if (wanted != current)
+          t.write(config_address, wanted);
+        current = wanted;
+      }
+      queue_segment(t, base_address_, fifo_size_, s);
+      if (s.delay.count() > 0) {
+        t.execute();
+        std::this_thread::sleep_for(s.delay);
+      }
+    }
+    if (current != configured)
+      t.write(config_address, configured);
+    t.execute();
+  } catch (...) {
+    // an override may have been sent already, later transfers must not
+    // run with it. The original error is the one worth reporting.
+    if (current != configured) {
+      try {
+        transaction{device_}.write(config_address, configured).execute();
+      } catch (...) {
+      }
+    }
+    throw;
+  }
 }
 
 } // namespace spinaltap::spi
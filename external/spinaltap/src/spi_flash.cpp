@@ -0,0 +1,254 @@
+#include "spinaltap/spi/flash.hpp"
+#include "spinaltap/logging.hpp"
+
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <vector>
+
+namespace spinaltap::spi {
+
+namespace {
+enum opcode : uint8_t {
+  write_enable = 0x06,
+  read_status = 0x05,
+  fast_read = 0x0b,
+  page_program = 0x02,
+  read_sfdp = 0x5a,
+  read_jedec_id = 0x9f,
+};
+
+constexpr uint8_t status_wip = 0x01;
+constexpr uint8_t status_wel = 0x02;
+constexpr uint32_t sfdp_signature = 0x50444653;
+// ID of the basic flash parameter table, LSB in byte 0 and MSB in byte 7
+constexpr uint16_t basic_table_id = 0xff00;
+// limit of 3 byte addresses
+constexpr std::size_t address_space = 1U << 24;
+
+std::array<uint8_t, 4> command(uint8_t opcode, uint32_t address) {
+  return {opcode, static_cast<uint8_t>(address >> 16),
+          static_cast<uint8_t>(address >> 8), static_cast<uint8_t>(address)};
+}
+
+// command, address and a dummy byte, used by fast read and SFDP
+std::array<uint8_t, 5> command_dummy(uint8_t opcode, uint32_t address) {
+  return {opcode, static_cast<uint8_t>(address >> 16),
+          static_cast<uint8_t>(address >> 8), static_cast<uint8_t>(address),
+          0};
+}
+} // namespace
+
+double flash_stats::rate() const noexcept {
+  const std::chrono::duration<double> seconds = elapsed;
+  return seconds.count() > 0 ? static_cast<double>(bytes) / seconds.count()
+                             : 0.;
+}
+
+jedec_id flash::read_id() {
+  if (pending_)
+    wait_ready();
+
+  const std::array<uint8_t, 1> tx{read_jedec_id};
+  std::array<uint8_t, 3> rx{};
+  const message m{{tx, {}, ss_action::assert},
+                  {{}, rx, ss_action::deassert}};
+  master_.execute(m);
+  return {rx[0], static_cast<uint16_t>((rx[1] << 8) | rx[2])};
+}
+
+void flash::read_sfdp(uint32_t address, gsl::span<uint8_t> out) {
+  if (pending_)
+    wait_ready();
+
+  const auto tx = command_dummy(opcode::read_sfdp, address);
+  const message m{{tx, {}, ss_action::assert},
+                  {{}, out, ss_action::deassert}};
+  master_.execute(m);
+}
+
+// see JESD216, only the density and 4 KiB erase of the basic table are used
+const flash_parameters &flash::probe() {
+  std::array<uint8_t, 8> header{};
+  read_sfdp(0, header);
+  if (endian::load<uint32_t>(gsl::span(header).first(4)) != sfdp_signature)
+    throw std::runtime_error("flash has no SFDP");
+
+  std::vector<uint8_t> tables(static_cast<std::size_t>(header[6] + 1) * 8);
+  read_sfdp(8, tables);
+  for (std::size_t offset = 0; offset < tables.size(); offset += 8) {
+    const auto table = gsl::span(tables).subspan(offset, 8);
+    if (((table[7] << 8) | table[0]) != basic_table_id)
+      continue;
+    if (table[3] < 2)
+      throw std::runtime_error("SFDP basic parameter table too short");
+
+    const uint32_t pointer = (table[6] << 16) | (table[5] << 8) | table[4];
+    std::array<uint8_t, 8> dwords{};
+    read_sfdp(pointer, dwords);
+    const auto first = endian::load<uint32_t>(gsl::span(dwords).first(4));
+    const auto density = endian::load<uint32_t>(gsl::span(dwords).last(4));
+
+    if (((first >> 17) & 0x3) == 0x2)
+      throw std::runtime_error("flash only supports 4 byte addresses");
+    if ((first & 0x3) == 0x1)
+      parameters_.sector_erase_opcode = static_cast<uint8_t>(first >> 8);
+    const uint64_t bits = (density & 0x80000000U) != 0
+                              ? uint64_t{1} << std::min(density & 0x3fU, 63U)
+                              : uint64_t{density} + 1;
+    parameters_.size = static_cast<std::size_t>(bits / 8);
+    SPINALTAP_LOG_DEBUG("flash of {} bytes, sector erase {:#04x}",
+                        parameters_.size, parameters_.sector_erase_opcode);
+    return parameters_;
+  }
+  throw std::runtime_error("SFDP has no basic parameter table");
+}
+
+uint8_t flash::status() {
+  const std::array<uint8_t, 1> tx{read_status};
+  std::array<uint8_t, 1> rx{};
+  const message m{{tx, {}, ss_action::assert},
+                  {{}, rx, ss_action::deassert}};
+  master_.execute(m);
+  return rx[0];
+}
+
+void flash::wait_ready(std::chrono::milliseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while ((status() & status_wip) != 0) {
+    if (std::chrono::steady_clock::now() > deadline)
+      throw std::runtime_error("timeout waiting for flash to finish");
+    std::this_thread::sleep_for(poll_interval);
+  }
+  pending_ = false;
+}
+
+void flash::read(uint32_t address, gsl::span<uint8_t> out) {
+  check_range(address, out.size());
+  if (pending_)
+    wait_ready();
+
+  for (std::size_t offset = 0; offset < out.size(); offset += read_size) {
+    const auto n = std::min(read_size, out.size() - offset);
+    const auto tx = command_dummy(
+        fast_read, static_cast<uint32_t>(address + offset));
+    const message m{{tx, {}, ss_action::assert},
+                    {{}, out.subspan(offset, n), ss_action::deassert}};
+    master_.execute(m);
+  }
+}
+
+void flash::erase_sector(uint32_t address) {
+  check_range(address, 1);
+  const auto tx = command(parameters_.sector_erase_opcode, address);
+  const std::array<segment, 1> m{segment{tx, {}, ss_action::both}};
+  modify(m);
+}
+
+void flash::program_page(uint32_t address, gsl::span<const uint8_t> data) {
+  check_range(address, data.size());
+  if (address % page_size + data.size() > page_size)
+    throw std::runtime_error("data crosses a flash page");
+
+  const auto tx = command(page_program, address);
+  const std::array<segment, 2> m{segment{tx, {}, ss_action::assert},
+                                 segment{data, {}, ss_action::deassert}};
+  modify(m);
+}
+
+void flash::modify(gsl::span<const segment> command) {
+  if (pending_)
+    wait_ready();
+
+  const std::array<uint8_t, 1> wren{write_enable};
+  const std::array<uint8_t, 1> rdsr{read_status};
+  std::array<uint8_t, 1> status{};
+  message m{{wren, {}, ss_action::both}};
+  m.insert(m.end(), command.begin(), command.end());
+  m.push_back({rdsr, {}, ss_action::assert});
+  m.push_back({{}, status, ss_action::deassert});
+  master_.execute(m);
+
+  pending_ = (status[0] & status_wip) != 0;
+  // write enable is cleared when the command is taken
+  if (!pending_ && (status[0] & status_wel) != 0)
+    throw std::runtime_error("flash did not accept the command");
+}
+
+void flash::check_range(uint32_t address, std::size_t size) const {
+  const auto limit =
+      parameters_.size != 0 ? std::min(parameters_.size, address_space)
+                            : address_space;
+  if (address > limit || size > limit - address)
+    throw std::runtime_error("flash address out of range");
+}
+
+flash_stats flash::write(uint32_t address, gsl::span<const uint8_t> data,
+                         const progress_handler &progress) {
+  check_range(address, data.size());
+  const auto start = std::chrono::steady_clock::now();
+  flash_stats stats;
+  stats.bytes = data.size();
+  if (data.empty())
+    return stats;
+
+  // whole sectors are read back in bulk, the parts outside of data are
+  // kept if a sector has to be erased
+  const std::size_t first = address - address % sector_size;
+  const std::size_t end = address + data.size();
+  const std::size_t last = (end + sector_size - 1) / sector_size * sector_size;
+  std::vector<uint8_t> current(last - first);
+  read(static_cast<uint32_t>(first), current);
+  std::vector<uint8_t> wanted = current;
+  std::copy(data.begin(), data.end(),
+            wanted.begin() + static_cast<std::ptrdiff_t>(address - first));
+
+  for (std::size_t offset = 0; offset < wanted.size(); offset += sector_size) {
+    const auto have = gsl::span(current).subspan(offset, sector_size);
+    const auto want = gsl::span(wanted).subspan(offset, sector_size);
+    // programming only clears bits
+    const bool erase = !std::equal(
+        want.begin(), want.end(), have.begin(),
+        [](uint8_t w, uint8_t h) { return (h & w) == w; });
+    if (erase) {
+      erase_sector(static_cast<uint32_t>(first + offset));
+      stats.sectors_erased++;
+    }
+
+    for (std::size_t page = 0; page < sector_size; page += page_size) {
+      const auto p = want.subspan(page, page_size);
+      const bool skip =
+          erase ? std::all_of(p.begin(), p.end(),
+                              [](uint8_t b) { return b == 0xff; })
+                : std::equal(p.begin(), p.end(), have.begin() + page);
+      if (skip) {
+        stats.pages_skipped++;
+        continue;
+      }
+      program_page(static_cast<uint32_t>(first + offset + page), p);
+      stats.pages_programmed++;
+    }
+
+    if (progress) {
+      progress({offset + sector_size, wanted.size(),
+                std::chrono::steady_clock::now() - start});
+    }
+  }
+
+  if (!verify(address, data))
+    throw std::runtime_error("flash verification failed");
+  stats.elapsed = std::chrono::steady_clock::now() - start;
+  SPINALTAP_LOG_INFO("flash write of {} bytes at {:.0f} bytes/s, {} sectors "
+                     "erased, {} pages programmed, {} skipped",
+                     stats.bytes, stats.rate(), stats.sectors_erased,
+                     stats.pages_programmed, stats.pages_skipped);
+  return stats;
+}
+
+bool flash::verify(uint32_t address, gsl::span<const uint8_t> data) {
+  std::vector<uint8_t> actual(data.size());
+  read(address, actual);
+  return std::equal(data.begin(), data.end(), actual.begin());
+}
+
+} // namespace spinaltap::spi
@@ -1,143 +1,1134 @@
 #include "spinaltap.hpp"
 #include "spinaltap/logging.hpp"
+#include "spinaltap/metrics.hpp"
+#include "spinaltap/protocol.hpp"
+#include "spinaltap/trace.hpp"
+#include "spinaltap/transport.hpp"
 #include "spinaltap/util.hpp"
 
 #include "libusb++/libusb++.hpp"
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <optional>
 #include <thread>
+#include <utility>
 
 namespace spinaltap {
-uint8_t ctr = 0;
-void make_write(gsl::span<uint8_t, 8> dest, uint32_t address, uint32_t value) {
-  if (address >= std::numeric_limits<uint16_t>::max())
-    throw std::logic_error("impossible register address");
+namespace {
+constexpr std::size_t max_free_buffers = 4;
 
-  dest[0] = ctr++;
-  dest[1] = static_cast<uint8_t>(cmd::write);
-  endian::store(static_cast<uint16_t>(address), dest.subspan<2, 2>());
-  endian::store(value, dest.subspan<4, 4>());
+struct joined {
+  std::size_t remaining;
+  std::exception_ptr error;
+  device::handler done;
+};
+
+// handler to be called count times, calls done with the first error
+// once all calls happened
+device::handler join(std::size_t count, device::handler done) {
+  auto st = std::make_shared<joined>(joined{count, nullptr, std::move(done)});
+  return [st](std::exception_ptr error) {
+    if (error && !st->error)
+      st->error = error;
+    if (--st->remaining == 0)
+      st->done(st->error);
+  };
 }
 
-device::device(usb::out_endpoint &out_ep, usb::in_endpoint &in_ep)
-    : out_ep_(out_ep), in_ep_(in_ep) {}
-// TODO make address 16bit?
-uint32_t device::readRegister(uint32_t address) {
-  logging::logger->debug("reading @{:04x}", address);
-  if (address >= std::numeric_limits<uint16_t>::max())
-    throw std::logic_error("impossible register address");
+// number of commands needed for a stream of length elements
+std::size_t chunk_count(std::size_t length) {
+  return std::max<std::size_t>(
+      1, (length + protocol::max_stream_length - 1) /
+             protocol::max_stream_length);
+}
+} // namespace
 
-  std::array<uint8_t, 4> msg;
-  msg[0] = ctr++;
-  msg[1] = static_cast<uint8_t>(cmd::read);
-  endian::store(static_cast<uint16_t>(address), gsl::span(msg).subspan<2, 2>());
-  out_ep_.bulk_write_all(msg);
+using protocol::reply_header_size;
+static_assert(stream_buffer::header_room == protocol::stream_header_size);
 
-  std::array<uint8_t, 6> reply;
-  in_ep_.bulk_read_all(reply, std::chrono::milliseconds(500));
-  auto result = endian::load<uint32_t>(gsl::span(reply).subspan<2, 4>());
+struct device::request {
+  uint8_t sequence;
+  std::size_t reply_size;
+  std::size_t received{0};
+  std::array<uint8_t, reply_header_size> header;
+  // inline storage for replies of register commands
+  std::array<uint8_t, 4> value;
+  gsl::span<uint8_t> sink;
+  // time the device needs to process the command on top of the usual timeout
+  std::chrono::milliseconds device_time{0};
+  std::chrono::steady_clock::time_point submitted;
+  std::function<void(request &, std::exception_ptr)> done;
+  // what the command does, only used for tracing
+  uint8_t opcode{0};
+  uint16_t address{0};
+  uint32_t length{0};
 
-  logging::logger->debug("read @{:04x}={:04x}", address, result);
-  return result;
+  void describe(gsl::span<const uint8_t> command) noexcept {
+    opcode = command[1];
+    address = static_cast<uint16_t>(command[2] | (command[3] << 8));
+    switch (static_cast<cmd>(opcode)) {
+    case cmd::writeStream8:
+    case cmd::readStream8:
+    case cmd::readStream32:
+      length = command[4] | (command[5] << 8);
+      break;
+    default:
+      length = 4;
+    }
+  }
+  // cached register to update from the reply, which holds the old value
+  // of the register. The new one is (old & ~mask) | (value & mask).
+  struct shadow_fill {
+    uint32_t address;
+    uint64_t generation;
+    uint32_t mask;
+    uint32_t value;
+  };
+  std::optional<shadow_fill> fill;
+};
+
+// ownership of the device, see device::post
+class device::io_lock {
+public:
+  io_lock() = default;
+  explicit io_lock(device &dev) : dev_(&dev) {
+    dev.io_mutex_.lock();
+    dev.acquired();
+  }
+  io_lock(device &dev, std::try_to_lock_t)
+      : dev_(dev.io_mutex_.try_lock() ? &dev : nullptr) {
+    if (dev_)
+      dev.acquired();
+  }
+  io_lock(io_lock &&other) noexcept
+      : dev_(std::exchange(other.dev_, nullptr)) {}
+  io_lock &operator=(io_lock &&) = delete;
+  ~io_lock() {
+    if (dev_)
+      dev_->release();
+  }
+
+  explicit operator bool() const noexcept { return dev_ != nullptr; }
+
+private:
+  device *dev_{nullptr};
+};
+
+// returns the device if it is free, queues the submission created by
+// make_submission otherwise. Creating it lazily keeps the common case of an
+// idle device free of allocations.
+template <typename Fn>
+device::io_lock device::try_own(Fn &&make_submission) {
+  io_lock io{*this, std::try_to_lock};
+  if (io)
+    return io;
+  submissions_.push(make_submission());
+  // the owner might have released the device before it saw fn, whoever
+  // gets the device next runs it
+  io_lock{*this, std::try_to_lock};
+  return {};
 }
-// TODO read all
-void device::readStream(uint32_t address, gsl::span<std::byte> data) {
-  if (address >= std::numeric_limits<uint16_t>::max())
-    throw std::logic_error("impossible register address");
 
-  std::array<uint8_t, 6> msg;
-  msg[0] = ctr++;
-  msg[1] = static_cast<uint8_t>(cmd::readStream8);
-  endian::store(static_cast<uint16_t>(address), gsl::span(msg).subspan<2, 2>());
-  endian::store(static_cast<uint16_t>(data.size()),
-                gsl::span(msg).subspan<4, 2>());
+void device::acquired() noexcept {
+  // submissions of other threads go first, they were made earlier
+  if (io_depth_++ == 0)
+    drain();
+}
 
-  out_ep_.bulk_write_all(msg);
+void device::release() noexcept {
+  for (;;) {
+    if (io_depth_ == 1)
+      drain();
+    const bool outermost = --io_depth_ == 0;
+    io_mutex_.unlock();
+    if (!outermost)
+      return;
+    notify_progress();
+    // a producer that failed to get the device right before the unlock
+    // relies on us to run its submission
+    if (submissions_.empty() || !io_mutex_.try_lock())
+      return;
+    io_depth_++;
+  }
+}
 
-  // do not try to optimize here by receiving into split buffers,
-  // the OS will not do any receive buffering for us, we have
-  // to read the whole packet that will be sent at once
-  std::vector<uint8_t> buffer(data.size() + 2, 0);
-  in_ep_.bulk_read_all(buffer, std::chrono::milliseconds(500));
-  util::copy(data, gsl::as_bytes(gsl::span(buffer).subspan(2)));
+void device::drain() noexcept {
+  if (submissions_.empty())
+    return;
+  draining_ = true;
+  while (auto fn = submissions_.pop()) {
+    try {
+      (*fn)();
+    } catch (...) {
+      defer_error(std::current_exception());
+    }
+  }
+  draining_ = false;
+  try {
+    flush();
+  } catch (...) {
+    defer_error(std::current_exception());
+  }
 }
 
-void device::readStream(uint32_t address, gsl::span<uint32_t> data) {
-  if (address >= std::numeric_limits<uint16_t>::max())
-    throw std::logic_error("impossile register address");
+void device::flush_now() {
+  const auto draining = std::exchange(draining_, false);
+  try {
+    flush();
+  } catch (...) {
+    draining_ = draining;
+    throw;
+  }
+  draining_ = draining;
+}
 
-  std::array<uint8_t, 6> msg;
-  msg[0] = ctr++;
-  msg[1] = static_cast<uint8_t>(cmd::readStream32);
-  endian::store(static_cast<uint16_t>(address), gsl::span(msg).subspan<2, 2>());
-  endian::store(static_cast<uint16_t>(data.size()),
-                gsl::span(msg).subspan<4, 2>());
+void device::make_progress() {
+  uint64_t epoch;
+  {
+    std::lock_guard lock{progress_mutex_};
+    epoch = progress_epoch_;
+  }
+  if (io_lock io{*this, std::try_to_lock}; io) {
+    // commands of a handler that blocks must not wait for the end of a
+    // drain that can't finish before the handler returns
+    flush_now();
+    processEvents(default_timeout);
+    return;
+  }
+  std::unique_lock lock{progress_mutex_};
+  progress_.wait_for(lock, default_timeout,
+                     [&] { return progress_epoch_ != epoch; });
+}
 
-  out_ep_.bulk_write_all(msg);
+void device::notify_progress() {
+  {
+    std::lock_guard lock{progress_mutex_};
+    progress_epoch_++;
+  }
+  progress_.notify_all();
+}
+
+void device::post(std::function<void()> fn) {
+  if (auto io = try_own([&] { return std::move(fn); }); io)
+    fn();
+}
 
-  std::vector<uint8_t> buffer(data.size_bytes() + 2, 0);
-  in_ep_.bulk_read_all(buffer, std::chrono::milliseconds(500));
-  for (int i = 0; i < data.size(); i++) {
-    data[i] = endian::load<uint32_t>(gsl::span(buffer).subspan(2 + i * 4, 4));
+void device::exclusive(const std::function<void()> &fn) {
+  // submissions of other threads are only drained when the outermost
+  // lock is released, i.e. after fn
+  io_lock io{*this};
+  fn();
+}
+
+device::device(usb::out_endpoint &out_ep, usb::in_endpoint &in_ep,
+               std::size_t max_in_flight)
+    : device(std::make_unique<usb_transport>(out_ep, in_ep), max_in_flight) {}
+
+device::device(transport &transport, std::size_t max_in_flight)
+    : transport_(transport),
+      max_in_flight_(std::max<std::size_t>(max_in_flight, 1)),
+      metrics_(std::make_unique<device_metrics>()) {
+  transport_.set_handlers(
+      [this](gsl::span<const uint8_t> data) {
+        on_receive(data);
+        post_reads();
+      },
+      [this](std::exception_ptr error) { fail_all(error); });
+}
+
+device::device(std::unique_ptr<transport> transport,
+               std::size_t max_in_flight)
+    : device(*transport, max_in_flight) {
+  owned_transport_ = std::move(transport);
+}
+
+device::~device() {
+  try {
+    sync();
+  } catch (...) {
+    // errors can't be reported anymore
   }
+  transport_.set_handlers(nullptr, nullptr);
 }
 
-void device::writeRegister(uint32_t address, uint32_t value) {
-  logging::logger->debug("write @{:04x}={:04x}", address, value);
-  std::array<uint8_t, 8> msg;
-  make_write(msg, address, value);
+device::request &device::stage_request(std::size_t reply_size) {
+  wait_for_capacity();
 
-  out_ep_.bulk_write_all(msg);
-  std::array<uint8_t, 2> reply;
-  in_ep_.bulk_read_all(reply, std::chrono::milliseconds(500));
+  auto &r = *staged_.emplace_back(std::make_unique<request>());
+  r.sequence = sequence_++;
+  r.reply_size = reply_size;
+  r.sink = gsl::span(r.value);
+  return r;
 }
 
-void device::writeStream(uint32_t address, gsl::span<const std::byte> data) {
-  logging::logger->debug("write @{:04x}={:n}", address,
-                         spdlog::to_hex(data.begin(), data.end()));
+device::request &device::stage(gsl::span<const uint8_t> command,
+                               std::size_t reply_size) {
+  // recorded writes go first to keep the order of accesses
+  if (!dirty_.empty())
+    stage_dirty();
+
+  auto &r = stage_request(reply_size);
+  const auto offset = staging_.size();
+  staging_.insert(staging_.end(), command.begin(), command.end());
+  staging_[offset] = r.sequence;
+  r.describe(command);
+  snoop(r, command);
+  return r;
+}
+
+void device::enqueue(gsl::span<const uint8_t> command, gsl::span<uint8_t> reply,
+                     handler done, std::chrono::milliseconds device_time) {
+  io_lock io{*this};
+  auto &r = stage(command, reply_header_size + reply.size());
+  r.sink = reply;
+  r.device_time = device_time;
+  r.done = [done = std::move(done)](request &, std::exception_ptr error) {
+    done(error);
+  };
+}
+
+void device::wait_for_capacity() {
+  // commands that are staged together are always sent together,
+  // only wait for commands that are already on their way
+  while (!pending_.empty() &&
+         pending_.size() + staged_.size() >= max_in_flight_)
+    processEvents(default_timeout);
+}
 
-  std::vector<uint8_t> msg(6 + data.size());
-  msg[0] = ctr++;
-  msg[1] = static_cast<uint8_t>(cmd::writeStream8);
-  endian::store(static_cast<uint16_t>(address),
-                gsl::span<uint8_t, 2>(&msg[2], 2));
-  endian::store(static_cast<uint16_t>(data.size()),
-                gsl::span<uint8_t, 2>(&msg[4], 2));
-  std::memcpy(&msg[6], data.data(), data.size());
+void device::flush() {
+  io_lock io{*this};
+  if (staged_.empty() || (draining_ && staged_.size() < max_in_flight_))
+    return;
 
-  out_ep_.bulk_write_all(msg);
-  gsl::span<uint8_t> rx_buffer{msg.data(), 2};
-  in_ep_.bulk_read_all(rx_buffer, std::chrono::milliseconds(500));
+  while (!transport_.can_send()) {
+    processEvents(default_timeout);
+    // everything staged fails with errors while waiting
+    if (staged_.empty())
+      return;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  if (pending_.empty())
+    last_progress_ = now;
+  for (auto &r : staged_) {
+    r->submitted = now;
+    metrics_->count_command(r->opcode);
+    trace(*r, trace_event::submit);
+  }
+  metrics_->transfers.fetch_add(1, std::memory_order_relaxed);
+  metrics_->bytes_sent.fetch_add(staging_.size(), std::memory_order_relaxed);
+  std::move(staged_.begin(), staged_.end(), std::back_inserter(pending_));
+  staged_.clear();
+  metrics_->set_in_flight(pending_.size());
+
+  try {
+    // the staging buffer is handed over to the transport, the buffer
+    // returned is reused as the next staging buffer
+    transport_.send(staging_);
+  } catch (...) {
+    fail_all(std::current_exception());
+    throw;
+  }
+  post_reads();
+}
+
+void device::post_reads() {
+  if (!pending_.empty())
+    transport_.receive();
+}
+
+void device::on_receive(gsl::span<const uint8_t> data) {
+  metrics_->bytes_received.fetch_add(data.size(), std::memory_order_relaxed);
+  while (!data.empty()) {
+    if (pending_.empty()) {
+      SPINALTAP_LOG_WARN("dropping {} bytes of unexpected data", data.size());
+      return;
+    }
+
+    auto &r = *pending_.front();
+    std::size_t n;
+    if (r.received < reply_header_size) {
+      n = std::min(reply_header_size - r.received, data.size());
+      std::memcpy(r.header.data() + r.received, data.data(), n);
+    } else {
+      n = std::min(r.reply_size - r.received, data.size());
+      std::memcpy(r.sink.data() + (r.received - reply_header_size),
+                  data.data(), n);
+    }
+    r.received += n;
+    data = data.subspan(n);
+    last_progress_ = std::chrono::steady_clock::now();
+
+    if (r.received == r.reply_size) {
+      auto done = std::move(pending_.front());
+      pending_.pop_front();
+      metrics_->set_in_flight(pending_.size());
+      if (done->header[0] != done->sequence) {
+        SPINALTAP_LOG_ERROR("reply sequence mismatch: expected {} got {}",
+                            done->sequence, done->header[0]);
+        auto error = std::make_exception_ptr(
+            std::runtime_error("reply sequence mismatch"));
+        trace(*done, trace_event::error);
+        done->done(*done, error);
+        fail_all(error);
+        return;
+      }
+      if (done->fill)
+        update_shadow(*done);
+      metrics_->record_latency(done->opcode,
+                               last_progress_ - done->submitted);
+      trace(*done, trace_event::complete);
+      done->done(*done, nullptr);
+    }
+  }
+}
+
+void device::fail_all(std::exception_ptr error) {
+  auto pending = std::move(pending_);
+  auto staged = std::move(staged_);
+  pending_.clear();
+  staged_.clear();
+  staging_.clear();
+  // replies still in transit would be matched against the wrong requests
+  transport_.cancel_receive();
+  // it is unknown which of the writes reached the device, recorded
+  // writes are still sent later
+  for (auto &[address, reg] : shadow_) {
+    if (!reg.dirty) {
+      reg.valid = false;
+      reg.generation++;
+    }
+  }
+
+  metrics_->failures.fetch_add(pending.size() + staged.size(),
+                              std::memory_order_relaxed);
+  metrics_->set_in_flight(0);
+  for (auto &r : pending) {
+    trace(*r, trace_event::error);
+    r->done(*r, error);
+  }
+  for (auto &r : staged)
+    r->done(*r, error);
+}
+
+void device::rethrow_deferred() {
+  std::exception_ptr error;
+  {
+    std::lock_guard lock{error_mutex_};
+    error = std::exchange(deferred_error_, nullptr);
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void device::defer_error(std::exception_ptr error) noexcept {
+  std::lock_guard lock{error_mutex_};
+  if (error && !deferred_error_)
+    deferred_error_ = error;
+}
+
+void device::processEvents(std::chrono::milliseconds timeout) {
+  io_lock io{*this};
+  auto wait = std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+  if (!pending_.empty()) {
+    // a request times out if no reply data arrived for too long,
+    // independent of how long it waited behind other requests
+    const auto now = std::chrono::steady_clock::now();
+    const auto deadline =
+        last_progress_ + default_timeout + pending_.front()->device_time;
+    if (now >= deadline) {
+      metrics_->timeouts.fetch_add(1, std::memory_order_relaxed);
+      fail_all(std::make_exception_ptr(usb::usb_error(usb::errors::TIMEOUT)));
+      notify_progress();
+      return;
+    }
+    wait = std::min(wait, std::chrono::duration_cast<std::chrono::microseconds>(
+                              deadline - now));
+  }
+  try {
+    transport_.process_events(wait);
+  } catch (...) {
+    // make sure no request outlives the blocking call that waits for it
+    fail_all(std::current_exception());
+    notify_progress();
+    throw;
+  }
+  // handlers may have completed requests of threads waiting for the owner
+  notify_progress();
+}
+
+void device::sync() {
+  io_lock io{*this};
+  stage_dirty();
+  flush_now();
+  while (!pending_.empty())
+    processEvents(default_timeout);
+  rethrow_deferred();
+}
+
+std::size_t device::inFlight() const {
+  std::lock_guard lock{io_mutex_};
+  return pending_.size() + staged_.size();
+}
+
+void device::readRegisterAsync(uint32_t address, read_handler done) {
+  const auto io = try_own([&] {
+    return [this, address, done = std::move(done)]() mutable {
+      readRegisterAsync(address, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  if (auto reg = shadowed(address); reg && reg->valid) {
+    done(nullptr, reg->value);
+    return;
+  }
+
+  auto &r = stage(protocol::encode_read(address), protocol::read_reply_size);
+  r.done = [done = std::move(done)](request &r, std::exception_ptr error) {
+    done(error, error ? 0 : endian::load<uint32_t>(r.value));
+  };
+  flush();
+}
+
+std::future<uint32_t> device::readRegisterAsync(uint32_t address) {
+  auto promise = std::make_shared<std::promise<uint32_t>>();
+  readRegisterAsync(address, [promise](std::exception_ptr error,
+                                       uint32_t value) {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value(value);
+  });
+  return promise->get_future();
+}
+
+void device::readRegistersAsync(gsl::span<const uint32_t> addresses,
+                                gsl::span<uint32_t> out, handler done) {
+  if (addresses.size() != out.size())
+    throw std::logic_error("number of addresses and values differ");
+  const auto io = try_own([&] {
+    return [this, addresses, out, done = std::move(done)]() mutable {
+      readRegistersAsync(addresses, out, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+
+  std::size_t remote = 0;
+  for (auto address : addresses) {
+    auto reg = shadowed(address);
+    if (!reg || !reg->valid)
+      remote++;
+  }
+  if (remote == 0) {
+    for (std::size_t i = 0; i < addresses.size(); i++)
+      out[i] = shadowed(addresses[i])->value;
+    done(nullptr);
+    return;
+  }
+
+  // stage all reads before flushing so they share a single transfer
+  auto read_done = join(remote, std::move(done));
+  for (std::size_t i = 0; i < addresses.size(); i++) {
+    if (auto reg = shadowed(addresses[i]); reg && reg->valid) {
+      out[i] = reg->value;
+      continue;
+    }
+    auto &r = stage(protocol::encode_read(addresses[i]),
+                    protocol::read_reply_size);
+    r.done = [read_done, &value = out[i]](request &r,
+                                          std::exception_ptr error) {
+      if (!error)
+        value = endian::load<uint32_t>(r.value);
+      read_done(error);
+    };
+  }
+  flush();
+}
+
+void device::writeRegisterAsync(uint32_t address, uint32_t value,
+                                handler done) {
+  const auto io = try_own([&] {
+    return [this, address, value, done = std::move(done)]() mutable {
+      writeRegisterAsync(address, value, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  enqueue(protocol::encode_write(address, value), {}, std::move(done));
+  flush();
+}
+
+std::future<void> device::writeRegisterAsync(uint32_t address,
+                                             uint32_t value) {
+  auto promise = std::make_shared<std::promise<void>>();
+  writeRegisterAsync(address, value, [promise](std::exception_ptr error) {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value();
+  });
+  return promise->get_future();
+}
+
+void device::readModifyWriteAsync(uint32_t address, uint32_t mask,
+                                  uint32_t value, read_handler done) {
+  const auto io = try_own([&] {
+    return [this, address, mask, value, done = std::move(done)]() mutable {
+      readModifyWriteAsync(address, mask, value, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  auto &r = stage(protocol::encode_read_modify_write(address, mask, value),
+                  protocol::read_modify_write_reply_size);
+  r.done = [done = std::move(done)](request &r, std::exception_ptr error) {
+    done(error, error ? 0 : endian::load<uint32_t>(r.value));
+  };
+  flush();
+}
+
+void device::readStreamAsync(uint32_t address, gsl::span<std::byte> data,
+                             handler done) {
+  const auto io = try_own([&] {
+    return [this, address, data, done = std::move(done)]() mutable {
+      readStreamAsync(address, data, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  const auto chunks = chunk_count(data.size());
+  auto chunk_done = join(chunks, std::move(done));
+  for (std::size_t i = 0; i < chunks; i++) {
+    const auto offset = i * protocol::max_stream_length;
+    auto chunk = data.subspan(
+        offset, std::min(protocol::max_stream_length, data.size() - offset));
+    enqueue(protocol::encode_stream(cmd::readStream8, address, chunk.size()),
+            gsl::span(reinterpret_cast<uint8_t *>(chunk.data()), chunk.size()),
+            chunk_done);
+    // send every chunk right away, the next one is prepared while the
+    // previous ones are transferred
+    flush();
+  }
+}
+
+void device::writeStreamAsync(uint32_t address,
+                              gsl::span<const std::byte> data, handler done) {
+  const auto io = try_own([&] {
+    return [this, address, data, done = std::move(done)]() mutable {
+      writeStreamAsync(address, data, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  SPINALTAP_LOG_DEBUG("write @{:04x} {} bytes", address, data.size());
+  const auto chunks = chunk_count(data.size());
+  auto chunk_done = join(chunks, std::move(done));
+  for (std::size_t i = 0; i < chunks; i++) {
+    const auto offset = i * protocol::max_stream_length;
+    auto chunk = data.subspan(
+        offset, std::min(protocol::max_stream_length, data.size() - offset));
+    auto &r = stage(
+        protocol::encode_stream(cmd::writeStream8, address, chunk.size()),
+        reply_header_size);
+    // the payload directly follows the header in the staging buffer
+    const auto bytes = reinterpret_cast<const uint8_t *>(chunk.data());
+    staging_.insert(staging_.end(), bytes, bytes + chunk.size());
+    r.done = [chunk_done](request &, std::exception_ptr error) {
+      chunk_done(error);
+    };
+    flush();
+  }
+}
+
+void device::writeStreamAsync(uint32_t address, stream_buffer buffer,
+                              handler done) {
+  const auto io = try_own([&] {
+    // submissions have to be copyable
+    auto shared = std::make_shared<stream_buffer>(std::move(buffer));
+    return [this, address, shared, done = std::move(done)]() mutable {
+      writeStreamAsync(address, std::move(*shared), std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  if (buffer.size() > protocol::max_stream_length) {
+    // there is only room for a single header, fall back to copying
+    writeStreamAsync(address, gsl::as_bytes(buffer.payload()),
+                     std::move(done));
+    recycle(std::move(buffer.storage_));
+    return;
+  }
+
+  SPINALTAP_LOG_DEBUG("write @{:04x} {} bytes", address, buffer.size());
+  const auto header =
+      protocol::encode_stream(cmd::writeStream8, address, buffer.size());
+  // keep the order of commands staged before
+  if (!dirty_.empty())
+    stage_dirty();
+  flush();
+
+  auto &r = stage_request(reply_header_size);
+  r.done = [done = std::move(done)](request &, std::exception_ptr error) {
+    done(error);
+  };
+  std::copy(header.begin(), header.end(), buffer.storage_.begin());
+  buffer.storage_[0] = r.sequence;
+  r.describe(header);
+  if (staging_.empty()) {
+    // send the stream buffer in place of the staging buffer and keep the
+    // old staging memory for later
+    std::swap(staging_, buffer.storage_);
+    recycle(std::move(buffer.storage_));
+  } else {
+    // a handler run while waiting for capacity staged commands already
+    staging_.insert(staging_.end(), buffer.storage_.begin(),
+                    buffer.storage_.end());
+    recycle(std::move(buffer.storage_));
+  }
+  flush();
+}
+
+stream_buffer device::allocateBuffer(std::size_t size) {
+  io_lock io{*this};
+  std::vector<uint8_t> storage;
+  if (!free_buffers_.empty()) {
+    auto largest = std::max_element(free_buffers_.begin(), free_buffers_.end(),
+                                    [](const auto &a, const auto &b) {
+                                      return a.capacity() < b.capacity();
+                                    });
+    storage = std::move(*largest);
+    free_buffers_.erase(largest);
+  }
+  return stream_buffer(std::move(storage), size);
+}
+
+void device::recycle(std::vector<uint8_t> &&buffer) {
+  if (buffer.capacity() == 0 || free_buffers_.size() >= max_free_buffers)
+    return;
+  buffer.clear();
+  free_buffers_.push_back(std::move(buffer));
+}
+
+// TODO make address 16bit?
+uint32_t device::readRegister(uint32_t address) {
+  SPINALTAP_LOG_DEBUG("reading @{:04x}", address);
+  auto result = wait(readRegisterAsync(address));
+  rethrow_deferred();
+
+  SPINALTAP_LOG_DEBUG("read @{:04x}={:04x}", address, result);
+  return result;
+}
+
+void device::readRegisters(gsl::span<const uint32_t> addresses,
+                           gsl::span<uint32_t> out) {
+  std::promise<void> promise;
+  readRegistersAsync(addresses, out, [&](std::exception_ptr error) {
+    if (error)
+      promise.set_exception(error);
+    else
+      promise.set_value();
+  });
+  wait(promise.get_future());
+  rethrow_deferred();
+}
+
+void device::readStream(uint32_t address, gsl::span<std::byte> data) {
+  std::promise<void> promise;
+  readStreamAsync(address, data, [&](std::exception_ptr error) {
+    if (error)
+      promise.set_exception(error);
+    else
+      promise.set_value();
+  });
+  wait(promise.get_future());
+  rethrow_deferred();
+}
+
+void device::readStream(uint32_t address, gsl::span<uint32_t> data) {
+  std::promise<void> promise;
+  const auto chunks = chunk_count(data.size());
+  auto chunk_done = join(chunks, [&](std::exception_ptr error) {
+    if (error)
+      promise.set_exception(error);
+    else
+      promise.set_value();
+  });
+  for (std::size_t i = 0; i < chunks; i++) {
+    const auto offset = i * protocol::max_stream_length;
+    auto chunk = data.subspan(
+        offset, std::min(protocol::max_stream_length, data.size() - offset));
+    enqueue(protocol::encode_stream(cmd::readStream32, address, chunk.size()),
+            gsl::span(reinterpret_cast<uint8_t *>(chunk.data()),
+                      chunk.size_bytes()),
+            chunk_done);
+    flush();
+  }
+  wait(promise.get_future());
+  rethrow_deferred();
+
+  // received little endian words in place, convert to host order
+  auto bytes = gsl::span(reinterpret_cast<uint8_t *>(data.data()),
+                         data.size_bytes());
+  for (std::size_t i = 0; i < data.size(); i++)
+    data[i] = endian::load<uint32_t>(bytes.subspan(i * 4, 4));
+}
+
+void device::writeRegister(uint32_t address, uint32_t value) {
+  const auto io = try_own([&] {
+    return [this, address, value] { writeRegister(address, value); };
+  });
+  if (!io)
+    return;
+  SPINALTAP_LOG_DEBUG("write @{:04x}={:04x}", address, value);
+  rethrow_deferred();
+  if (auto reg = shadowed(address); reg && caching_ == caching::write_back) {
+    reg->value = value;
+    reg->valid = true;
+    reg->generation++;
+    if (!std::exchange(reg->dirty, true))
+      dirty_.push_back(address);
+    return;
+  }
+  writeRegisterAsync(address, value,
+                     [this](std::exception_ptr error) { defer_error(error); });
+}
+
+void device::writeStream(uint32_t address, gsl::span<const std::byte> data) {
+  const auto io = try_own([&] {
+    return [this, address, data] { writeStream(address, data); };
+  });
+  if (!io)
+    return;
+  rethrow_deferred();
+  writeStreamAsync(address, data,
+                   [this](std::exception_ptr error) { defer_error(error); });
+}
+
+void device::writeStream(uint32_t address, stream_buffer buffer) {
+  const auto io = try_own([&] {
+    auto shared = std::make_shared<stream_buffer>(std::move(buffer));
+    return [this, address, shared] {
+      writeStream(address, std::move(*shared));
+    };
+  });
+  if (!io)
+    return;
+  rethrow_deferred();
+  writeStreamAsync(address, std::move(buffer),
+                   [this](std::exception_ptr error) { defer_error(error); });
 }
 
 void device::writeRegisters(
     const std::vector<std::pair<uint32_t, uint32_t>> &toWrite) {
-  // TODO: replace with uninitialized memory
-  std::vector<uint8_t> msg(toWrite.size() * 8, static_cast<uint8_t>(0));
-  for (int i = 0; i < toWrite.size(); i++) {
-    make_write(gsl::span<uint8_t, 8>(msg.data() + i * 8, 8), toWrite[i].first,
-               toWrite[i].second);
+  const auto io = try_own([&] {
+    return [this, toWrite] { writeRegisters(toWrite); };
+  });
+  if (!io)
+    return;
+  rethrow_deferred();
+  // stage all writes first so they are sent in a single transfer
+  for (const auto &[address, value] : toWrite) {
+    if (shadowed(address) && caching_ == caching::write_back)
+      writeRegister(address, value);
+    else
+      enqueue(protocol::encode_write(address, value), {},
+              [this](std::exception_ptr error) { defer_error(error); });
   }
-  out_ep_.bulk_write_all(msg);
-
-  msg.resize(toWrite.size() * 2);
-  in_ep_.bulk_read_all(msg, std::chrono::milliseconds(500));
+  flush();
 }
 
-// TODO make this a command
 void device::readModifyWrite(uint32_t address, uint32_t mask, uint32_t value) {
-  uint32_t old = readRegister(address);
-  writeRegister(address, (old & ~mask) | value);
+  const auto io = try_own([&] {
+    return [this, address, mask, value] {
+      readModifyWrite(address, mask, value);
+    };
+  });
+  if (!io)
+    return;
+  SPINALTAP_LOG_DEBUG("modify @{:04x}={:08x}/{:08x}", address, value, mask);
+  rethrow_deferred();
+  if (auto reg = shadowed(address);
+      reg && reg->valid && caching_ == caching::write_back) {
+    writeRegister(address, (reg->value & ~mask) | (value & mask));
+    return;
+  }
+  enqueue(protocol::encode_read_modify_write(address, mask, value),
+          gsl::span(discard_),
+          [this](std::exception_ptr error) { defer_error(error); });
+  flush();
+}
+
+uint32_t device::fetchModifyWrite(uint32_t address, uint32_t mask,
+                                  uint32_t value) {
+  {
+    io_lock io{*this};
+    if (auto reg = shadowed(address); reg && reg->valid) {
+      const auto old = reg->value;
+      readModifyWrite(address, mask, value);
+      return old;
+    }
+  }
+
+  std::promise<uint32_t> promise;
+  readModifyWriteAsync(address, mask, value,
+                       [&](std::exception_ptr error, uint32_t old) {
+                         if (error)
+                           promise.set_exception(error);
+                         else
+                           promise.set_value(old);
+                       });
+  auto old = wait(promise.get_future());
+  rethrow_deferred();
+  SPINALTAP_LOG_DEBUG("modify @{:04x}={:08x}/{:08x} was {:08x}", address, value,
+                      mask, old);
+  return old;
+}
+
+bool wait_condition::matches(uint32_t value) const noexcept {
+  const auto masked = value & mask;
+  switch (cond) {
+  case condition::equal:
+    return masked == expected;
+  case condition::not_equal:
+    return masked != expected;
+  case condition::greater_equal:
+    return masked >= expected;
+  }
+  return false;
+}
+
+void device::setFeatures(const features &supported) noexcept {
+  std::lock_guard lock{io_mutex_};
+  features_ = supported;
+}
+
+const features &device::supportedFeatures() const noexcept {
+  return features_;
+}
+
+void device::markConfiguration(uint32_t address) {
+  protocol::check_address(address);
+  io_lock io{*this};
+  shadow_.try_emplace(address);
+}
+
+void device::markVolatile(uint32_t address) {
+  io_lock io{*this};
+  if (auto it = shadow_.find(address); it != shadow_.end()) {
+    if (it->second.dirty) {
+      stage_dirty();
+      flush();
+    }
+    shadow_.erase(it);
+  }
+}
+
+void device::setTrace(trace_ring *ring) {
+  io_lock io{*this};
+  trace_ = ring;
+}
+
+void device::trace(const request &r, trace_event event) noexcept {
+  if (trace_ == nullptr)
+    return;
+  const auto now = std::chrono::steady_clock::now().time_since_epoch();
+  trace_->record(
+      {static_cast<uint64_t>(
+           std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()),
+       event, r.sequence, r.opcode, r.address, r.length});
+}
+
+void device::setCaching(caching mode) {
+  io_lock io{*this};
+  if (mode == caching_)
+    return;
+  if (caching_ == caching::write_back) {
+    stage_dirty();
+    flush();
+  }
+  caching_ = mode;
+  if (caching_ == caching::none)
+    invalidateCache();
+}
+
+caching device::registerCaching() const noexcept {
+  std::lock_guard lock{io_mutex_};
+  return caching_;
+}
+
+void device::invalidateCache() {
+  io_lock io{*this};
+  stage_dirty();
+  flush();
+  for (auto &[address, reg] : shadow_) {
+    reg.valid = false;
+    reg.generation++;
+  }
+}
+
+device::shadow_register *device::shadowed(uint32_t address) noexcept {
+  if (caching_ == caching::none)
+    return nullptr;
+  auto it = shadow_.find(address);
+  return it == shadow_.end() ? nullptr : &it->second;
+}
+
+// keeps the cache consistent with commands staged through any interface,
+// including transactions and enqueue()
+void device::snoop(request &r, gsl::span<const uint8_t> command) {
+  if (caching_ == caching::none || shadow_.empty() || command.size() < 4)
+    return;
+  const auto load = [&](std::size_t offset, std::size_t size) {
+    uint32_t v = 0;
+    for (std::size_t i = size; i > 0; i--)
+      v = (v << 8) | command[offset + i - 1];
+    return v;
+  };
+  const auto payload = [&](std::size_t offset) { return load(offset, 4); };
+  const auto address = load(2, 2);
+  auto it = shadow_.find(address);
+  if (it == shadow_.end())
+    return;
+  auto &reg = it->second;
+
+  switch (static_cast<cmd>(command[1])) {
+  case cmd::write:
+    reg.value = payload(4);
+    reg.valid = true;
+    reg.dirty = false;
+    reg.generation++;
+    break;
+  case cmd::read:
+    r.fill = request::shadow_fill{address, ++reg.generation, 0, 0};
+    break;
+  case cmd::readModifyWrite:
+    if (reg.valid) {
+      reg.value = (reg.value & ~payload(4)) | (payload(8) & payload(4));
+      reg.generation++;
+    } else {
+      r.fill = request::shadow_fill{address, ++reg.generation, payload(4),
+                                    payload(8)};
+    }
+    break;
+  case cmd::writeStream8:
+    reg.valid = false;
+    reg.generation++;
+    break;
+  default:
+    break;
+  }
+}
+
+void device::update_shadow(const request &r) {
+  auto it = shadow_.find(r.fill->address);
+  if (it == shadow_.end() || it->second.generation != r.fill->generation ||
+      r.sink.size() < 4)
+    return;
+  const auto old = endian::load<uint32_t>(r.sink.first(4));
+  it->second.value = (old & ~r.fill->mask) | (r.fill->value & r.fill->mask);
+  it->second.valid = true;
+}
+
+void device::stage_dirty() {
+  auto dirty = std::move(dirty_);
+  dirty_.clear();
+  for (auto address : dirty) {
+    auto it = shadow_.find(address);
+    if (it == shadow_.end() || !it->second.dirty)
+      continue;
+    enqueue(protocol::encode_write(address, it->second.value), {},
+            [this](std::exception_ptr error) { defer_error(error); });
+  }
+}
+
+void device::waitAsync(const wait_condition &condition,
+                       std::chrono::milliseconds timeout, wait_handler done) {
+  const auto io = try_own([&] {
+    return [this, condition, timeout, done = std::move(done)]() mutable {
+      waitAsync(condition, timeout, std::move(done));
+    };
+  });
+  if (!io)
+    return;
+  if (!features_.wait) {
+    emulate_wait(condition, std::chrono::steady_clock::now() + timeout,
+                 std::move(done));
+    return;
+  }
+
+  // longer waits than the command allows are chained
+  const auto chunk = std::min(timeout, protocol::max_wait_timeout);
+  auto &r = stage(protocol::encode_wait(condition, chunk),
+                  protocol::wait_reply_size);
+  r.device_time = chunk;
+  r.done = [this, condition, rest = timeout - chunk,
+            done = std::move(done)](request &r,
+                                    std::exception_ptr error) mutable {
+    const bool matched =
+        !error && condition.matches(endian::load<uint32_t>(r.value));
+    if (error || matched || rest.count() == 0)
+      done(error, matched);
+    else
+      waitAsync(condition, rest, std::move(done));
+  };
+  flush();
+}
+
+void device::emulate_wait(const wait_condition &condition,
+                          std::chrono::steady_clock::time_point deadline,
+                          wait_handler done) {
+  // every read is a round trip to the device anyhow, reissue right away
+  readRegisterAsync(condition.address, [this, condition, deadline,
+                                        done = std::move(done)](
+                                           std::exception_ptr error,
+                                           uint32_t value) mutable {
+    if (error || condition.matches(value))
+      done(error, !error);
+    else if (std::chrono::steady_clock::now() > deadline)
+      done(nullptr, false);
+    else {
+      metrics_->poll_retries.fetch_add(1, std::memory_order_relaxed);
+      emulate_wait(condition, deadline, std::move(done));
+    }
+  });
 }
 
 bool device::poll(uint32_t address, uint32_t mask, uint32_t expected,
                   std::chrono::milliseconds timeout) {
-  auto limit = std::chrono::system_clock::now() + timeout;
-  while (std::chrono::system_clock::now() <= limit) {
-    auto reg = readRegister(address);
-    if ((reg & mask) == expected)
+  return poll(wait_condition{address, mask, expected}, timeout);
+}
+
+bool device::poll(const wait_condition &condition,
+                  std::chrono::milliseconds timeout) {
+  if (features_.wait) {
+    std::promise<bool> promise;
+    waitAsync(condition, timeout, [&](std::exception_ptr error, bool matched) {
+      if (error)
+        promise.set_exception(error);
+      else
+        promise.set_value(matched);
+    });
+    auto matched = wait(promise.get_future());
+    rethrow_deferred();
+    return matched;
+  }
+
+  // start polling right away, since most conditions are met within
+  // a few round trips, only back off for longer waits
+  auto backoff = std::chrono::microseconds(0);
+  constexpr auto max_backoff = std::chrono::microseconds(5000);
+  auto limit = std::chrono::steady_clock::now() + timeout;
+  while (std::chrono::steady_clock::now() <= limit) {
+    auto reg = readRegister(condition.address);
+    if (condition.matches(reg))
       return true;
-    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    metrics_->poll_retries.fetch_add(1, std::memory_order_relaxed);
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min(max_backoff,
+                       backoff * 2 + std::chrono::microseconds(100));
   }
   return false;
 }
@@ -166,15 +1157,48 @@ enum class commands : uint8_t {
 };
 
 void load_bitstream(usb::interface &intf,
-                    const std::filesystem::path &location) {
+                    const std::filesystem::path &location,
+                    progress_handler on_progress) {
   using namespace std::chrono_literals;
+  constexpr std::size_t chunk_size = 2048;
+  constexpr std::size_t read_ahead = 32 * chunk_size;
+
+  bitstream_reader reader{location};
+  SPINALTAP_LOG_DEBUG("loading {} ({} bytes, {} bitorder)", location.string(),
+                      reader.size(), reader.flipped() ? "serial" : "parallel");
+
   intf.control_write(usb::type::vendor, usb::recipient::device,
                      static_cast<uint8_t>(commands::start_configuration), 0, 0,
                      {}, 1500ms);
-  uint8_t bytes[] = {0x11, 0x22, 0x33, 0x44};
-  intf.control_write(usb::type::vendor, usb::recipient::device,
-                     static_cast<uint8_t>(commands::write_configuration_chunk),
-                     0, 0, gsl::span<uint8_t>(bytes), 1500ms);
+
+  // read the next part of the file while the current one is sent
+  const auto start = std::chrono::steady_clock::now();
+  std::uintmax_t done = 0;
+  std::vector<char> current(read_ahead);
+  std::vector<char> next(read_ahead);
+  current.resize(reader.read(current));
+  while (!current.empty()) {
+    auto pending = std::async(std::launch::async, [&] {
+      next.resize(read_ahead);
+      next.resize(reader.read(next));
+    });
+    for (std::size_t offset = 0; offset < current.size();
+         offset += chunk_size) {
+      const auto n = std::min(chunk_size, current.size() - offset);
+      intf.control_write(
+          usb::type::vendor, usb::recipient::device,
+          static_cast<uint8_t>(commands::write_configuration_chunk), 0, 0,
+          gsl::span(reinterpret_cast<uint8_t *>(current.data() + offset), n),
+          1500ms);
+      done += n;
+      if (on_progress)
+        on_progress(
+            {done, reader.size(), std::chrono::steady_clock::now() - start});
+    }
+    pending.get();
+    std::swap(current, next);
+  }
+
   intf.control_write(usb::type::vendor, usb::recipient::device,
                      static_cast<uint8_t>(commands::finish_configuration), 0, 0,
                      {}, 1500ms);
@@ -182,7 +1206,12 @@ void load_bitstream(usb::interface &intf,
   intf.control_read(usb::type::vendor, usb::recipient::device,
                     static_cast<uint8_t>(commands::get_configuration_state), 0,
                     0, response, 1500ms);
-  fmt::print("read: {}", response[0]);
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  SPINALTAP_LOG_INFO("loaded {} bytes in {:.3f} s ({:.2f} MB/s), state {}",
+                     done, elapsed.count(),
+                     static_cast<double>(done) / elapsed.count() / 1e6,
+                     response[0]);
 }
 } // namespace control
 } // namespace spinaltap
@@ -0,0 +1,237 @@
+#include "spinaltap/trace.hpp"
+#include "spinaltap/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+
+namespace spinaltap {
+
+namespace {
+
+constexpr std::array<char, 8> trace_magic{'S', 'T', 'T', 'R',
+                                          'A', 'C', 'E', '1'};
+constexpr std::size_t record_size = 16;
+
+std::array<uint64_t, 2> pack(const trace_record &r) noexcept {
+  return {r.timestamp,
+          (r.length & 0xffffffu) |
+              (static_cast<uint64_t>(r.event) << 24) |
+              (static_cast<uint64_t>(r.sequence) << 32) |
+              (static_cast<uint64_t>(r.opcode) << 40) |
+              (static_cast<uint64_t>(r.address) << 48)};
+}
+
+trace_record unpack(uint64_t timestamp, uint64_t word) noexcept {
+  return {timestamp,
+          static_cast<trace_event>((word >> 24) & 0xff),
+          static_cast<uint8_t>(word >> 32),
+          static_cast<uint8_t>(word >> 40),
+          static_cast<uint16_t>(word >> 48),
+          static_cast<uint32_t>(word & 0xffffff)};
+}
+
+void store64(uint64_t v, uint8_t *out) noexcept {
+  for (int i = 0; i < 8; i++)
+    out[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+uint64_t load64(const uint8_t *in) noexcept {
+  uint64_t v{0};
+  for (int i = 0; i < 8; i++)
+    v |= static_cast<uint64_t>(in[i]) << (8 * i);
+  return v;
+}
+
+const char *event_name(trace_event event) {
+  switch (event) {
+  case trace_event::submit:
+    return "submit";
+  case trace_event::complete:
+    return "complete";
+  case trace_event::error:
+    return "error";
+  case trace_event::lost:
+    return "lost";
+  }
+  return "unknown";
+}
+
+} // namespace
+
+trace_ring::trace_ring(std::size_t capacity) {
+  std::size_t size{1};
+  while (size < capacity)
+    size <<= 1;
+  mask_ = size - 1;
+  slots_ = std::make_unique<slot[]>(size);
+}
+
+void trace_ring::record(const trace_record &r) noexcept {
+  const auto index = head_.fetch_add(1, std::memory_order_relaxed);
+  auto &s = slots_[index & mask_];
+  const auto words = pack(r);
+  s.sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.words[0].store(words[0], std::memory_order_relaxed);
+  s.words[1].store(words[1], std::memory_order_relaxed);
+  s.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+std::size_t trace_ring::read(uint64_t &cursor,
+                             std::vector<trace_record> &out) const {
+  std::size_t lost{0};
+  const auto head = head_.load(std::memory_order_acquire);
+  if (head - cursor > capacity()) {
+    lost += head - cursor - capacity();
+    cursor = head - capacity();
+  }
+  for (; cursor != head; cursor++) {
+    const auto &s = slots_[cursor & mask_];
+    const auto before = s.sequence.load(std::memory_order_acquire);
+    const auto timestamp = s.words[0].load(std::memory_order_relaxed);
+    const auto word = s.words[1].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const auto after = s.sequence.load(std::memory_order_relaxed);
+    const auto expected = 2 * cursor + 2;
+    if (before == expected && after == expected) {
+      out.push_back(unpack(timestamp, word));
+    } else if (before < expected) {
+      // still being written, picked up by the next read
+      break;
+    } else {
+      lost++;
+    }
+  }
+  return lost;
+}
+
+trace_writer::trace_writer(const trace_ring &ring,
+                           const std::filesystem::path &file,
+                           std::chrono::milliseconds interval)
+    : ring_(ring), out_(file, std::ios::binary | std::ios::trunc),
+      interval_(interval) {
+  if (!out_)
+    throw std::runtime_error("can't open trace file " + file.string());
+  // only records made from now on are written
+  cursor_ = ring.recorded();
+  write_trace_header(out_);
+  thread_ = std::thread([this] { run(); });
+}
+
+trace_writer::~trace_writer() {
+  {
+    std::lock_guard lock{mutex_};
+    stop_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+  write_pending();
+  out_.flush();
+}
+
+void trace_writer::run() {
+  std::unique_lock lock{mutex_};
+  while (!stop_) {
+    wakeup_.wait_for(lock, interval_, [this] { return stop_; });
+    lock.unlock();
+    write_pending();
+    lock.lock();
+  }
+}
+
+void trace_writer::write_pending() {
+  buffer_.clear();
+  const auto lost = ring_.read(cursor_, buffer_);
+  if (lost != 0) {
+    lost_ += lost;
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    const trace_record marker{
+        static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now)
+                .count()),
+        trace_event::lost,
+        0,
+        0,
+        0,
+        static_cast<uint32_t>(std::min<std::size_t>(lost, 0xffffff))};
+    write_trace(out_, gsl::span(&marker, 1));
+  }
+  write_trace(out_, buffer_);
+}
+
+void write_trace_header(std::ostream &out) {
+  out.write(trace_magic.data(), trace_magic.size());
+}
+
+void write_trace(std::ostream &out, gsl::span<const trace_record> records) {
+  std::vector<uint8_t> bytes(records.size() * record_size);
+  auto p = bytes.data();
+  for (const auto &r : records) {
+    const auto words = pack(r);
+    store64(words[0], p);
+    store64(words[1], p + 8);
+    p += record_size;
+  }
+  out.write(reinterpret_cast<const char *>(bytes.data()),
+            static_cast<std::streamsize>(bytes.size()));
+}
+
+std::vector<trace_record> read_trace(std::istream &in) {
+  std::array<char, trace_magic.size()> magic{};
+  if (!in.read(magic.data(), magic.size()) || magic != trace_magic)
+    throw std::runtime_error("not a spinaltap trace");
+
+  std::vector<trace_record> records;
+  std::array<uint8_t, record_size> raw;
+  while (in.read(reinterpret_cast<char *>(raw.data()), raw.size()))
+    records.push_back(unpack(load64(raw.data()), load64(raw.data() + 8)));
+  if (in.gcount() != 0)
+    throw std::runtime_error("truncated spinaltap trace");
+  return records;
+}
+
+void print_trace(std::ostream &out, gsl::span<const trace_record> records) {
+  if (records.empty())
+    return;
+  const auto start = records[0].timestamp;
+  const auto flags = out.flags();
+  const auto fill = out.fill();
+  // sequence numbers wrap around, only the latest submission is kept
+  std::map<uint8_t, uint64_t> submitted;
+  for (const auto &r : records) {
+    out << std::dec << std::fixed << std::setprecision(3) << std::setfill(' ')
+        << std::setw(14)
+        << static_cast<double>(static_cast<int64_t>(r.timestamp - start)) /
+               1e3
+        << "us ";
+    if (r.event == trace_event::lost) {
+      out << r.length << " records lost\n";
+      submitted.clear();
+      continue;
+    }
+    out << std::setw(8) << event_name(r.event) << " #" << std::setw(3)
+        << static_cast<int>(r.sequence) << ' ' << protocol::command_name(r.opcode)
+        << " @" << std::hex << std::setfill('0') << std::setw(4) << r.address
+        << std::dec << std::setfill(' ') << ' ' << r.length << " bytes";
+    if (r.event == trace_event::submit) {
+      submitted[r.sequence] = r.timestamp;
+    } else {
+      const auto it = submitted.find(r.sequence);
+      if (it != submitted.end()) {
+        out << " after "
+            << static_cast<double>(r.timestamp - it->second) / 1e3 << "us";
+        submitted.erase(it);
+      }
+    }
+    out << '\n';
+  }
+  out.flags(flags);
+  out.fill(fill);
+}
+
+} // namespace spinaltap
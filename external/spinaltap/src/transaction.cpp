@@ -0,0 +1,234 @@
+#include "spinaltap/transaction.hpp"
+#include "spinaltap/protocol.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+namespace spinaltap {
+
+namespace {
+gsl::span<uint8_t> as_reply(uint32_t &value) {
+  return {reinterpret_cast<uint8_t *>(&value), sizeof(value)};
+}
+
+gsl::span<uint8_t> as_reply(gsl::span<uint32_t> data) {
+  return {reinterpret_cast<uint8_t *>(data.data()), data.size_bytes()};
+}
+
+// streams longer than the length field allows are split into chunks
+template <typename T, typename F>
+void for_each_chunk(gsl::span<T> data, F &&f) {
+  std::size_t offset = 0;
+  do {
+    const auto n = std::min(protocol::max_stream_length, data.size() - offset);
+    f(data.subspan(offset, n));
+    offset += n;
+  } while (offset < data.size());
+}
+
+void to_host_order(gsl::span<uint8_t> reply) {
+  for (std::size_t offset = 0; offset + 4 <= reply.size(); offset += 4) {
+    const auto word = endian::load<uint32_t>(reply.subspan(offset, 4));
+    std::memcpy(reply.data() + offset, &word, sizeof(word));
+  }
+}
+} // namespace
+
+void transaction::add(gsl::span<const uint8_t> command,
+                      gsl::span<uint8_t> reply, std::size_t reply_size,
+                      bool words) {
+  entries_.push_back({commands_.size(), command.size(), reply, reply_size,
+                      words});
+  commands_.insert(commands_.end(), command.begin(), command.end());
+}
+
+transaction &transaction::read(uint32_t address, uint32_t &value) {
+  add(protocol::encode_read(address), as_reply(value), sizeof(value), true);
+  return *this;
+}
+
+transaction &transaction::write(uint32_t address, uint32_t value) {
+  add(protocol::encode_write(address, value), {}, 0, false);
+  return *this;
+}
+
+transaction &transaction::writeStream(uint32_t address,
+                                      gsl::span<const std::byte> data) {
+  for_each_chunk(data, [&](auto chunk) {
+    const auto header =
+        protocol::encode_stream(cmd::writeStream8, address, chunk.size());
+    entries_.push_back(
+        {commands_.size(), header.size() + chunk.size(), {}, 0, false});
+    commands_.insert(commands_.end(), header.begin(), header.end());
+    const auto bytes = reinterpret_cast<const uint8_t *>(chunk.data());
+    commands_.insert(commands_.end(), bytes, bytes + chunk.size());
+  });
+  return *this;
+}
+
+transaction &transaction::readStream(uint32_t address,
+                                     gsl::span<std::byte> data) {
+  for_each_chunk(data, [&](auto chunk) {
+    add(protocol::encode_stream(cmd::readStream8, address, chunk.size()),
+        {reinterpret_cast<uint8_t *>(chunk.data()), chunk.size()},
+        chunk.size(), false);
+  });
+  return *this;
+}
+
+transaction &transaction::readStream(uint32_t address,
+                                     gsl::span<uint32_t> data) {
+  for_each_chunk(data, [&](auto chunk) {
+    add(protocol::encode_stream(cmd::readStream32, address, chunk.size()),
+        as_reply(chunk), chunk.size_bytes(), true);
+  });
+  return *this;
+}
+
+transaction &transaction::readModifyWrite(uint32_t address, uint32_t mask,
+                                          uint32_t value) {
+  add(protocol::encode_read_modify_write(address, mask, value), {},
+      sizeof(uint32_t), false);
+  return *this;
+}
+
+transaction &transaction::readModifyWrite(uint32_t address, uint32_t mask,
+                                          uint32_t value, uint32_t &old) {
+  add(protocol::encode_read_modify_write(address, mask, value), as_reply(old),
+      sizeof(old), true);
+  return *this;
+}
+
+transaction &transaction::wait(uint32_t address, uint32_t mask,
+                               uint32_t expected,
+                               std::chrono::milliseconds timeout,
+                               condition cond) {
+  if (timeout.count() < 0)
+    throw std::logic_error("invalid wait timeout");
+  const wait_condition condition{address, mask, expected, cond};
+  // longer waits are left to device::waitAsync, which chains them
+  if (timeout <= protocol::max_wait_timeout)
+    add(protocol::encode_wait(condition, timeout), {}, sizeof(uint32_t), false);
+  else
+    add({}, {}, sizeof(uint32_t), false);
+  auto &e = entries_.back();
+  e.wait = true;
+  e.condition = condition;
+  e.timeout = timeout;
+  return *this;
+}
+
+struct transaction::state {
+  device &dev;
+  // owned copies, the transaction may be reused while this is running
+  std::vector<uint8_t> commands;
+  std::vector<entry> entries;
+  device::handler done;
+  std::size_t remaining = 0;
+  std::exception_ptr error{};
+  // replies nobody is interested in all end up here
+  std::array<uint8_t, 4> discard{};
+};
+
+static std::exception_ptr wait_timeout() {
+  return std::make_exception_ptr(
+      std::runtime_error("timeout, wait condition never met"));
+}
+
+void transaction::submit(device::handler done) {
+  if (entries_.empty()) {
+    done(nullptr);
+    return;
+  }
+
+  auto st = std::make_shared<state>(state{device_, std::move(commands_),
+                                         std::move(entries_), std::move(done)});
+  clear();
+  run(st, 0);
+}
+
+// sends the commands starting at first up to the next wait that has to
+// be emulated on the host, continuing with the rest once it finished
+void transaction::run(const std::shared_ptr<state> &st, std::size_t first) {
+  auto &entries = st->entries;
+  if (first == entries.size()) {
+    st->done(st->error);
+    return;
+  }
+
+  // waits without a command are too long to be sent in one
+  const bool emulate_waits = !st->dev.supportedFeatures().wait;
+  const auto on_host = [emulate_waits](const entry &e) {
+    return e.wait && (emulate_waits || e.size == 0);
+  };
+  if (on_host(entries[first])) {
+    const auto &e = entries[first];
+    st->dev.waitAsync(
+        e.condition, e.timeout,
+        [st, first](std::exception_ptr error, bool matched) {
+          if (!error && !matched)
+            error = wait_timeout();
+          if (error)
+            st->done(error);
+          else
+            run(st, first + 1);
+        });
+    return;
+  }
+
+  auto last = first;
+  while (last < entries.size() && !on_host(entries[last]))
+    ++last;
+
+  // other threads must not get their commands in between, or flush them
+  // together with only part of the transaction
+  st->dev.exclusive([&] {
+    st->remaining = last - first;
+    for (auto idx = first; idx < last; ++idx) {
+      auto &e = entries[idx];
+      auto reply = e.wait ? gsl::span<uint8_t>(e.last)
+                   : e.reply.empty() && e.reply_size != 0
+                       ? gsl::span<uint8_t>(st->discard).first(e.reply_size)
+                       : e.reply;
+      st->dev.enqueue(
+          gsl::span(st->commands).subspan(e.offset, e.size), reply,
+          [st, &e, reply, last](std::exception_ptr error) {
+            if (!error && e.wait &&
+                !e.condition.matches(endian::load<uint32_t>(e.last)))
+              error = wait_timeout();
+            if (error && !st->error)
+              st->error = error;
+            else if (!error && e.words)
+              to_host_order(reply);
+            if (--st->remaining != 0)
+              return;
+            if (st->error)
+              st->done(st->error);
+            else
+              run(st, last);
+          },
+          e.timeout);
+    }
+    st->dev.flush();
+  });
+}
+
+void transaction::execute() {
+  std::promise<void> promise;
+  submit([&](std::exception_ptr error) {
+    if (error)
+      promise.set_exception(error);
+    else
+      promise.set_value();
+  });
+  device_.wait(promise.get_future());
+}
+
+void transaction::clear() noexcept {
+  commands_.clear();
+  entries_.clear();
+}
+
+} // namespace spinaltap
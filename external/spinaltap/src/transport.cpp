@@ -0,0 +1,107 @@
+#include "spinaltap/transport.hpp"
+
+#include "libusb++/libusb++.hpp"
+#include "libusb++/transfer.hpp"
+
+#include <algorithm>
+
+namespace spinaltap {
+namespace {
+constexpr std::size_t in_buffer_size = 16 * 1024;
+constexpr std::size_t in_slot_count = 2;
+constexpr std::size_t out_slot_count = 4;
+constexpr std::chrono::milliseconds send_timeout{500};
+} // namespace
+
+struct usb_transport::out_slot {
+  usb::transfer transfer;
+  std::vector<uint8_t> buffer;
+};
+
+struct usb_transport::in_slot {
+  usb::transfer transfer;
+  std::vector<uint8_t> buffer = std::vector<uint8_t>(in_buffer_size);
+};
+
+usb_transport::usb_transport(usb::out_endpoint &out_ep,
+                             usb::in_endpoint &in_ep)
+    : out_ep_(out_ep), in_ep_(in_ep) {
+  for (std::size_t i = 0; i < in_slot_count; i++) {
+    auto &slot = in_slots_.emplace_back(std::make_unique<in_slot>());
+    slot->transfer.set_callback([this](usb::transfer &t) {
+      if (t.status() == usb::transfer_status::completed) {
+        if (on_receive_)
+          on_receive_(t.received());
+      } else if (t.status() != usb::transfer_status::cancelled && on_error_) {
+        on_error_(std::make_exception_ptr(
+            usb::usb_error(usb::to_error(t.status()))));
+      }
+    });
+  }
+}
+
+usb_transport::~usb_transport() {
+  for (auto &slot : out_slots_)
+    slot->transfer.set_callback(nullptr);
+  for (auto &slot : in_slots_)
+    slot->transfer.set_callback(nullptr);
+  in_slots_.clear();
+  out_slots_.clear();
+}
+
+void usb_transport::set_handlers(receive_handler on_receive,
+                                 error_handler on_error) {
+  on_receive_ = std::move(on_receive);
+  on_error_ = std::move(on_error);
+}
+
+bool usb_transport::can_send() const noexcept {
+  return out_slots_.size() < out_slot_count ||
+         std::any_of(out_slots_.begin(), out_slots_.end(), [](const auto &s) {
+           return !s->transfer.in_flight();
+         });
+}
+
+void usb_transport::send(std::vector<uint8_t> &buffer) {
+  auto slot_it =
+      std::find_if(out_slots_.begin(), out_slots_.end(),
+                   [](const auto &s) { return !s->transfer.in_flight(); });
+  out_slot *slot;
+  if (slot_it == out_slots_.end()) {
+    if (out_slots_.size() >= out_slot_count)
+      throw usb::usb_error(usb::errors::BUSY);
+    slot = out_slots_.emplace_back(std::make_unique<out_slot>()).get();
+    slot->transfer.set_callback([this](usb::transfer &t) {
+      if (t.status() != usb::transfer_status::completed && on_error_)
+        on_error_(std::make_exception_ptr(
+            usb::usb_error(usb::to_error(t.status()))));
+    });
+  } else {
+    slot = slot_it->get();
+  }
+
+  // the old transfer buffer is handed back for reuse
+  std::swap(slot->buffer, buffer);
+  buffer.clear();
+  out_ep_.async_bulk_write(slot->transfer, slot->buffer, send_timeout);
+}
+
+void usb_transport::receive() {
+  for (auto &slot : in_slots_) {
+    if (!slot->transfer.in_flight())
+      // timeouts are tracked per request, keep reads posted indefinitely
+      in_ep_.async_bulk_read(slot->transfer, slot->buffer,
+                             std::chrono::milliseconds(0));
+  }
+}
+
+void usb_transport::cancel_receive() noexcept {
+  for (auto &slot : in_slots_)
+    slot->transfer.cancel();
+}
+
+void usb_transport::process_events(std::chrono::microseconds timeout) {
+  out_ep_.owning_context().handle_events(timeout);
+}
+
+} // namespace spinaltap
@@ -4,8 +4,12 @@ source = ProtoField.uint8("spt.source", "source", base.HEX)
 opcode = ProtoField.uint8("spt.opcode", "opcode", base.HEX)
 address = ProtoField.uint16("spt.address", "address", base.HEX)
 value = ProtoField.uint32("spt.value", "value", base.HEX)
+mask = ProtoField.uint32("spt.mask", "mask", base.HEX)
+timeout = ProtoField.uint16("spt.timeout", "timeout (ms)", base.DEC)
+condition = ProtoField.uint8("spt.condition", "condition", base.DEC)
 
-spinaltap_v1_protocol.fields = {source, opcode, address, value}
+spinaltap_v1_protocol.fields = {source, opcode, address, value, mask, timeout,
+                                condition}
 
 function spinaltap_v1_protocol.dissector(buffer, pinfo, tree)
   pinfo.cols.protocol = spinaltap_v1_protocol.name
@@ -43,6 +47,18 @@ function dissect(buffer, pinfo, tree, recurse)
     subtree:add_le(address, buffer(2, 2))
     subtree:add_le(value, buffer(4, 4))
     length = length - 8
+  elseif op == 6 then
+    subtree:add_le(address, buffer(2, 2))
+    subtree:add_le(mask, buffer(4, 4))
+    subtree:add_le(value, buffer(8, 4))
+    length = length - 12
+  elseif op == 7 then
+    subtree:add_le(address, buffer(2, 2))
+    subtree:add_le(mask, buffer(4, 4))
+    subtree:add_le(value, buffer(8, 4))
+    subtree:add_le(timeout, buffer(12, 2))
+    subtree:add_le(condition, buffer(14, 1))
+    length = length - 16
   else
     subtree:add_expert_info(PI_MALFORMED, PI_ERROR, "invalid opcode")
     return
@@ -58,6 +74,8 @@ function get_opcode_name(opcode)
 
   if opcode == 1 then opcode_name = "write"
   elseif opcode == 2 then opcode_name = "read"
+  elseif opcode == 6 then opcode_name = "readModifyWrite"
+  elseif opcode == 7 then opcode_name = "wait"
   end
 
   return opcode_name
@@ -66,6 +84,8 @@ end
 function get_opcode_length(opcode)
   if opcode == 1 then return 8
   elseif opcode == 2 then return 4
+  elseif opcode == 6 then return 12
+  elseif opcode == 7 then return 16
   end
   return 0
 end
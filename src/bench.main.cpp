@@ -0,0 +1,356 @@
+// benchmarks of the register protocol, streams, SPI and bitstream upload.
+// Runs against a board or the simulated bridge, results are printed as JSON
+// (or Prometheus text) so runs can be compared, e.g. in CI.
+//
+// With --sim durations are taken from the simulated clock of the bridge,
+// so results only change if the host side of the protocol changes.
+
+#include "clipp.h"
+#include "libusb++/device_filter.hpp"
+#include "libusb++/libusb++.hpp"
+#include "libusb++/metrics.hpp"
+#include "numeric_utils.hpp"
+#include "spinaltap.hpp"
+#include "spinaltap/bitstream.hpp"
+#include "spinaltap/sim/bridge.hpp"
+#include "spinaltap/spi/registers.hpp"
+#include "spinaltap/spi/spi.hpp"
+#include "ztexpp.hpp"
+
+#include "fmt/core.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace numeric_utils;
+
+namespace {
+
+constexpr uint16_t vendor_id = 0x1209;
+constexpr uint16_t product_id = 0x1337;
+
+// register used for register and stream benchmarks on a board
+constexpr uint32_t default_address = 0x0000;
+constexpr uint32_t default_spi_base = 0x0500;
+
+constexpr std::array<std::size_t, 5> batch_sizes{1, 4, 16, 64, 256};
+constexpr std::array<std::size_t, 4> stream_sizes{64, 1024, 16 * 1024,
+                                                  64 * 1024};
+// the largest is split into several FIFO fills
+constexpr std::array<std::size_t, 4> spi_sizes{1, 16, 64, 4096};
+
+using clock_fn = std::function<std::chrono::nanoseconds()>;
+
+std::chrono::nanoseconds host_now() {
+  return std::chrono::steady_clock::now().time_since_epoch();
+}
+
+// times a function repeatedly and collects the results
+class runner {
+public:
+  runner(clock_fn clock, std::size_t iterations, std::size_t warmup,
+         std::string only)
+      : clock_(std::move(clock)), iterations_(iterations), warmup_(warmup),
+        only_(std::move(only)) {}
+
+  // bytes moved per call, 0 if throughput is not meaningful
+  void run(const std::string &name, std::size_t size, std::size_t bytes,
+           const std::function<void()> &fn) {
+    if (name.rfind(only_, 0) != 0)
+      return;
+    fmt::print(stderr, "{} {}\n", name, size);
+    for (std::size_t i = 0; i < warmup_; i++)
+      fn();
+
+    usb::histogram h;
+    for (std::size_t i = 0; i < iterations_; i++) {
+      const auto before = clock_();
+      fn();
+      h.record(clock_() - before);
+    }
+
+    const std::vector<std::pair<std::string, std::string>> labels{
+        {"benchmark", name}, {"size", std::to_string(size)}};
+    const auto snapshot = h.snapshot();
+    if (bytes != 0 && snapshot.mean() > 0) {
+      results_.gauges.push_back(
+          {{"spinaltap_bench_bytes_per_second", labels},
+           static_cast<double>(bytes) / snapshot.mean() * 1e9});
+    }
+    results_.histograms.push_back(
+        {{"spinaltap_bench_duration_seconds", labels}, snapshot});
+  }
+
+  [[nodiscard]] usb::metrics_snapshot take() { return std::move(results_); }
+
+private:
+  clock_fn clock_;
+  std::size_t iterations_;
+  std::size_t warmup_;
+  std::string only_;
+  usb::metrics_snapshot results_;
+};
+
+// loops back everything sent by a SPI master at base
+void model_spi_loopback(spinaltap::sim::bridge &bridge, uint32_t base) {
+  namespace regs = spinaltap::spi::registers;
+  auto fifo = std::make_shared<std::deque<uint8_t>>();
+  auto received = std::make_shared<std::deque<uint8_t>>();
+
+  const auto address = [base](uint32_t offset) {
+    return static_cast<uint16_t>(base + offset);
+  };
+  bridge.set(address(regs::frequency), 100'000'000);
+  bridge.set(address(regs::prescaler_width), 16);
+  bridge.set(address(regs::buffers), (255U << regs::buffers_rx_size_pos) |
+                                         (255U << regs::buffers_tx_size_pos));
+  bridge.on_write(address(regs::tx), [fifo](uint32_t value) {
+    fifo->push_back(static_cast<uint8_t>(value));
+  });
+  bridge.on_write(address(regs::trigger), [fifo, received](uint32_t value) {
+    if ((value & regs::trigger_transceive) == 0)
+      return;
+    received->insert(received->end(), fifo->begin(), fifo->end());
+    fifo->clear();
+  });
+  bridge.on_read(address(regs::rx), [received]() -> uint32_t {
+    if (received->empty())
+      return 0;
+    const auto value = received->front();
+    received->pop_front();
+    return value;
+  });
+}
+
+void bench_registers(runner &r, spinaltap::device &device, uint32_t address) {
+  r.run("register_read", 1, 4,
+        [&] { (void)device.readRegister(address); });
+  r.run("register_write", 1, 4, [&] {
+    device.writeRegister(address, 0);
+    device.sync();
+  });
+
+  for (const auto size : batch_sizes) {
+    const std::vector<std::pair<uint32_t, uint32_t>> writes(size,
+                                                            {address, 0});
+    r.run("write_registers", size, size * 4, [&] {
+      device.writeRegisters(writes);
+      device.sync();
+    });
+
+    const std::vector<uint32_t> addresses(size, address);
+    std::vector<uint32_t> values(size);
+    r.run("read_registers", size, size * 4,
+          [&] { device.readRegisters(addresses, values); });
+  }
+}
+
+void bench_streams(runner &r, spinaltap::device &device, uint32_t address) {
+  for (const auto size : stream_sizes) {
+    std::vector<std::byte> data(size);
+    r.run("stream_write", size, size, [&] {
+      device.writeStream(address, data);
+      device.sync();
+    });
+    r.run("stream_read", size, size,
+          [&] { device.readStream(address, data); });
+  }
+}
+
+void bench_spi(runner &r, spinaltap::device &device, uint32_t base) {
+  spinaltap::spi::master spi{device, base};
+  spi.configure(spinaltap::spi::cpol::idle_low,
+                spinaltap::spi::cpha::first_edge_shifts, 10e6);
+  for (const auto size : spi_sizes) {
+    std::vector<uint8_t> tx(size, 0x5a);
+    std::vector<uint8_t> rx(size);
+    r.run("spi_transceive", size, size, [&] {
+      spi.transceive(tx, rx, spinaltap::spi::ss_action::both);
+    });
+  }
+}
+
+// without a board only the host side of the upload is measured
+void bench_bitstream_read(runner &r, const std::string &bitstream) {
+  std::vector<char> chunk(64 * 1024);
+  const auto size = std::filesystem::file_size(bitstream);
+  r.run("bitstream_read", static_cast<std::size_t>(size),
+        static_cast<std::size_t>(size), [&] {
+          spinaltap::bitstream_reader reader{bitstream};
+          while (reader.read(chunk) == chunk.size())
+            ;
+        });
+}
+
+void bench_bitstream_upload(runner &r, usb::interface &intf,
+                            const std::string &bitstream) {
+  auto info = ztex::device_info(intf);
+  const auto size = std::filesystem::file_size(bitstream);
+  r.run("bitstream_upload", static_cast<std::size_t>(size),
+        static_cast<std::size_t>(size),
+        [&] { ztex::upload_bitstream(intf, info, bitstream); });
+}
+
+struct options {
+  bool sim = false;
+  std::size_t iterations = 1000;
+  std::size_t warmup = 100;
+  std::size_t bitstream_iterations = 3;
+  std::string only;
+  std::string bitstream;
+  std::string output;
+  bool prometheus = false;
+  uint32_t address = default_address;
+  uint32_t spi_base = default_spi_base;
+  spinaltap::sim::bridge::config bridge;
+};
+
+usb::metrics_snapshot run_sim(const options &opts) {
+  spinaltap::sim::bridge bridge{opts.bridge};
+  model_spi_loopback(bridge, opts.spi_base);
+  spinaltap::device device{bridge};
+  device.setFeatures({opts.bridge.wait_command});
+
+  runner r{[&bridge] { return bridge.now(); }, opts.iterations, opts.warmup,
+           opts.only};
+  bench_registers(r, device, opts.address);
+  bench_streams(r, device, opts.address);
+  bench_spi(r, device, opts.spi_base);
+  auto results = r.take();
+
+  if (!opts.bitstream.empty()) {
+    runner host{host_now, opts.bitstream_iterations, 1, opts.only};
+    bench_bitstream_read(host, opts.bitstream);
+    results.merge(host.take());
+  }
+  return results;
+}
+
+usb::metrics_snapshot run_board(const options &opts,
+                                const usb::device_filter &filter) {
+  usb::context ctx;
+  const usb::device_list list{ctx};
+  const auto matches = filter.filter(list);
+  if (matches.size() != 1) {
+    throw std::runtime_error(
+        fmt::format("invalid number of devices ({})", matches.size()));
+  }
+  usb::device_handle dh{matches[0]};
+  dh.reset();
+  dh.set_configuration(1);
+  usb::interface intf{dh, 0};
+
+  usb::metrics_snapshot results;
+  // first, the other benchmarks run against the uploaded design
+  if (!opts.bitstream.empty()) {
+    runner upload{host_now, opts.bitstream_iterations, 0, opts.only};
+    bench_bitstream_upload(upload, intf, opts.bitstream);
+    results.merge(upload.take());
+  }
+
+  usb::in_endpoint in_ep{intf, 1};
+  usb::out_endpoint out_ep{intf, 2};
+  spinaltap::device device{out_ep, in_ep};
+  runner r{host_now, opts.iterations, opts.warmup, opts.only};
+  bench_registers(r, device, opts.address);
+  bench_streams(r, device, opts.address);
+  bench_spi(r, device, opts.spi_base);
+  results.merge(r.take());
+  return results;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  options opts;
+  usb::device_filter filter;
+  filter.vendor_id(vendor_id);
+  filter.product_id(product_id);
+
+  auto cli =
+      (clipp::option("--sim")
+           .doc("Run against the simulated bridge instead of a board")
+           .set(opts.sim),
+       clipp::option("-n").doc("Timed iterations per benchmark") &
+           clipp::number("iterations", opts.iterations),
+       clipp::option("--warmup").doc("Untimed iterations per benchmark") &
+           clipp::number("iterations", opts.warmup),
+       clipp::option("--only").doc("Run benchmarks starting with prefix") &
+           clipp::value("prefix", opts.only),
+       clipp::option("--bitstream").doc("Also measure bitstream upload") &
+           clipp::value("file", opts.bitstream),
+       clipp::option("--bitstream-iterations")
+               .doc("Timed iterations of the bitstream upload") &
+           clipp::number("iterations", opts.bitstream_iterations),
+       clipp::option("--address")
+               .doc("Register used for register and stream benchmarks") &
+           clipp::value(is_number<uint16_t, 16>,
+                        "address")([&](std::string_view s) {
+             opts.address = as_integer<uint16_t, 16>(s);
+           }),
+       clipp::option("--spi").doc("Base address of the SPI master") &
+           clipp::value(is_number<uint16_t, 16>,
+                        "base")([&](std::string_view s) {
+             opts.spi_base = as_integer<uint16_t, 16>(s);
+           }),
+       clipp::option("--latency").doc("Latency of the simulated bridge [us]") &
+           clipp::number("us")([&](std::string_view s) {
+             opts.bridge.latency =
+                 std::chrono::microseconds(as_integer<uint16_t, 10>(s));
+           }),
+       clipp::option("-v").doc("Filter by vendor ID") &
+           clipp::value(is_number<uint16_t, 16>,
+                        "vendor")([&](std::string_view s) {
+             filter.vendor_id(as_integer<uint16_t, 16>(s));
+           }),
+       clipp::option("-p").doc("Filter by product ID") &
+           clipp::value(is_number<uint16_t, 16>,
+                        "product")([&](std::string_view s) {
+             filter.product_id(as_integer<uint16_t, 16>(s));
+           }),
+       clipp::option("-s").doc("Filter by serial number") &
+           clipp::value("serial")([&](std::string_view s) {
+             filter.serial_number(std::string{s});
+           }),
+       clipp::option("--prometheus")
+           .doc("Print Prometheus text instead of JSON")
+           .set(opts.prometheus),
+       clipp::option("-o").doc("Write results to file") &
+           clipp::value("file", opts.output));
+
+  if (!clipp::parse(argc, argv, cli)) {
+    std::cout << "Usage:\n"
+              << clipp::usage_lines(cli, "spinaltap_bench") << "\nOptions:\n"
+              << clipp::documentation(cli) << '\n';
+    return -1;
+  }
+
+  try {
+    auto results = opts.sim ? run_sim(opts) : run_board(opts, filter);
+    results.add_label("target", opts.sim ? "sim" : "board");
+    const auto text =
+        opts.prometheus ? results.to_prometheus() : results.to_json() + "\n";
+    if (opts.output.empty()) {
+      std::cout << text;
+    } else {
+      std::ofstream out{opts.output};
+      out << text;
+    }
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "error: {}\n", e.what());
+    return -1;
+  }
+  return 0;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <limits>
+#include <stdexcept>
 #include <string_view>
 
 namespace numeric_utils {
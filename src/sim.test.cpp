@@ -0,0 +1,670 @@
+#include "catch2/catch_all.hpp"
+
+#include "spinaltap.hpp"
+#include "spinaltap/coro.hpp"
+#include "spinaltap/metrics.hpp"
+#include "spinaltap/pwm/pwm.hpp"
+#include "spinaltap/pwm/registers.hpp"
+#include "spinaltap/sim/bridge.hpp"
+#include "spinaltap/sim/spi_flash.hpp"
+#include "spinaltap/spi/flash.hpp"
+#include "spinaltap/spi/registers.hpp"
+#include "spinaltap/spi/spi.hpp"
+#include "spinaltap/trace.hpp"
+#include "spinaltap/transaction.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("registers can be written and read back") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+
+  device.writeRegister(0x10, 0xdeadbeef);
+  REQUIRE(device.readRegister(0x10) == 0xdeadbeef);
+  REQUIRE(bridge.get(0x10) == 0xdeadbeef);
+
+  device.readModifyWrite(0x10, 0xff00, 0x1234);
+  REQUIRE(device.fetchModifyWrite(0x10, 0, 0) == 0xdead12ef);
+}
+
+TEST_CASE("pipelined reads complete in order") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  for (uint16_t i = 0; i < 64; i++)
+    bridge.set(i, i * 3);
+
+  std::vector<std::future<uint32_t>> reads;
+  for (uint16_t i = 0; i < 64; i++)
+    reads.push_back(device.readRegisterAsync(i));
+  for (uint16_t i = 0; i < 64; i++)
+    REQUIRE(device.wait(std::move(reads[i])) == i * 3U);
+}
+
+TEST_CASE("pipelining hides the bridge latency") {
+  spinaltap::sim::bridge::config config;
+  config.latency = 100us;
+  spinaltap::sim::bridge bridge{config};
+  spinaltap::device device{bridge};
+
+  auto start = bridge.now();
+  for (int i = 0; i < 16; i++)
+    (void)device.readRegister(0);
+  const auto blocking = bridge.now() - start;
+
+  start = bridge.now();
+  std::vector<std::future<uint32_t>> reads;
+  for (int i = 0; i < 16; i++)
+    reads.push_back(device.readRegisterAsync(0));
+  for (auto &read : reads)
+    (void)device.wait(std::move(read));
+  const auto pipelined = bridge.now() - start;
+
+  REQUIRE(blocking >= 16 * config.latency);
+  REQUIRE(pipelined < blocking / 4);
+}
+
+TEST_CASE("streams longer than a single command") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+
+  std::vector<uint8_t> written;
+  bridge.on_write(0x20, [&](uint32_t v) { written.push_back(v); });
+  uint32_t counter = 0;
+  bridge.on_read(0x24, [&] { return counter++; });
+
+  std::vector<std::byte> data(200'000);
+  for (std::size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<std::byte>(i);
+  device.writeStream(0x20, data);
+  device.sync();
+  REQUIRE(written.size() == data.size());
+  REQUIRE(written[70'000] == static_cast<uint8_t>(70'000));
+
+  std::vector<uint32_t> words(100'000);
+  device.readStream(0x24, words);
+  REQUIRE(words.front() == 0);
+  REQUIRE(words.back() == 99'999);
+  REQUIRE(bridge.commands() > 4);
+}
+
+TEST_CASE("transaction waits on the device or emulated") {
+  const bool on_device = GENERATE(true, false);
+  spinaltap::sim::bridge::config config;
+  config.wait_command = on_device;
+  spinaltap::sim::bridge bridge{config};
+  spinaltap::device device{bridge};
+  device.setFeatures({on_device});
+
+  // busy for 50us after every trigger
+  std::chrono::nanoseconds busy_until{0};
+  bridge.on_write(0x00, [&](uint32_t) { busy_until = bridge.now() + 50us; });
+  bridge.on_read(0x04, [&] { return bridge.now() < busy_until ? 1U : 0U; });
+  bridge.set(0x08, 42);
+
+  uint32_t value = 0;
+  spinaltap::transaction{device}
+      .write(0x00, 1)
+      .wait(0x04, 1, 0, 10ms)
+      .read(0x08, value)
+      .execute();
+  REQUIRE(value == 42);
+
+  bridge.on_read(0x04, [] { return 1U; });
+  REQUIRE_THROWS_AS(
+      spinaltap::transaction{device}.wait(0x04, 1, 0, 1ms).execute(),
+      std::runtime_error);
+  REQUIRE_FALSE(device.poll(0x04, 1, 0, 1ms));
+}
+
+TEST_CASE("waits may exceed the limit of the wait command") {
+  const bool on_device = GENERATE(true, false);
+  spinaltap::sim::bridge::config config;
+  config.wait_command = on_device;
+  config.poll_interval = 1ms;
+  spinaltap::sim::bridge bridge{config};
+  spinaltap::device device{bridge};
+  device.setFeatures({on_device});
+
+  // the host polls in real time, the device in simulated time
+  std::chrono::nanoseconds ready = 70s;
+  std::size_t reads = 0;
+  bridge.on_read(0x04, [&] {
+    reads++;
+    return on_device ? bridge.now() < ready : reads < 100;
+  });
+  bridge.set(0x08, 42);
+
+  uint32_t value = 0;
+  spinaltap::transaction{device}
+      .wait(0x04, 1, 0, 100s)
+      .read(0x08, value)
+      .execute();
+  REQUIRE(value == 42);
+  if (on_device)
+    REQUIRE(bridge.now() >= ready);
+
+  ready = bridge.now() + 70s;
+  reads = 0;
+  REQUIRE(device.poll(0x04, 1, 0, 100s));
+}
+
+TEST_CASE("configuration registers are cached") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  device.markConfiguration(0x20);
+
+  SECTION("write through") {
+    device.setCaching(spinaltap::caching::write_through);
+    device.writeRegister(0x20, 0x1234);
+    device.sync();
+    const auto commands = bridge.commands();
+    REQUIRE(device.readRegister(0x20) == 0x1234);
+    device.readModifyWrite(0x20, 0xff, 0x56);
+    REQUIRE(device.readRegister(0x20) == 0x1256);
+    REQUIRE(bridge.commands() == commands + 1);
+    REQUIRE(bridge.get(0x20) == 0x1256);
+
+    // writes from transactions update the cache as well
+    spinaltap::transaction{device}.write(0x20, 0x99).execute();
+    REQUIRE(device.readRegister(0x20) == 0x99);
+  }
+
+  SECTION("write back combines writes") {
+    device.setCaching(spinaltap::caching::write_back);
+    const auto commands = bridge.commands();
+    for (uint32_t i = 0; i < 10; i++)
+      device.writeRegister(0x20, i);
+    REQUIRE(bridge.commands() == commands);
+    REQUIRE(device.readRegister(0x20) == 9);
+
+    // recorded writes go out before other commands
+    bridge.set(0x30, 7);
+    REQUIRE(device.readRegister(0x30) == 7);
+    REQUIRE(bridge.commands() == commands + 2);
+    REQUIRE(bridge.get(0x20) == 9);
+
+    device.writeRegister(0x20, 10);
+    device.sync();
+    REQUIRE(bridge.get(0x20) == 10);
+  }
+
+  SECTION("misses are filled from replies") {
+    bridge.set(0x20, 0x42);
+    device.setCaching(spinaltap::caching::write_through);
+    REQUIRE(device.readRegister(0x20) == 0x42);
+    bridge.set(0x20, 0);
+    REQUIRE(device.readRegister(0x20) == 0x42);
+    device.invalidateCache();
+    REQUIRE(device.readRegister(0x20) == 0);
+  }
+}
+
+TEST_CASE("SPI configuration getters use the cache") {
+  namespace spi = spinaltap::spi;
+  spinaltap::sim::bridge bridge;
+  bridge.set(spi::registers::frequency, 100'000'000);
+  bridge.set(spi::registers::prescaler_width, 16);
+  spinaltap::device device{bridge};
+  device.setCaching(spinaltap::caching::write_through);
+  spi::master master{device, 0};
+
+  master.configure(spi::cpol::idle_high, spi::cpha::first_edge_latches, 1e6);
+  device.sync();
+  const auto commands = bridge.commands();
+  REQUIRE(master.polarity() == spi::cpol::idle_high);
+  REQUIRE(master.phase() == spi::cpha::first_edge_latches);
+  REQUIRE(master.frequency() == 1e6);
+  REQUIRE(bridge.commands() == commands);
+}
+
+TEST_CASE("SPI transfers are split at the FIFO size") {
+  namespace spi = spinaltap::spi;
+  namespace regs = spi::registers;
+  const bool on_device = GENERATE(true, false);
+  spinaltap::sim::bridge::config config;
+  config.wait_command = on_device;
+  spinaltap::sim::bridge bridge{config};
+  bridge.set(regs::frequency, 100'000'000);
+  bridge.set(regs::prescaler_width, 16);
+  bridge.set(regs::buffers, (16U << regs::buffers_tx_size_pos) |
+                                (24U << regs::buffers_rx_size_pos));
+
+  // loopback, records the slave select part of every trigger
+  std::vector<uint8_t> fifo;
+  std::vector<uint8_t> received;
+  std::vector<uint32_t> triggers;
+  bridge.on_write(regs::tx, [&](uint32_t v) {
+    REQUIRE(fifo.size() < 16);
+    fifo.push_back(static_cast<uint8_t>(v));
+  });
+  bridge.on_write(regs::trigger, [&](uint32_t v) {
+    if ((v & regs::trigger_transceive) == 0)
+      return;
+    triggers.push_back(v & (regs::trigger_assert | regs::trigger_deassert));
+    received.insert(received.end(), fifo.begin(), fifo.end());
+    fifo.clear();
+  });
+  bridge.on_read(regs::rx, [&] {
+    const uint32_t v = received.front();
+    received.erase(received.begin());
+    return v;
+  });
+
+  spinaltap::device device{bridge};
+  device.setFeatures({on_device});
+  spi::master master{device, 0};
+  REQUIRE(master.fifo_size() == 16);
+
+  std::vector<uint8_t> tx(100);
+  for (std::size_t i = 0; i < tx.size(); i++)
+    tx[i] = static_cast<uint8_t>(i * 7);
+  std::vector<uint8_t> rx(tx.size());
+  master.transceive(tx, rx, spi::ss_action::both);
+  REQUIRE(rx == tx);
+  REQUIRE(triggers.size() == 7);
+  REQUIRE(triggers.front() == regs::trigger_assert);
+  REQUIRE(std::all_of(triggers.begin() + 1, triggers.end() - 1,
+                      [](uint32_t t) { return t == 0; }));
+  REQUIRE(triggers.back() == regs::trigger_deassert);
+
+  triggers.clear();
+  master.send(tx, spi::ss_action::assert);
+  REQUIRE(triggers.size() == 7);
+  REQUIRE(triggers.front() == regs::trigger_assert);
+  REQUIRE(triggers.back() == 0);
+
+  // rx has to match tx, whether the transfer is split or not
+  triggers.clear();
+  std::vector<uint8_t> longer(tx.size() + 1);
+  REQUIRE_THROWS_AS(master.transceive(tx, longer), std::runtime_error);
+  REQUIRE_THROWS_AS(master.transceive(gsl::span(tx).first(4),
+                                      gsl::span(longer).first(5)),
+                    std::runtime_error);
+  REQUIRE(triggers.empty());
+}
+
+TEST_CASE("PWM run bit is updated in place") {
+  namespace regs = spinaltap::pwm::registers;
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  spinaltap::pwm::pwm pwm{device, 0};
+
+  bridge.set(regs::ctrl, 0xf0);
+  REQUIRE_FALSE(pwm.running());
+  pwm.set_running(true);
+  REQUIRE(bridge.get(regs::ctrl) == (0xf0 | regs::ctrl_run));
+  REQUIRE(pwm.running());
+  pwm.set_running(false);
+  REQUIRE(bridge.get(regs::ctrl) == 0xf0);
+}
+
+TEST_CASE("SPI messages are sent as one batch") {
+  namespace spi = spinaltap::spi;
+  namespace regs = spi::registers;
+  spinaltap::sim::bridge bridge;
+  bridge.set(regs::frequency, 100'000'000);
+  bridge.set(regs::prescaler_width, 16);
+
+  // loopback, records the slave select part and divider of every trigger
+  std::vector<uint8_t> fifo;
+  std::vector<uint8_t> received;
+  std::vector<std::pair<uint32_t, uint32_t>> triggers;
+  bridge.on_write(regs::tx,
+                  [&](uint32_t v) { fifo.push_back(static_cast<uint8_t>(v)); });
+  bridge.on_write(regs::trigger, [&](uint32_t v) {
+    triggers.emplace_back(v & (regs::trigger_assert | regs::trigger_deassert),
+                          regs::config_t::prescaler::get(
+                              bridge.get(regs::config)));
+    if ((v & regs::trigger_flush) != 0)
+      received.clear();
+    received.insert(received.end(), fifo.begin(), fifo.end());
+    fifo.clear();
+  });
+  bridge.on_read(regs::rx, [&] {
+    const uint32_t v = received.front();
+    received.erase(received.begin());
+    return v;
+  });
+
+  spinaltap::device device{bridge};
+  device.setFeatures({true});
+  // overrides need the configuration, which is not read if cached
+  device.setCaching(spinaltap::caching::write_through);
+  spi::master master{device, 0};
+  master.configure(spi::cpol::idle_low, spi::cpha::first_edge_shifts, 1e6);
+  device.sync();
+
+  const std::array<uint8_t, 1> write_enable{0x06};
+  const std::array<uint8_t, 4> program{0x02, 0x00, 0x10, 0x00};
+  const std::array<uint8_t, 3> data{0xaa, 0x55, 0x12};
+  std::array<uint8_t, 3> status{0xff, 0xff, 0xff};
+
+  spi::message message{{write_enable, {}, spi::ss_action::both},
+                       {program, {}, spi::ss_action::assert},
+                       {data, {}, spi::ss_action::deassert},
+                       {{}, status, spi::ss_action::both, 10e6}};
+  triggers.clear();
+  const auto transfers = bridge.transfers();
+  master.execute(message);
+  REQUIRE(bridge.transfers() == transfers + 1);
+
+  const std::vector<std::pair<uint32_t, uint32_t>> expected{
+      {regs::trigger_assert | regs::trigger_deassert, 100},
+      {regs::trigger_assert, 100},
+      {regs::trigger_deassert, 100},
+      {regs::trigger_assert | regs::trigger_deassert, 10}};
+  REQUIRE(triggers == expected);
+  REQUIRE(status == std::array<uint8_t, 3>{});
+  REQUIRE(regs::config_t::prescaler::get(bridge.get(regs::config)) == 100);
+
+  REQUIRE_THROWS(master.execute(
+      spi::message{{program, status, spi::ss_action::both}}));
+
+  // the override is undone if the message fails after it was sent
+  spi::segment stuck{{}, status, spi::ss_action::both, 10e6};
+  stuck.delay = 1ms;
+  bridge.set(regs::status, regs::status_busy);
+  REQUIRE_THROWS(master.execute(spi::message{stuck, {data, {}}}));
+  REQUIRE(regs::config_t::prescaler::get(bridge.get(regs::config)) == 100);
+}
+
+TEST_CASE("SPI flash only erases and programs what differs") {
+  namespace spi = spinaltap::spi;
+  spinaltap::sim::bridge bridge;
+  spinaltap::sim::spi_flash::config config;
+  config.size = 64 * 1024;
+  spinaltap::sim::spi_flash model{bridge, 0, config};
+  // kept when its sector is erased
+  const std::array<uint8_t, 4> kept{1, 2, 3, 4};
+  std::copy(kept.begin(), kept.end(), model.memory().begin() + 0x1000);
+
+  spinaltap::device device{bridge};
+  device.setFeatures({true});
+  spi::master master{device, 0};
+  spi::flash flash{master};
+
+  const auto id = flash.read_id();
+  REQUIRE(id.manufacturer == 0xef);
+  REQUIRE(id.device == 0x4014);
+  REQUIRE(flash.probe().size == 64 * 1024);
+  REQUIRE(flash.parameters().sector_erase_opcode == 0x20);
+
+  // pages 0x11 to 0x24 of sectors 1 and 2
+  std::vector<uint8_t> data(5000);
+  for (std::size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<uint8_t>(i * 7);
+  auto stats = flash.write(0x1100, data);
+  REQUIRE(stats.sectors_erased == 0);
+  REQUIRE(stats.pages_programmed == 20);
+  REQUIRE(stats.pages_skipped == 12);
+  REQUIRE(model.programs() == 20);
+  REQUIRE(stats.rate() > 0);
+  REQUIRE(
+      std::equal(data.begin(), data.end(), model.memory().begin() + 0x1100));
+
+  stats = flash.write(0x1100, data);
+  REQUIRE(stats.pages_programmed == 0);
+  REQUIRE(stats.pages_skipped == 32);
+  REQUIRE(model.programs() == 20);
+
+  // setting bits needs an erase of sector 1, the data before 0x1100 and
+  // the untouched sector 2 survive
+  data[0] = 0xff;
+  std::vector<uint64_t> progress;
+  stats = flash.write(0x1100, data, [&](const spinaltap::upload_progress &p) {
+    progress.push_back(p.done);
+  });
+  REQUIRE(stats.sectors_erased == 1);
+  REQUIRE(model.erases() == 1);
+  REQUIRE(stats.pages_programmed == 16);
+  REQUIRE(progress == std::vector<uint64_t>{4096, 8192});
+  REQUIRE(
+      std::equal(kept.begin(), kept.end(), model.memory().begin() + 0x1000));
+  REQUIRE(
+      std::equal(data.begin(), data.end(), model.memory().begin() + 0x1100));
+  REQUIRE(flash.verify(0x1100, data));
+  data[1] ^= 0x01;
+  REQUIRE_FALSE(flash.verify(0x1100, data));
+  // WIP was polled before every command, no page was sent twice
+  REQUIRE(model.ignored() == 0);
+
+  REQUIRE_THROWS(flash.write(0xffff, data));
+}
+
+TEST_CASE("register fields are combined into a single command") {
+  namespace regs = spinaltap::spi::registers;
+  static_assert(regs::guard_times_deassert_msk == 0xff0000U);
+  static_assert(regs::buffers_tx_size_msk == 0xff0000U);
+  static_assert(spinaltap::value_of(regs::config_t::cpol::of<1>(),
+                                    regs::config_t::prescaler::of<3>()) ==
+                0x32U);
+
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  bridge.set(regs::config, 0xff000001U);
+
+  auto commands = bridge.commands();
+  spinaltap::write_fields(device, 0, regs::config_t::cpol::of(1),
+                          regs::config_t::prescaler::of(5));
+  device.sync();
+  REQUIRE(bridge.commands() == commands + 1);
+  REQUIRE(bridge.get(regs::config) == 0xff000053U);
+  REQUIRE(spinaltap::read_field<regs::config_t::prescaler>(device, 0) == 5);
+
+  REQUIRE_THROWS(regs::guard_times_t::word::of(0x100));
+}
+
+TEST_CASE("registers are read with a single transfer") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  const std::array<uint32_t, 5> addresses{0x40, 0x10, 0x44, 0x10, 0x8};
+  for (auto address : addresses)
+    bridge.set(static_cast<uint16_t>(address), address * 2);
+
+  std::array<uint32_t, 5> values{};
+  const auto transfers = bridge.transfers();
+  device.readRegisters(addresses, values);
+  REQUIRE(bridge.transfers() == transfers + 1);
+  for (std::size_t i = 0; i < addresses.size(); i++)
+    REQUIRE(values[i] == addresses[i] * 2);
+
+  // cached registers don't need to be read
+  device.markConfiguration(0x40);
+  device.setCaching(spinaltap::caching::write_through);
+  device.writeRegister(0x40, 1);
+  const auto commands = bridge.commands();
+  device.readRegisters(addresses, values);
+  REQUIRE(bridge.commands() == commands + 4);
+  REQUIRE(values[0] == 1);
+  REQUIRE(values[4] == 0x10);
+
+  std::array<uint32_t, 2> too_few;
+  REQUIRE_THROWS_AS(device.readRegisters(addresses, too_few),
+                    std::logic_error);
+}
+
+TEST_CASE("a device can be shared by threads") {
+  spinaltap::sim::bridge::config config;
+  config.latency = 50us;
+  spinaltap::sim::bridge bridge{config};
+  spinaltap::device device{bridge};
+
+  constexpr uint32_t threads = 4;
+  constexpr uint32_t iterations = 200;
+  std::vector<std::thread> workers;
+  std::atomic<int> mismatches{0};
+  for (uint32_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (uint32_t i = 0; i < iterations; i++) {
+        device.writeRegister(t * 4, i);
+        if (device.readRegister(t * 4) != i)
+          mismatches++;
+      }
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+  device.sync();
+
+  REQUIRE(mismatches == 0);
+  for (uint32_t t = 0; t < threads; t++)
+    REQUIRE(bridge.get(static_cast<uint16_t>(t * 4)) == iterations - 1);
+  REQUIRE(bridge.commands() == threads * iterations * 2);
+}
+
+TEST_CASE("a contended transaction is sent as one transfer") {
+  spinaltap::sim::bridge::config config;
+  config.latency = 20us;
+  spinaltap::sim::bridge bridge{config};
+  constexpr uint16_t first = 0x100;
+  constexpr uint16_t size = 32;
+  // transfer each write of the transaction arrived with
+  std::vector<std::size_t> seen;
+  for (uint16_t i = 0; i < size; i++) {
+    bridge.on_write(first + i * 4, [&](uint32_t) {
+      seen.push_back(bridge.transfers());
+    });
+  }
+  spinaltap::device device{bridge};
+
+  std::atomic<bool> done{false};
+  std::vector<std::thread> others;
+  for (uint16_t t = 0; t < 3; t++) {
+    others.emplace_back([&, t] {
+      for (uint32_t i = 0; !done; i++) {
+        device.writeRegister(t * 4, i);
+        (void)device.readRegister(t * 4);
+      }
+    });
+  }
+  int split = 0;
+  for (uint32_t n = 0; n < 200; n++) {
+    seen.clear();
+    spinaltap::transaction t{device};
+    for (uint16_t i = 0; i < size; i++)
+      t.write(first + i * 4, n);
+    t.execute();
+    if (seen.size() != size ||
+        std::count(seen.begin(), seen.end(), seen.front()) != size)
+      split++;
+  }
+  done = true;
+  for (auto &t : others)
+    t.join();
+  REQUIRE(split == 0);
+}
+
+TEST_CASE("device metrics count commands and latency") {
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+
+  for (uint16_t i = 0; i < 10; i++)
+    (void)device.readRegister(i);
+  device.writeRegister(0, 1);
+  device.sync();
+
+  const auto &metrics = device.metrics();
+  const auto read = static_cast<uint8_t>(spinaltap::cmd::read);
+  REQUIRE(metrics.commands[read] == 10);
+  REQUIRE(metrics.commands[static_cast<uint8_t>(spinaltap::cmd::write)] == 1);
+  REQUIRE(metrics.in_flight == 0);
+  REQUIRE(metrics.max_in_flight >= 1);
+  const auto latency = metrics.latency[read].snapshot();
+  REQUIRE(latency.count == 10);
+  REQUIRE(latency.min <= latency.max);
+
+  const auto text = metrics.snapshot().to_prometheus();
+  REQUIRE(text.find("spinaltap_commands_total{opcode=\"read\"} 10\n") !=
+          std::string::npos);
+}
+
+TEST_CASE("commands are recorded in a trace ring") {
+  using spinaltap::trace_event;
+  spinaltap::sim::bridge bridge;
+  spinaltap::device device{bridge};
+  spinaltap::trace_ring ring{8};
+  device.setTrace(&ring);
+
+  device.writeRegister(0x10, 1);
+  REQUIRE(device.readRegister(0x12) == 0);
+  device.setTrace(nullptr);
+  device.writeRegister(0x10, 2);
+  device.sync();
+
+  uint64_t cursor{0};
+  std::vector<spinaltap::trace_record> records;
+  REQUIRE(ring.read(cursor, records) == 0);
+  REQUIRE(cursor == 4);
+  REQUIRE(records.size() == 4);
+  REQUIRE(records[0].event == trace_event::submit);
+  REQUIRE(records[0].opcode == static_cast<uint8_t>(spinaltap::cmd::write));
+  REQUIRE(records[0].address == 0x10);
+  // the posted write is still in flight when the read is sent
+  REQUIRE(records[1].event == trace_event::submit);
+  REQUIRE(records[2].event == trace_event::complete);
+  REQUIRE(records[2].sequence == records[0].sequence);
+  REQUIRE(records[3].event == trace_event::complete);
+  REQUIRE(records[3].opcode == static_cast<uint8_t>(spinaltap::cmd::read));
+  REQUIRE(records[3].address == 0x12);
+  REQUIRE(records[3].timestamp >= records[2].timestamp);
+
+  std::stringstream file;
+  spinaltap::write_trace_header(file);
+  spinaltap::write_trace(file, records);
+  const auto decoded = spinaltap::read_trace(file);
+  REQUIRE(decoded.size() == records.size());
+  REQUIRE(decoded[3].timestamp == records[3].timestamp);
+  REQUIRE(decoded[3].address == 0x12);
+  REQUIRE(decoded[3].length == 4);
+
+  // the ring only keeps the newest records
+  for (uint16_t i = 0; i < 12; i++)
+    ring.record({i, trace_event::submit, 0, 0, i, 0});
+  records.clear();
+  REQUIRE(ring.read(cursor, records) == 4);
+  REQUIRE(records.size() == 8);
+  REQUIRE(records[0].address == 4);
+}
+
+#ifdef LIBUSBXX_COROUTINES
+TEST_CASE("coroutines share a single thread") {
+  spinaltap::sim::bridge::config config;
+  config.latency = 100us;
+  spinaltap::sim::bridge bridge{config};
+  spinaltap::device device{bridge};
+
+  auto session = [&](uint32_t address) -> spinaltap::task<uint32_t> {
+    co_await spinaltap::async_write_register(device, address, address + 1);
+    const auto value = co_await spinaltap::async_read_register(device, address);
+    co_return value * 2;
+  };
+
+  constexpr int sessions = 8;
+  std::vector<uint32_t> results(sessions);
+  // the lambdas have to outlive the coroutines, they refer to the captures
+  auto run = [&](int i) -> spinaltap::task<> {
+    results[i] = co_await session(i * 4);
+  };
+  int done = 0;
+  const auto start = bridge.now();
+  for (int i = 0; i < sessions; i++)
+    spinaltap::spawn(run(i), [&](std::exception_ptr error) {
+      REQUIRE(!error);
+      done++;
+    });
+  while (done < sessions)
+    device.processEvents(10ms);
+
+  for (int i = 0; i < sessions; i++)
+    REQUIRE(results[i] == (i * 4 + 1) * 2U);
+  // the sessions overlap, each one takes two round trips
+  REQUIRE(bridge.now() - start < sessions * 2 * config.latency);
+}
+#endif
@@ -1,6 +1,21 @@
 #define CATCH_CONFIG_MAIN
 #include "catch2/catch_all.hpp"
 
+#include "libusb++/event_loop.hpp"
+#include "libusb++/metrics.hpp"
+#include "libusb++/spsc_queue.hpp"
+#include "libusb++/transfer.hpp"
+#include "numeric_utils.hpp"
+#include "spinaltap/bitstream.hpp"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
 template <int c, int bit> struct mask_recurse {
   static int foo(int n) {
     return (((~c ^ n) >> bit) & 1) && mask_recurse<c, bit - 1>::foo(n);
@@ -18,3 +33,145 @@ TEST_CASE("foo") {
   REQUIRE(mask<5>(x) == 0);
   REQUIRE(mask<5>(6) == -1);
 }
+
+TEST_CASE("bitstream_reader returns parallel bitorder") {
+  // sync word in the bitorder of the file, serial files are flipped
+  const bool serial = GENERATE(false, true);
+  const std::array<char, 4> sync =
+      serial ? std::array<char, 4>{'\xaa', '\x99', '\x55', '\x66'}
+             : std::array<char, 4>{'\x55', '\x99', '\xaa', '\x66'};
+
+  // longer than the head that is loaded for bitorder detection
+  std::vector<char> data(spinaltap::bitstream_reader::sync_search_limit + 1000);
+  for (std::size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<char>(i * 31 + 7);
+  std::fill_n(data.begin(), 16, '\0');
+  std::copy(sync.begin(), sync.end(), data.begin() + 16);
+
+  const auto path =
+      std::filesystem::temp_directory_path() / "spinaltap_test_bitstream.bit";
+  {
+    std::ofstream file{path, std::ios::binary};
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  }
+
+  spinaltap::bitstream_reader reader{path};
+  REQUIRE(reader.flipped() == serial);
+  REQUIRE(reader.size() == data.size());
+
+  // chunks that don't divide the head, one is partly read from it
+  std::vector<char> read;
+  std::array<char, 1000> chunk{};
+  while (const auto n = reader.read(chunk))
+    read.insert(read.end(), chunk.begin(), chunk.begin() + n);
+  REQUIRE(reader.position() == data.size());
+
+  if (serial) {
+    for (auto &c : data)
+      c = numeric_utils::flip_bits(c);
+  }
+  REQUIRE(read == data);
+
+  std::fill_n(data.begin(), 32, '\0');
+  {
+    std::ofstream file{path, std::ios::binary};
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  }
+  REQUIRE_THROWS_AS(spinaltap::bitstream_reader{path}, std::runtime_error);
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("spsc_queue passes values between threads in order") {
+  usb::spsc_queue<int> queue{4};
+  REQUIRE(queue.capacity() == 4);
+  for (int i = 0; i < 4; i++)
+    REQUIRE(queue.push(i));
+  REQUIRE_FALSE(queue.push(4));
+  REQUIRE(queue.pop() == 0);
+
+  usb::spsc_queue<int> handover{16};
+  constexpr int count = 100000;
+  std::thread producer{[&] {
+    for (int i = 0; i < count; i++)
+      while (!handover.push(i))
+        std::this_thread::yield();
+  }};
+  bool ordered = true;
+  for (int expected = 0; expected < count;) {
+    if (auto value = handover.pop())
+      ordered &= *value == expected++;
+  }
+  producer.join();
+  REQUIRE(ordered);
+  REQUIRE(handover.empty());
+}
+
+TEST_CASE("work_queue runs handlers on the polling thread") {
+  usb::work_queue queue;
+  REQUIRE(queue.poll() == 0);
+
+  auto ex = queue.get_executor();
+  std::thread::id ran_on;
+  std::thread poster{[&] { ex([&] { ran_on = std::this_thread::get_id(); }); }};
+  poster.join();
+  REQUIRE(queue.run_for(std::chrono::milliseconds(100)) == 1);
+  REQUIRE(ran_on == std::this_thread::get_id());
+}
+
+TEST_CASE("transfers may be destroyed before their handler ran") {
+  usb::work_queue queue;
+  std::vector<uint8_t> buffer(64);
+  int called = 0;
+  // completes it the way the event handling of libusb does
+  const auto complete = [](usb::transfer &t) {
+    auto *native = t.native_handle();
+    native->status = LIBUSB_TRANSFER_COMPLETED;
+    native->callback(native);
+  };
+
+  auto t = std::make_unique<usb::transfer>();
+  t->fill_bulk(nullptr, nullptr, 0x81, buffer, std::chrono::milliseconds(100));
+  t->set_executor(queue.get_executor());
+  t->set_callback([&](usb::transfer &) { called++; });
+  complete(*t);
+  REQUIRE(queue.poll() == 1);
+  REQUIRE(called == 1);
+
+  complete(*t);
+  REQUIRE_FALSE(t->in_flight());
+  t.reset();
+  REQUIRE(queue.poll() == 1);
+  REQUIRE(called == 1);
+}
+
+TEST_CASE("histogram buckets bound the relative error") {
+  for (uint64_t v : {0ULL, 15ULL, 16ULL, 17ULL, 1000ULL, 123456789ULL}) {
+    const auto upper = usb::histogram::bucket_upper(
+        usb::histogram::bucket_index(v));
+    REQUIRE(upper >= v);
+    REQUIRE(upper - v <= v / 16);
+  }
+
+  usb::histogram h;
+  for (uint64_t i = 1; i <= 1000; i++)
+    h.record(i * 1000);
+  const auto s = h.snapshot();
+  REQUIRE(s.count == 1000);
+  REQUIRE(s.min == 1000);
+  REQUIRE(s.max == 1000000);
+  REQUIRE(s.percentile(50) >= 500000);
+  REQUIRE(s.percentile(50) <= 500000 + 500000 / 16);
+  REQUIRE(s.percentile(100) == 1000000);
+
+  usb::metrics_snapshot m;
+  m.counters.push_back({{"requests_total", {{"op", "read"}}}, 3});
+  m.histograms.push_back({{"latency_seconds", {}}, s});
+  m.add_label("board", "1");
+  const auto text = m.to_prometheus();
+  REQUIRE(text.find("# TYPE requests_total counter\n"
+                    "requests_total{op=\"read\",board=\"1\"} 3\n") !=
+          std::string::npos);
+  REQUIRE(text.find("latency_seconds_count{board=\"1\"} 1000\n") !=
+          std::string::npos);
+  REQUIRE(m.to_json().find("\"p99_ns\":") != std::string::npos);
+}
@@ -2,17 +2,21 @@
 #include "libusb++/device_filter.hpp"
 #include "libusb++/libusb++.hpp"
 #include "libusb++/logging.hpp"
+#include "libusb++/stream_reader.hpp"
 #include "libusb++/utils.hpp"
 #include "numeric_utils.hpp"
 #include "random.hpp"
 #include "spinaltap.hpp"
+#include "spinaltap/device_pool.hpp"
 #include "spinaltap/gpio/gpio.hpp"
 #include "spinaltap/iomux/iomux.hpp"
 #include "spinaltap/iso7816/iso7816.hpp"
 #include "spinaltap/logging.hpp"
+#include "spinaltap/metrics.hpp"
 #include "spinaltap/pwm/pwm.hpp"
 #include "spinaltap/pwm/registers.hpp"
 #include "spinaltap/spi/spi.hpp"
+#include "spinaltap/trace.hpp"
 #include "ztexpp.hpp"
 
 #include "fmt/chrono.h"
@@ -22,6 +26,7 @@
 #include "utils.hpp"
 #include <algorithm>
 #include <cmath>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <optional>
@@ -46,6 +51,8 @@ int main(int argc, char *argv[]) {
   bool test_rx = false;
   bool interactive = true;
   std::string bitstream;
+  std::string trace_file;
+  std::string decode_file;
 
   // for easier debugging
   filter.product_id(1337);
@@ -68,6 +75,10 @@ int main(int argc, char *argv[]) {
                         "product")([&](std::string_view s) {
              filter.product_id(as_integer<uint16_t, 16>(s));
            }),
+       clipp::option("-s").doc("Filter by serial number") &
+           clipp::value("serial")([&](std::string_view s) {
+             filter.serial_number(std::string{s});
+           }),
        clipp::option("--verbose").doc("Print detail information").set(verbose),
        clipp::option("--download").doc("Try download").set(download) &
            clipp::value("bitstream", bitstream),
@@ -75,7 +86,11 @@ int main(int argc, char *argv[]) {
        clipp::option("--test-rx").doc("Run RX speedtest").set(test_rx),
        clipp::option("--interactive")
            .doc("Run interactive shell")
-           .set(interactive));
+           .set(interactive),
+       clipp::option("--trace").doc("Record commands of the shell to file") &
+           clipp::value("file", trace_file),
+       clipp::option("--decode-trace").doc("Print a recorded trace") &
+           clipp::value("file", decode_file));
 
   auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
   console_sink->set_level(spdlog::level::debug);
@@ -95,6 +110,12 @@ int main(int argc, char *argv[]) {
       exit(-1);
     }
 
+    if (!decode_file.empty()) {
+      std::ifstream in{decode_file, std::ios::binary};
+      spinaltap::print_trace(std::cout, spinaltap::read_trace(in));
+      return 0;
+    }
+
     usb::context usb_ctx;
     usb_ctx.set_log_level(usb::log_level::info);
     {
@@ -124,36 +145,33 @@ int main(int argc, char *argv[]) {
       }
 
       if (download || test_txrx || test_rx) {
-        if (matches.size() != 1) {
-          fmt::print("invalid number of devices ({}) - exit", matches.size());
-          return -1;
-        }
-
-        usb::device_handle dh{matches[0]};
-        dh.reset();
-        dh.set_configuration(1);
-
-        try {
-          if (download) {
-            usb::interface intf{dh, 0};
-            auto info = ztex::device_info(intf);
-            // ztex::upload_bitstream(intf, info, "C:/work/tmp/Board_2_14.bit");
+        // all matching boards are handled in parallel
+        spinaltap::board::config config;
+        config.reset = true;
+        spinaltap::device_pool pool{filter, config};
+        for (const auto &[id, error] : pool.unavailable())
+          fmt::print("board {}-{} unavailable\n", id.bus, id.address);
+
+        pool.run([&](spinaltap::board &board) {
+          auto &intf = board.usb_interface();
+          auto info = ztex::device_info(intf);
+          if (download)
             ztex::upload_bitstream(intf, info, bitstream);
-          }
-
-          if (test_txrx) {
-            usb::interface intf{dh, 0};
-            auto info = ztex::device_info(intf);
+          if (test_txrx)
             loopbackTest(intf, info);
-          }
-          if (test_rx) {
-            usb::interface intf{dh, 0};
-            auto info = ztex::device_info(intf);
+          if (test_rx)
             readValueTest(intf, info);
-          }
+        });
 
-        } catch (const std::exception &e) {
-          fmt::print(e.what());
+        for (const auto &board : pool) {
+          if (!board->failed())
+            continue;
+          try {
+            std::rethrow_exception(board->error());
+          } catch (const std::exception &e) {
+            fmt::print("board {}-{} ({}): {}\n", board->id().bus,
+                       board->id().address, board->id().serial, e.what());
+          }
         }
       }
       if (interactive) {
@@ -167,12 +185,18 @@ int main(int argc, char *argv[]) {
 
         usb::interface intf{dh, 0};
         // auto info = ztex::device_info(intf);
+        spinaltap::trace_ring ring;
+        std::optional<spinaltap::trace_writer> writer;
+        if (!trace_file.empty())
+          writer.emplace(ring, trace_file);
         bool loop = true;
         do {
           try {
             usb::in_endpoint in_ep{intf, 1};
             usb::out_endpoint out_ep{intf, 2};
             spinaltap::device device{out_ep, in_ep};
+            if (writer)
+              device.setTrace(&ring);
             loop = interactiveShell(device);
           } catch (std::runtime_error &e) {
             fmt::print("Error: {}\n", e.what());
@@ -223,38 +247,46 @@ static void loopbackTest(usb::interface &intf, ztex::dev_info &info) {
 
 static void readValueTest(usb::interface &intf, ztex::dev_info &info) {
   using namespace std::literals::chrono_literals;
-  std::vector<uint8_t> mbuf(4 * 1024 * 1024, 0);
 
   ztex::reset_fpga(intf, false);
   ztex::ctrl_gpio(intf, 0b0111, 0b0001);
 
   usb::in_endpoint in_ep{intf, info.default_in_ep};
+  // transfers stay queued on the endpoint while the data is checked
+  usb::stream_reader reader{in_ep};
   int size{0};
   int errors{0};
   xorshift16 xs{0xc181}; // seed so that first result is 1, matching HW
+  const auto start = std::chrono::steady_clock::now();
+  reader.start();
   while (size < 2000000) {
-    int transferred = in_ep.bulk_read(mbuf, 2000ms);
-
-    fmt::print("transferred: {}\n", transferred);
-    if (transferred % 2)
+    auto chunk = reader.next(2000ms);
+    if (!chunk)
+      throw usb::usb_error(usb::errors::TIMEOUT);
+    if (chunk.data().size() % 2)
       throw std::runtime_error("unexpected transfer size != 2 * n");
 
-    uint16_t *mbuf16 = reinterpret_cast<uint16_t *>(mbuf.data());
-    while (transferred >= 2) {
+    for (std::size_t i = 0; i + 1 < chunk.data().size(); i += 2) {
+      const uint16_t value = chunk.data()[i] | (chunk.data()[i + 1] << 8);
       size++;
       uint16_t expected = xs();
-      if (*mbuf16 != expected) {
-        fmt::print("{}: 0x{:04x} != 0x{:04x}\n", size, *mbuf16, expected);
+      if (value != expected) {
+        fmt::print("{}: 0x{:04x} != 0x{:04x}\n", size, value, expected);
         if (errors++ > 20)
           return;
       } else if (size < 20) {
-        fmt::print("{}: 0x{:04x} == 0x{:04x}\n", size, *mbuf16, expected);
+        fmt::print("{}: 0x{:04x} == 0x{:04x}\n", size, value, expected);
       }
-      mbuf16++;
-      transferred -= 2;
     }
   }
-
+  reader.stop();
+
+  const std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const auto stats = reader.stats();
+  fmt::print("Read {:.1f} MB at {:.1f} MB/s ({} overflows, {} starvations)\n",
+             stats.bytes / (1024.0 * 1024.0), stats.bytes / elapsed.count(),
+             stats.overflows, stats.starvations);
   if (errors == 0)
     fmt::print("DONE: OK\n");
 }
@@ -467,6 +499,7 @@ static void perftest(spinaltap::device &device) {
     for (size_t i = 0; i < cnt; i++) {
       device.writeRegister(spinaltap::pwm::registers::max, 0);
     }
+    device.sync();
     const auto after = std::chrono::high_resolution_clock::now();
     const auto duration = after - before;
     using double_duration = std::chrono::duration<double>;
@@ -475,6 +508,43 @@ static void perftest(spinaltap::device &device) {
                std::chrono::duration_cast<std::chrono::milliseconds>(dd),
                dd.count() / cnt);
   }
+  {
+    std::vector<std::future<uint32_t>> reads;
+    reads.reserve(cnt);
+    const auto before = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < cnt; i++) {
+      reads.push_back(
+          device.readRegisterAsync(spinaltap::pwm::registers::max));
+    }
+    for (auto &read : reads)
+      (void)device.wait(std::move(read));
+    const auto after = std::chrono::high_resolution_clock::now();
+    using double_duration = std::chrono::duration<double>;
+    const double_duration dd = after - before;
+    fmt::print("{} pipelined reads in {} ms => {}ms / read\n", cnt,
+               std::chrono::duration_cast<std::chrono::milliseconds>(dd),
+               dd.count() / cnt);
+  }
+  {
+    // large enough to be split into many chunks
+    std::vector<std::byte> data(4 * 1024 * 1024);
+    using double_duration = std::chrono::duration<double>;
+
+    auto before = std::chrono::high_resolution_clock::now();
+    device.writeStream(spinaltap::pwm::registers::max, data);
+    device.sync();
+    double_duration dd = std::chrono::high_resolution_clock::now() - before;
+    fmt::print("stream write of {} bytes in {} ms => {} MB/s\n", data.size(),
+               std::chrono::duration_cast<std::chrono::milliseconds>(dd),
+               data.size() / dd.count() / 1e6);
+
+    before = std::chrono::high_resolution_clock::now();
+    device.readStream(spinaltap::pwm::registers::max, data);
+    dd = std::chrono::high_resolution_clock::now() - before;
+    fmt::print("stream read of {} bytes in {} ms => {} MB/s\n", data.size(),
+               std::chrono::duration_cast<std::chrono::milliseconds>(dd),
+               data.size() / dd.count() / 1e6);
+  }
 }
 
 static bool interactiveShell(spinaltap::device &device) {
@@ -517,6 +587,12 @@ static bool interactiveShell(spinaltap::device &device) {
     isotest(device);
   } else if (pieces.at(0) == "perftest") {
     perftest(device);
+  } else if (pieces.at(0) == "metrics") {
+    const auto snapshot = device.metrics().snapshot();
+    if (pieces.size() == 2 && pieces.at(1) == "json")
+      fmt::print("{}\n", snapshot.to_json());
+    else
+      fmt::print("{}", snapshot.to_prometheus());
   } else {
     fmt::print("invalid command\n");
   }
@@ -2,12 +2,22 @@
 
 #include "fmt/core.h"
 #include "gsl/span"
+#include "libusb++/device_registry.hpp"
 #include "libusb++/libusb++.hpp"
-#include "numeric_utils.hpp"
+#include "libusb++/logging.hpp"
+#include "libusb++/transfer.hpp"
+#include "spinaltap/bitstream.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 
 namespace ztex {
@@ -46,19 +56,16 @@ enum class commands : uint8_t {
 };
 
 [[nodiscard]] std::string device_info_string(const usb::device &dev) {
-  auto dd{dev.device_descriptor()};
-  std::string product_string = "<unknown>";
-  std::string serialnumber = "<unknown>";
-  try {
-    usb::device_handle devhandle{dev};
-    product_string = devhandle.string_descriptor_ascii(dd.iProduct);
-    serialnumber = devhandle.string_descriptor_ascii(dd.iSerialNumber);
-  } catch (const usb::usb_error &) {
-  }
+  return device_info_string(usb::cached_device{dev});
+}
+
+[[nodiscard]] std::string device_info_string(const usb::cached_device &dev) {
+  const auto &dd = dev.device_descriptor();
   return fmt::format(
       "Bus {:03x} device {:03x}: ID {:04x}:{:04x} Product {} SN {}",
-      dev.bus_number(), dev.device_address(), dd.idVendor, dd.idProduct,
-      product_string, serialnumber);
+      dev.get().bus_number(), dev.get().device_address(), dd.idVendor,
+      dd.idProduct, dev.string_descriptor(dd.iProduct).value_or("<unknown>"),
+      dev.serial_number().value_or("<unknown>"));
 }
 
 [[nodiscard]] dev_info device_info(usb::interface &intf) {
@@ -71,7 +78,9 @@ enum class commands : uint8_t {
 
   try {
     const auto fast_config_len{intf.control_read(
-        type::vendor, recipient::device, 0x33, 0, 0, buffer, 1500ms)};
+        type::vendor, recipient::device,
+        static_cast<uint8_t>(commands::fpga_fast_info), 0, 0, buffer,
+        1500ms)};
     info.fast_config_ep = fast_config_len >= 1 ? buffer[0] : 0;
     info.fast_config_if = fast_config_len == 2 ? buffer[1] : 0;
   } catch (const usb::usb_error &) {
@@ -115,78 +124,276 @@ enum class commands : uint8_t {
   return buffer[0] == 0;
 }
 
-void upload_bitstream(usb::interface &intf, dev_info &info,
-                      std::filesystem::path bitstream_location) {
-  constexpr int ep0_transaction_size = 2048;
-  static_assert(
-      ep0_transaction_size % 64 == 0,
-      "transaction size must be x * 64, otherwise end-detection will not work");
-
-  std::ifstream file{bitstream_location, std::ios::binary | std::ios::ate};
-  if (!file)
-    throw std::system_error(errno, std::system_category(),
-                            std::string("failed to open ") +
-                                bitstream_location.string());
-  const std::streamsize filesize{file.tellg()};
-  file.seekg(0, std::ios::beg);
-
-  // load bitstream prepended with 512 0-bytes as dummy data
-  // sometimes first 512 byte are swallowed by by FX3 on bulk endpoints
-  // if last transfer is less than a full transaction but
-  // of a multiple of 64 - add a single byte for end detection
-  const std::streamsize prepended_size = filesize + 512;
-  const std::streamsize buffer_size =
-      ((prepended_size % ep0_transaction_size != 0) &&
-       (prepended_size % 64 == 0))
-          ? prepended_size + 1
-          : prepended_size;
-  std::vector<char> bitstream(buffer_size, 0);
-  if (!file.read(bitstream.data() + 512, filesize))
-    throw ztex_error(std::string("could not load bitstream ") +
-                     bitstream_location.string());
-
-  // check bitorder since Vivado has two possible formats (serial and parallel
-  // download) - we need flipped bitorder for parallel download
-  // xilinx bitstream files carry a synchronization word
-  //
-  // see Series 7 Configuration Guide, p. 83
-  // https://www.xilinx.com/support/documentation/user_guides/ug470_7Series_Config.pdf
-  std::vector<char> flipped_sync{'\x55', '\x99', '\xaa', '\x66'};
-  std::vector<char> normal_sync{'\xaa', '\x99', '\x55', '\x66'};
-  auto index_flipped = std::search(begin(bitstream), end(bitstream),
-                                   begin(flipped_sync), end(flipped_sync));
-  auto index_normal = std::search(begin(bitstream), end(bitstream),
-                                  begin(normal_sync), end(normal_sync));
-  if (index_flipped == end(bitstream) && index_normal == end(bitstream))
-    throw ztex_error(
-        "can't determine bitorder of bitstream, expected mark missing");
-
-  if (index_normal < index_flipped) {
-    for (auto &c : bitstream) {
-      c = numeric_utils::flip_bits(c);
+namespace {
+// the 512 dummy bytes in front of the bitstream
+constexpr std::size_t dummy_size = 512;
+constexpr int ep0_transaction_size = 2048;
+static_assert(
+    ep0_transaction_size % 64 == 0,
+    "transaction size must be x * 64, otherwise end-detection will not work");
+constexpr std::size_t ep0_read_ahead = 32 * ep0_transaction_size;
+constexpr std::size_t fast_transfer_size = 64 * 1024;
+constexpr std::size_t fast_transfers_in_flight = 4;
+static_assert(fast_transfer_size % 512 == 0,
+              "only the last bulk transfer may end with a short packet");
+// larger images are streamed from the file on every upload
+constexpr std::uintmax_t max_cached_size = 32 * 1024 * 1024;
+
+using prepared_image = std::shared_ptr<const std::vector<char>>;
+
+struct cache_entry {
+  std::filesystem::file_time_type write_time;
+  prepared_image image;
+};
+
+std::mutex cache_mutex;
+std::map<std::filesystem::path, cache_entry> cache;
+
+/// Image as it is sent to the device
+///
+/// The bitstream is prepended with 512 0-bytes as dummy data since
+/// sometimes first 512 byte are swallowed by by FX3 on bulk endpoints.
+/// If the size is a multiple of 64 the last transfer might end with a
+/// full packet - a single byte is added for end detection.
+///
+/// Bitstreams are usually uploaded to many boards in a row, smaller
+/// images are kept in memory after they were read once as long as the
+/// file does not change.
+class upload_source {
+public:
+  explicit upload_source(const std::filesystem::path &location) {
+    std::error_code ec;
+    path_ = std::filesystem::absolute(location, ec);
+    write_time_ = std::filesystem::last_write_time(path_, ec);
+    if (!ec) {
+      std::lock_guard lock{cache_mutex};
+      auto it = cache.find(path_);
+      if (it != cache.end() && it->second.write_time == write_time_)
+        image_ = it->second.image;
     }
+
+    if (image_) {
+      size_ = image_->size();
+      return;
+    }
+
+    reader_.emplace(location);
+    const auto prepended_size = reader_->size() + dummy_size;
+    size_ = prepended_size % 64 == 0 ? prepended_size + 1 : prepended_size;
+    if (!ec && size_ <= max_cached_size)
+      recording_.reserve(static_cast<std::size_t>(size_));
+  }
+
+  [[nodiscard]] std::uintmax_t size() const noexcept { return size_; }
+
+  // returns the number of bytes read, 0 at the end of the image
+  std::size_t read(gsl::span<char> out) {
+    const auto n = static_cast<std::size_t>(
+        std::min<std::uintmax_t>(out.size(), size_ - position_));
+    out = out.first(n);
+    if (image_) {
+      std::memcpy(out.data(), image_->data() + position_, n);
+      position_ += n;
+      return n;
+    }
+
+    std::size_t done = 0;
+    if (position_ < dummy_size) {
+      done = std::min(n, dummy_size - static_cast<std::size_t>(position_));
+      std::fill_n(out.begin(), done, '\0');
+    }
+    const auto from_file = static_cast<std::size_t>(std::min<std::uintmax_t>(
+        n - done, reader_->size() - reader_->position()));
+    if (reader_->read(out.subspan(done, from_file)) != from_file)
+      throw ztex_error("bitstream changed while reading");
+    done += from_file;
+    // end detection byte
+    std::fill(out.begin() + done, out.end(), '\0');
+
+    position_ += n;
+    record(out);
+    return n;
+  }
+
+private:
+  void record(gsl::span<const char> data) {
+    if (recording_.capacity() < size_)
+      return;
+    recording_.insert(recording_.end(), data.begin(), data.end());
+    if (recording_.size() != size_)
+      return;
+    std::lock_guard lock{cache_mutex};
+    cache[path_] = cache_entry{
+        write_time_,
+        std::make_shared<const std::vector<char>>(std::move(recording_))};
+  }
+
+  std::filesystem::path path_;
+  std::filesystem::file_time_type write_time_;
+  std::uintmax_t size_;
+  std::uintmax_t position_{0};
+  prepared_image image_;
+  std::optional<spinaltap::bitstream_reader> reader_;
+  std::vector<char> recording_;
+};
+
+class progress_reporter {
+public:
+  progress_reporter(std::uintmax_t total, spinaltap::progress_handler handler)
+      : total_(total), handler_(std::move(handler)) {}
+
+  void add(std::size_t n) {
+    done_ += n;
+    if (handler_)
+      handler_(current());
+  }
+
+  [[nodiscard]] spinaltap::upload_progress current() const {
+    return {done_, total_, std::chrono::steady_clock::now() - start_};
   }
 
-  // TODO implement fast config
+private:
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  std::uintmax_t done_{0};
+  std::uintmax_t total_;
+  spinaltap::progress_handler handler_;
+};
+
+void log_throughput(const spinaltap::upload_progress &progress) {
+  usb::logging::logger->info(
+      "uploaded {} bytes in {} ms ({:.2f} MB/s)", progress.done,
+      std::chrono::duration_cast<std::chrono::milliseconds>(progress.elapsed)
+          .count(),
+      progress.rate() / 1e6);
+}
+} // namespace
+
+static void control_command(usb::interface &intf, commands cmd) {
   using namespace std::literals::chrono_literals;
   intf.control_write(usb::type::vendor, usb::recipient::device,
-                     static_cast<uint8_t>(commands::fpga_reset), 0, 0,
-                     gsl::span<uint8_t>{}, 1500ms);
-
-  utils::in_chunks<char>(bitstream, ep0_transaction_size, [&](auto chunk) {
-    const auto size{chunk.size()};
-    auto sent{intf.control_write(
-        usb::type::vendor, usb::recipient::device,
-        static_cast<uint8_t>(commands::fpga_send), 0, 0,
-        gsl::span((uint8_t *)chunk.data(), chunk.size()), 1000ms)};
-    if (sent != chunk.size())
-      throw ztex_error("Error transferring bitstream");
-  });
-  // TODO do we need to send additional frame if no additional byte was added?
-  // would also be missing in the original source
+                     static_cast<uint8_t>(cmd), 0, 0, gsl::span<uint8_t>{},
+                     1500ms);
+}
+
+// stream the bitstream through the fast configuration endpoint, keeping
+// several bulk transfers in flight. The next chunk is read and prepared
+// while the previous ones are transferred.
+static void upload_fast(usb::interface &intf, const dev_info &info,
+                        upload_source &source, progress_reporter &progress) {
+  using namespace std::literals::chrono_literals;
+  usb::out_endpoint ep{intf,
+                       static_cast<unsigned char>(info.fast_config_ep & 0x7f)};
+
+  control_command(intf, commands::fpga_reset);
+  control_command(intf, commands::fpga_fast_start);
+
+  bool end_of_image = false;
+  std::size_t in_flight = 0;
+  auto error = usb::errors::SUCCESS;
+  std::array<std::vector<char>, fast_transfers_in_flight> buffers;
+  std::array<usb::transfer, fast_transfers_in_flight> transfers;
+  for (auto &t : transfers) {
+    t.set_callback([&](usb::transfer &t) {
+      in_flight--;
+      if (error != usb::errors::SUCCESS)
+        return;
+      if (t.status() != usb::transfer_status::completed)
+        error = usb::to_error(t.status());
+      else if (static_cast<std::size_t>(t.actual_length()) !=
+               t.buffer().size())
+        error = usb::errors::IO_ERROR;
+      else
+        progress.add(t.buffer().size());
+    });
+  }
+
+  while (error == usb::errors::SUCCESS && (!end_of_image || in_flight > 0)) {
+    for (std::size_t i = 0; i < transfers.size() && !end_of_image; i++) {
+      if (transfers[i].in_flight())
+        continue;
+      auto &buffer = buffers[i];
+      buffer.resize(fast_transfer_size);
+      buffer.resize(source.read(buffer));
+      if (buffer.empty()) {
+        end_of_image = true;
+        break;
+      }
+      ep.async_bulk_write(
+          transfers[i],
+          gsl::span(reinterpret_cast<const uint8_t *>(buffer.data()),
+                    buffer.size()),
+          1000ms);
+      in_flight++;
+    }
+    if (in_flight > 0)
+      intf.owning_context().handle_events(1000ms);
+  }
+  if (error != usb::errors::SUCCESS)
+    throw usb::usb_error(error);
+
+  control_command(intf, commands::fpga_fast_finish);
+}
+
+// control transfers are synchronous, read the next chunk from a separate
+// thread while the current one is sent
+static void upload_ep0(usb::interface &intf, upload_source &source,
+                       progress_reporter &progress) {
+  using namespace std::literals::chrono_literals;
+  control_command(intf, commands::fpga_reset);
+
+  std::vector<char> current(ep0_read_ahead);
+  std::vector<char> next(ep0_read_ahead);
+  current.resize(source.read(current));
+  while (!current.empty()) {
+    auto read_ahead = std::async(std::launch::async, [&] {
+      next.resize(ep0_read_ahead);
+      next.resize(source.read(next));
+    });
+    utils::in_chunks<const char>(
+        current, ep0_transaction_size, [&](auto chunk) {
+          auto sent{intf.control_write(
+              usb::type::vendor, usb::recipient::device,
+              static_cast<uint8_t>(commands::fpga_send), 0, 0,
+              gsl::span((uint8_t *)chunk.data(), chunk.size()), 1000ms)};
+          if (sent != chunk.size())
+            throw ztex_error("Error transferring bitstream");
+          progress.add(chunk.size());
+        });
+    read_ahead.get();
+    std::swap(current, next);
+  }
+}
+
+void upload_bitstream(usb::interface &intf, dev_info &info,
+                      std::filesystem::path bitstream_location,
+                      spinaltap::progress_handler on_progress) {
+  // the fast configuration endpoint might belong to another interface,
+  // which the caller would have to claim
+  if (info.fast_config_ep != 0 && info.fast_config_if == intf.number()) {
+    try {
+      upload_source source{bitstream_location};
+      progress_reporter progress{source.size(), on_progress};
+      upload_fast(intf, info, source, progress);
+      if (is_fpga_configured(intf)) {
+        log_throughput(progress.current());
+        return;
+      }
+      usb::logging::logger->warn("FPGA not configured after fast "
+                                 "configuration, retrying via EP0");
+    } catch (const usb::usb_error &e) {
+      usb::logging::logger->warn("fast configuration failed ({}), "
+                                 "retrying via EP0",
+                                 e.what());
+    }
+  }
 
+  upload_source source{bitstream_location};
+  progress_reporter progress{source.size(), std::move(on_progress)};
+  upload_ep0(intf, source, progress);
   if (!is_fpga_configured(intf))
     throw ztex_error("FPGA not configured after bitstream download");
+  log_throughput(progress.current());
 }
 
 uint8_t ctrl_gpio(usb::interface &intf, uint8_t mask, uint8_t value) {
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "libusb++/device_registry.hpp"
 #include "libusb++/libusb++.hpp"
+#include "spinaltap/bitstream.hpp"
 
 #include <string>
 #include <filesystem>
@@ -21,10 +23,14 @@ struct dev_info {
 };
 
 [[nodiscard]] std::string device_info_string(const usb::device &dev);
+// strings are only read once per device
+[[nodiscard]] std::string device_info_string(const usb::cached_device &dev);
 [[nodiscard]] dev_info device_info(usb::interface &intf);
 [[nodiscard]] bool is_fpga_configured(usb::interface &intf);
+// progress is reported from the calling thread after every transfer
 void upload_bitstream(usb::interface &intf, dev_info &info,
-                      std::filesystem::path bitstream_location);
+                      std::filesystem::path bitstream_location,
+                      spinaltap::progress_handler on_progress = {});
 uint8_t ctrl_gpio(usb::interface &intf, uint8_t mask, uint8_t value);
 void reset_fpga(usb::interface &intf, bool leave);
 